@@ -0,0 +1,138 @@
+/// affinity.hpp
+/// Purpose: Place worker threads on cores and NUMA nodes, so each worker's buffers stay in memory local to it.
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+// Defined by the build when libnuma is found
+#ifdef VESSEL_HAVE_NUMA
+#include <numa.h>
+#endif
+
+/// @brief Whether this build links libnuma and the kernel supports its memory policies
+inline bool libnuma_available() {
+#ifdef VESSEL_HAVE_NUMA
+    return numa_available() >= 0;
+#else
+    return false;
+#endif
+}
+
+/// @brief Core and NUMA node a worker thread is bound to
+struct Placement {
+    int cpu;
+    int node;
+};
+
+/// @brief CPUs this process may run on, grouped by NUMA node
+/// @note Read from the affinity mask the process was started with and `/sys/devices/system/node`, so
+///       `taskset` and cgroup CPU sets are honoured. Without NUMA information every CPU is on node 0.
+class CpuTopology {
+public:
+    CpuTopology() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+
+        std::vector<bool> assigned(CPU_SETSIZE, false);
+        std::error_code ec;
+        std::vector<std::pair<int, std::vector<int>>> nodes;
+        for (std::filesystem::directory_iterator it("/sys/devices/system/node", ec), end; !ec && it != end; it.increment(ec)) {
+            auto const name = it->path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4
+                || !std::all_of(name.begin() + 4, name.end(), [](unsigned char c) { return std::isdigit(c); })) continue;
+            std::ifstream file(it->path() / "cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (auto cpu : parse_cpu_list(list)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && !assigned[cpu]) {
+                    assigned[cpu] = true;
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) nodes.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+        }
+        std::vector<int> unassigned;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && !assigned[cpu]) unassigned.push_back(cpu);
+        }
+        if (!unassigned.empty()) {
+            if (nodes.empty()) nodes.emplace_back(0, std::move(unassigned));
+            else nodes.front().second.insert(nodes.front().second.end(), unassigned.begin(), unassigned.end());
+        }
+        std::sort(nodes.begin(), nodes.end());
+        for (auto& [node, cpus] : nodes) {
+            std::sort(cpus.begin(), cpus.end());
+            node_ids_.push_back(node);
+            node_cpus_.push_back(std::move(cpus));
+        }
+    }
+
+    /// @brief Number of CPUs the process may use, at least 1
+    int cpu_count() const {
+        size_t count = 0;
+        for (auto const& cpus : node_cpus_) count += cpus.size();
+        return std::max<int>(1, static_cast<int>(count));
+    }
+
+    /// @brief Number of NUMA nodes with a usable CPU
+    int node_count() const { return static_cast<int>(node_cpus_.size()); }
+
+    /// @brief Where worker `index` runs: workers alternate between nodes, then take the next core of their node
+    /// @note Spreading over the nodes first gives every socket's memory controllers work as soon as there
+    ///       are two workers. With more workers than CPUs, placements wrap around.
+    Placement place(int index) const {
+        if (node_cpus_.empty()) return Placement{-1, -1};
+        auto const node = index % node_count();
+        auto const& cpus = node_cpus_[node];
+        return Placement{cpus[(index / node_count()) % cpus.size()], node_ids_[node]};
+    }
+
+    /// @brief Expand a kernel CPU list such as "0-3,8,10-11"
+    static std::vector<int> parse_cpu_list(std::string const& list) {
+        std::vector<int> cpus;
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            char* end = nullptr;
+            long const first = std::strtol(range.c_str(), &end, 10);
+            if (end == range.c_str()) continue;
+            long const last = (*end == '-') ? std::strtol(end + 1, nullptr, 10) : first;
+            for (long cpu = first; cpu <= last; cpu++) cpus.push_back(static_cast<int>(cpu));
+        }
+        return cpus;
+    }
+
+private:
+    std::vector<int> node_ids_;
+    std::vector< std::vector<int> > node_cpus_;
+};
+
+/// @brief Bind the calling thread to `placement.cpu` and allocate its memory on `placement.node`
+/// @return `false` if the thread could not be bound
+/// @note Call before the thread touches its buffers. The kernel places a page on the node of the thread
+///       that first writes it, so a bound thread gets local buffers even without libnuma; with libnuma the
+///       thread's policy prefers its node explicitly, which also holds when the process was started with
+///       another default policy, e.g. under `numactl --interleave`.
+inline bool pin_current_thread(Placement placement) {
+    if (placement.cpu < 0) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(placement.cpu, &set);
+    bool const pinned = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#ifdef VESSEL_HAVE_NUMA
+    if (pinned && libnuma_available()) numa_set_preferred(placement.node);
+#endif
+    return pinned;
+}
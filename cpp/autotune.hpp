@@ -0,0 +1,244 @@
+/// autotune.hpp
+/// Purpose: Pick the fastest implementation of each stage on this host, and remember the choice per host.
+
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <opencv2/core.hpp>
+
+#include "extract_arteries.hpp"
+#include "profiler.hpp"
+
+/// @brief What `autotune()` chooses; none of it changes the mask
+struct TunedSettings {
+    StageKernels kernels;
+    Backend backend = Backend::cpu;
+    /// Side of the tiles of `ExtractArteries::set_tile_size()`, 0 for whole frames
+    int tile_size = 0;
+};
+
+/// @brief Settings as one line of `key=value` words, as stored in the profile file
+/// @note The morphology and median kernels are left out when they are the defaults, which is also what
+///       `autotune()` keeps when the paths it will run do not use them.
+inline std::string to_string(TunedSettings const& settings) {
+    StageKernels const defaults;
+    std::string line;
+    if (settings.kernels.morphology != defaults.morphology) {
+        line += std::string("morphology=") + morphology_kernel_name(settings.kernels.morphology) + " ";
+    }
+    if (settings.kernels.median != defaults.median) {
+        line += std::string("median=") + median_kernel_name(settings.kernels.median) + " ";
+    }
+    return line + "blobs=" + blob_kernel_name(settings.kernels.blobs)
+        + " backend=" + backend_name(settings.backend)
+        + " tile=" + std::to_string(settings.tile_size);
+}
+
+/// @brief Parse what `to_string()` wrote
+/// @return `std::nullopt` if a word is unknown, or the blobs, backend, or tile word is missing
+inline std::optional<TunedSettings> parse_settings(std::string const& line) {
+    TunedSettings settings;
+    int found = 0, required = 0;
+    std::istringstream in(line);
+    std::string word;
+    auto pick = [](std::string const& value, int n, auto name, auto& out) {
+        for (int i = 0; i < n; i++) {
+            using Enum = std::decay_t<decltype(out)>;
+            if (value == name(static_cast<Enum>(i))) {
+                out = static_cast<Enum>(i);
+                return true;
+            }
+        }
+        return false;
+    };
+    while (in >> word) {
+        auto const eq = word.find('=');
+        if (eq == std::string::npos) return std::nullopt;
+        auto const key = word.substr(0, eq), value = word.substr(eq + 1);
+        bool ok;
+        if (key == "morphology") ok = pick(value, 2, morphology_kernel_name, settings.kernels.morphology);
+        else if (key == "median") ok = pick(value, 2, median_kernel_name, settings.kernels.median);
+        else if (key == "blobs") ok = pick(value, 2, blob_kernel_name, settings.kernels.blobs);
+        else if (key == "backend") ok = pick(value, 3, backend_name, settings.backend);
+        else if (key == "tile") ok = (std::istringstream(value) >> settings.tile_size) && settings.tile_size >= 0;
+        else return std::nullopt;
+        if (!ok) return std::nullopt;
+        found++;
+        if (key == "blobs" || key == "backend" || key == "tile") required++;
+    }
+    // a backend that was tuned elsewhere, or has lost its device, is not usable here
+    if (required != 3 || found > 5 || !backend_available(settings.backend)) return std::nullopt;
+    return settings;
+}
+
+/// @brief Whether `ex` with `settings` but on `backend` segments `sample` exactly as it does on the CPU
+/// @note Leaves `ex` on the CPU.
+inline bool same_mask(ExtractArteries& ex, cv::Mat const& sample, TunedSettings const& settings, Backend backend) {
+    ex.set_kernels(settings.kernels);
+    ex.set_tile_size(settings.tile_size);
+    if (ex.backend() != Backend::cpu) ex.set_backend(Backend::cpu);
+    cv::Mat expected, mask;
+    ex.extract(sample, expected);
+    ex.set_backend(backend);
+    ex.extract(sample, mask);
+    ex.set_backend(Backend::cpu);
+    return mask.size() == expected.size() && mask.type() == expected.type()
+        && cv::norm(mask, expected, cv::NORM_INF) == 0;
+}
+
+/// @brief Time `ex` on `sample` and pick, one stage at a time, the implementation with the lowest median time
+/// @param ex Extractor with its configuration and luminance set; left configured with the choice
+/// @param sample Decoded image representative of the workload, since the winner depends on the image size
+/// @param repetitions Timed runs per candidate, after one untimed warm-up run
+/// @note Backends and then tile sizes are compared on the whole `extract()`, then kernels on the time of
+///       their own stage; the median kernels on median plus threshold, since the fused one also counts Otsu's
+///       histogram. The morphology and median kernels are tuned only for whole frames on the CPU without
+///       `set_micro_batch()`, the one path that runs them; otherwise they keep their defaults. Only exact
+///       alternatives are candidates: OpenCV holds its OpenCL kernels only to a tolerance of the CPU ones,
+///       so OpenCL competes only if its mask of `sample` is the CPU's bit for bit, and CUDA, whose border
+///       handling differs, never does.
+inline TunedSettings autotune(ExtractArteries& ex, cv::Mat const& sample, int repetitions = 5) {
+    TunedSettings best;
+    auto measure = [&](TunedSettings const& candidate, std::vector<Stage> const& stages) {
+        ex.set_kernels(candidate.kernels);
+        if (ex.backend() != candidate.backend) ex.set_backend(candidate.backend);
+        ex.set_tile_size(candidate.tile_size);
+        Profiler profiler;
+        cv::Mat mask;
+        ex.set_profiler(nullptr);
+        ex.extract(sample, mask);
+        ex.set_profiler(&profiler);
+        for (int i = 0; i < repetitions; i++) ex.extract(sample, mask);
+        ex.set_profiler(nullptr);
+        double seconds = 0;
+        for (auto stage : stages) seconds += profiler.summary(stage).p50;
+        return seconds;
+    };
+    // one setting at a time, the others held at the best found so far
+    auto tune = [&](auto const& candidates, std::vector<Stage> const& stages, auto&& assign) {
+        double best_seconds = -1;
+        TunedSettings winner = best;
+        for (auto candidate : candidates) {
+            auto trial = best;
+            assign(trial, candidate);
+            auto const seconds = measure(trial, stages);
+            if (best_seconds < 0 || seconds < best_seconds) {
+                best_seconds = seconds;
+                winner = trial;
+            }
+        }
+        best = winner;
+    };
+
+    std::vector<Backend> backends{Backend::cpu};
+    if (backend_available(Backend::opencl) && same_mask(ex, sample, best, Backend::opencl)) {
+        backends.push_back(Backend::opencl);
+    }
+    tune(backends, {Stage::extract}, [](TunedSettings& s, Backend backend) { s.backend = backend; });
+    if (best.backend == Backend::cpu) {
+        std::vector<int> tiles{0};
+        for (int tile : {128, 256, 512}) {
+            if (sample.cols > tile || sample.rows > tile) tiles.push_back(tile);
+        }
+        tune(tiles, {Stage::extract}, [](TunedSettings& s, int tile) { s.tile_size = tile; });
+    }
+    // tiles, stacks, and devices run the van Herk cascade and the fused median whatever is chosen
+    if (best.backend == Backend::cpu && best.tile_size == 0 && ex.micro_batch() == 1) {
+        tune(std::vector{MorphologyKernel::van_herk, MorphologyKernel::opencv}, {Stage::large_arteries},
+            [](TunedSettings& s, MorphologyKernel kernel) { s.kernels.morphology = kernel; });
+        tune(std::vector{MedianKernel::fused, MedianKernel::opencv}, {Stage::median, Stage::threshold},
+            [](TunedSettings& s, MedianKernel kernel) { s.kernels.median = kernel; });
+    }
+    tune(std::vector{BlobKernel::labeling, BlobKernel::stats}, {Stage::remove_blobs},
+        [](TunedSettings& s, BlobKernel kernel) { s.kernels.blobs = kernel; });
+
+    ex.set_kernels(best.kernels);
+    if (ex.backend() != best.backend) ex.set_backend(best.backend);
+    ex.set_tile_size(best.tile_size);
+    return best;
+}
+
+/// @brief Settings tuned on earlier runs, one line per host, thread count, image size, and pipeline parameters
+/// @note A line is `<key>\t<settings>`; lines of other keys are kept when one is stored, so a profile in a
+///       shared home directory serves every host that uses it.
+class TuneProfile {
+public:
+    /// @param path Profile file; need not exist yet
+    explicit TuneProfile(std::filesystem::path path) : path_{std::move(path)} {}
+
+    /// @brief Default location: `$XDG_CACHE_HOME/vessel_segmentation/autotune`, else under `$HOME/.cache`
+    static std::filesystem::path default_path() {
+        if (auto const* cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+            return std::filesystem::path(cache) / "vessel_segmentation" / "autotune";
+        }
+        auto const* home = std::getenv("HOME");
+        return std::filesystem::path(home ? home : ".") / ".cache" / "vessel_segmentation" / "autotune";
+    }
+
+    /// @brief Key of the settings for `sample` with the extractor's parameters on this host
+    /// @param threads Threads segmenting at once, since they compete for the same cores and memory
+    /// @note The micro-batch is part of the key, since stacks do not use the tuned kernels.
+    static std::string key(ExtractArteries const& ex, cv::Size sample, int threads) {
+        char host[256] = {};
+        ::gethostname(host, sizeof(host) - 1);
+        std::ostringstream key;
+        key << "host=" << host << " threads=" << threads << " size=" << sample.width << "x" << sample.height
+            << " micro_batch=" << ex.micro_batch() << " " << parameters_without_backend(ex);
+        return key.str();
+    }
+
+    /// @brief Settings stored under `key`, if any
+    std::optional<TunedSettings> find(std::string const& key) const {
+        std::ifstream file(path_);
+        std::string line;
+        while (std::getline(file, line)) {
+            auto const tab = line.find('\t');
+            if (tab != std::string::npos && line.compare(0, tab, key) == 0 && tab == key.size()) {
+                return parse_settings(line.substr(tab + 1));
+            }
+        }
+        return std::nullopt;
+    }
+
+    /// @brief Store `settings` under `key`, replacing an earlier entry
+    /// @return `false` if the file could not be written
+    bool store(std::string const& key, TunedSettings const& settings) const {
+        std::vector<std::string> lines;
+        {
+            std::ifstream file(path_);
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.compare(0, key.size() + 1, key + "\t") != 0) lines.push_back(line);
+            }
+        }
+        lines.push_back(key + "\t" + to_string(settings));
+        std::error_code ec;
+        if (path_.has_parent_path()) std::filesystem::create_directories(path_.parent_path(), ec);
+        // written aside and renamed, so a concurrent reader sees the old or the new profile
+        auto const temporary = path_.string() + ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream out(temporary);
+            for (auto const& line : lines) out << line << '\n';
+            if (!out) return false;
+        }
+        std::filesystem::rename(temporary, path_, ec);
+        return !ec;
+    }
+
+private:
+    /// @brief `ExtractArteries::parameters()` without the backend, which is one of the tuned settings
+    static std::string parameters_without_backend(ExtractArteries const& ex) {
+        auto parameters = ex.parameters();
+        auto const at = parameters.find(" backend=");
+        if (at != std::string::npos) parameters.erase(at);
+        return parameters;
+    }
+
+    std::filesystem::path path_;
+};
@@ -0,0 +1,284 @@
+/// band_stream.hpp
+/// Purpose: Pieces of `ExtractArteries::extract_stream()`, which segments an image a band of rows at a time:
+/// row sources and sinks, spill files for the intermediates, sliding windows of rows, and blob areas across bands.
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+/// @brief Image delivered top to bottom, a few rows at a time
+class RowSource {
+public:
+    virtual ~RowSource() = default;
+
+    /// @brief Size of the whole image, known before any row is read
+    virtual cv::Size size() const = 0;
+
+    /// @brief Next rows, BGR CV_8UC3 as `cv::imread` decodes them, of `size().width`
+    /// @param rows Receives at least one row, valid until the next call
+    /// @return `false` at the end of the image or on error, see `error()`
+    virtual bool read(cv::Mat& rows) = 0;
+
+    /// @brief Reason reading stopped before the last row, empty otherwise
+    virtual std::string const& error() const = 0;
+};
+
+/// @brief Image written top to bottom, a few rows at a time
+class RowSink {
+public:
+    virtual ~RowSink() = default;
+
+    /// @brief Append `rows`, CV_8UC1 mask rows of the image width
+    /// @return `false` on error, see `error()`
+    virtual bool write(cv::Mat const& rows) = 0;
+
+    /// @brief Complete the image once every row was written
+    virtual bool close() = 0;
+
+    virtual std::string const& error() const = 0;
+};
+
+/// @brief Unnamed temporary file of CV_8UC1 rows, written in order and read back by row
+/// @note The file is unlinked at once, so it disappears with the process however it ends. Rows read back
+///       are dropped from the page cache, since each is read once per pass; the cache would otherwise grow
+///       towards the size of the whole image and count against the memory limit of a container.
+class SpillFile {
+public:
+    /// @param directory Where the file is created, empty for `std::filesystem::temp_directory_path()`; a local
+    ///        disk rather than a RAM-backed `/tmp`, whose pages would count as memory again
+    /// @param width Pixels per row
+    SpillFile(std::string const& directory, int width) : row_bytes_{size_t(width)} {
+        std::error_code ec;
+        auto const base = directory.empty() ? std::filesystem::temp_directory_path(ec).string() : directory;
+        std::string name = (base.empty() ? std::string(".") : base) + "/vessel_spill_XXXXXX";
+        fd_ = ::mkstemp(name.data());
+        if (fd_ < 0) {
+            error_ = name + ": " + std::strerror(errno);
+            return;
+        }
+        ::unlink(name.c_str());
+    }
+
+    ~SpillFile() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    SpillFile(SpillFile const&) = delete;
+    SpillFile& operator=(SpillFile const&) = delete;
+
+    /// @brief Reason the file could not be created, written, or read; empty while it works
+    std::string const& error() const { return error_; }
+
+    /// @brief Append `rows`, the next rows of the image
+    bool write(cv::Mat const& rows) {
+        CV_Assert(rows.type() == CV_8UC1 && size_t(rows.cols) == row_bytes_);
+        for (int y = 0; y < rows.rows && error_.empty(); y++) {
+            transfer(::pwrite, const_cast<uchar*>(rows.ptr<uchar>(y)), offset(rows_ + y));
+        }
+        rows_ += rows.rows;
+        return error_.empty();
+    }
+
+    /// @brief Read rows `y` to `y + rows.rows` into `rows`, which must be sized
+    bool read(int y, cv::Mat& rows) {
+        CV_Assert(rows.type() == CV_8UC1 && size_t(rows.cols) == row_bytes_ && y >= 0 && y + rows.rows <= rows_);
+        if (rows.isContinuous()) {
+            transfer(::pread, rows.data, offset(y), row_bytes_ * rows.rows);
+        } else {
+            for (int r = 0; r < rows.rows && error_.empty(); r++) transfer(::pread, rows.ptr<uchar>(r), offset(y + r));
+        }
+        if (error_.empty()) ::posix_fadvise(fd_, offset(y), row_bytes_ * rows.rows, POSIX_FADV_DONTNEED);
+        return error_.empty();
+    }
+
+private:
+    off_t offset(int y) const { return off_t(y) * off_t(row_bytes_); }
+
+    /// @brief `pread` or `pwrite` `bytes` (one row by default) at `at`, resuming after short transfers
+    template <typename Io>
+    void transfer(Io io, uchar* data, off_t at, size_t bytes = 0) {
+        if (!bytes) bytes = row_bytes_;
+        while (bytes && error_.empty()) {
+            auto const n = io(fd_, data, bytes, at);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                error_ = n < 0 ? std::string("spill file: ") + std::strerror(errno) : "spill file: unexpected end";
+                return;
+            }
+            data += n;
+            at += n;
+            bytes -= n;
+        }
+    }
+
+    int fd_ = -1;
+    size_t row_bytes_;
+    int rows_ = 0;
+    std::string error_;
+};
+
+/// @brief Consecutive rows of a frame, produced a band at a time and kept while later rows still read them
+/// @note A stage that reads `halo` rows around each output row asks for the rows of its band grown by the halo;
+///       rows it asked for before are kept rather than produced again, and rows above the request are
+///       dropped. Bands are always produced whole, `band` rows from a multiple of `band`, so a producer
+///       sees the same bands whatever halo its reader needs. The buffer holds `halo + band` rows plus
+///       however many bands the lower halo reaches into.
+class BandWindow {
+public:
+    /// @param frame Size of the frame the rows belong to
+    /// @param band Rows produced at a time
+    /// @param halo Rows read above and below a band
+    /// @param type Type of the rows
+    BandWindow(cv::Size frame, int band, int halo, int type)
+    :
+    frame_{frame},
+    band_{band},
+    buffer_(halo + band * (1 + (halo + band - 1) / band), frame.width, type)
+    {}
+
+    /// @brief Rows `first` to `last` of the frame, after producing the bands they reach into
+    /// @param produce Called as `produce(rows, y)` to fill `rows` with the band of the frame starting at row `y`
+    /// @return View of the window, valid until the next call; requests must not move up the frame
+    template <typename Produce>
+    cv::Mat rows(int first, int last, Produce&& produce) {
+        CV_Assert(first >= first_ && first <= last && last <= frame_.height);
+        // drop the rows above the request, keeping those produced that it still reaches
+        int const keep_from = std::min(first, produced_);
+        if (keep_from > first_) {
+            int const kept = produced_ - keep_from;
+            if (kept > 0) {
+                auto const row_bytes = buffer_.step[0];
+                std::memmove(buffer_.data, buffer_.ptr(keep_from - first_), kept * row_bytes);
+            }
+            first_ = keep_from;
+        }
+        while (produced_ < last) {
+            int const rows = std::min(band_, frame_.height - produced_);
+            CV_Assert(produced_ - first_ + rows <= buffer_.rows);
+            cv::Mat band = buffer_.rowRange(produced_ - first_, produced_ - first_ + rows);
+            produce(band, produced_);
+            produced_ += rows;
+        }
+        return buffer_.rowRange(first - first_, last - first_);
+    }
+
+private:
+    cv::Size frame_;
+    int band_;
+    cv::Mat buffer_;
+    /// Frame row held by the first buffer row
+    int first_ = 0;
+    /// Frame rows produced so far
+    int produced_ = 0;
+};
+
+/// @brief 8-connected blobs of a binary image seen one band at a time, and which of them are large enough
+/// @note Each band is labelled on its own and its labels numbered after those of the bands above. Blobs of the
+///       first row of a band that touch blobs of the last row of the band above are merged in a union-find
+///       forest, which sums areas across bands. Once every band was added, `finish()` decides per label, and
+///       a second pass over the same bands maps each through `clean()`. Memory is that of one band plus
+///       a few bytes per label.
+class BandBlobs {
+public:
+    /// @brief Label `binary`, the next band, and merge its blobs with those of the band above
+    void add(cv::Mat const& binary) {
+        CV_Assert(binary.type() == CV_8UC1 && keep_.empty());
+        int const count = cv::connectedComponents(binary, labels_, 8, CV_32S);
+        int const base = static_cast<int>(parent_.size()) - 1;
+        band_labels_.push_back(count);
+        parent_.resize(parent_.size() + count - 1);
+        area_.resize(parent_.size(), 0);
+        std::iota(parent_.begin() + base + 1, parent_.end(), base + 1);
+        for (int y = 0; y < labels_.rows; y++) {
+            auto const* label = labels_.ptr<int>(y);
+            for (int x = 0; x < labels_.cols; x++) {
+                if (label[x]) area_[base + label[x]]++;
+            }
+        }
+        auto const* first = labels_.ptr<int>(0);
+        if (!above_.empty()) {
+            int const width = labels_.cols;
+            for (int x = 0; x < width; x++) {
+                if (!first[x]) continue;
+                for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, width - 1); dx++) {
+                    if (above_[dx]) unite(base + first[x], above_[dx]);
+                }
+            }
+        }
+        auto const* last = labels_.ptr<int>(labels_.rows - 1);
+        above_.resize(labels_.cols);
+        for (int x = 0; x < labels_.cols; x++) above_[x] = last[x] ? base + last[x] : 0;
+    }
+
+    /// @brief Decide, for every label, whether its blob has at least `min_area` pixels
+    void finish(int min_area) {
+        for (size_t i = 1; i < parent_.size(); i++) {
+            auto const root = find(static_cast<int>(i));
+            if (root != static_cast<int>(i)) area_[root] += area_[i];
+        }
+        keep_.assign(parent_.size(), 0);
+        for (size_t i = 1; i < parent_.size(); i++) keep_[i] = area_[find(static_cast<int>(i))] >= min_area ? 255 : 0;
+        // only the decisions are needed from here on
+        std::vector<int>().swap(parent_);
+        std::vector<int>().swap(area_);
+        std::vector<int>().swap(above_);
+    }
+
+    /// @brief Clear the small blobs of the next band of the second pass
+    /// @param binary The band `add()` saw in the same place
+    /// @param cleaned Receives `binary` with the blobs of fewer than `min_area` pixels removed; may alias `binary`
+    void clean(cv::Mat const& binary, cv::Mat& cleaned) {
+        CV_Assert(!keep_.empty() && next_band_ < band_labels_.size());
+        int const count = cv::connectedComponents(binary, labels_, 8, CV_32S);
+        // labelling is deterministic, a band labelled again gets the labels it got the first time
+        CV_Assert(count == band_labels_[next_band_]);
+        cleaned.create(binary.size(), CV_8UC1);
+        auto const* keep = keep_.data() + base_;
+        for (int y = 0; y < labels_.rows; y++) {
+            auto const* label = labels_.ptr<int>(y);
+            auto* out = cleaned.ptr<uchar>(y);
+            for (int x = 0; x < labels_.cols; x++) out[x] = label[x] ? keep[label[x]] : 0;
+        }
+        base_ += count - 1;
+        next_band_++;
+    }
+
+private:
+    int find(int label) {
+        while (parent_[label] != label) {
+            parent_[label] = parent_[parent_[label]];
+            label = parent_[label];
+        }
+        return label;
+    }
+
+    void unite(int a, int b) {
+        a = find(a);
+        b = find(b);
+        // the older label becomes the root, so roots stay in bands already seen
+        if (a != b) parent_[std::max(a, b)] = std::min(a, b);
+    }
+
+    cv::Mat labels_;
+    /// Union-find forest over the labels of every band, 0 for the background, and the area under each label
+    std::vector<int> parent_{0};
+    std::vector<int> area_{0};
+    /// Labels of the last row of the band above
+    std::vector<int> above_;
+    /// Number of labels of each band, the background included
+    std::vector<int> band_labels_;
+    std::vector<uchar> keep_;
+    size_t next_band_ = 0;
+    int base_ = 0;
+};
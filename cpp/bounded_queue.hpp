@@ -0,0 +1,86 @@
+/// bounded_queue.hpp
+/// Purpose: Blocking FIFO with a fixed capacity, used to connect pipeline stages.
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+/// @brief Multi-producer, multi-consumer queue that blocks producers when full
+/// @note `close()` wakes every waiter; `pop()` drains remaining items before returning `std::nullopt`
+template <typename T>
+class BoundedQueue {
+public:
+    /// @param capacity Maximum number of queued items before `push()` blocks
+    explicit BoundedQueue(size_t capacity)
+    :
+    capacity_{capacity ? capacity : 1}
+    {}
+
+    /// @brief Append an item, waiting while the queue is full
+    /// @return `false` if the queue was closed and the item was dropped
+    bool push(T item) {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /// @brief Remove the oldest item, waiting while the queue is empty
+    /// @return The item, or `std::nullopt` once the queue is closed and drained
+    std::optional<T> pop() {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return std::nullopt;
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    /// @brief Remove up to `max_items` of the oldest items, waiting while the queue is empty
+    /// @param items Receives the items, replacing its previous contents
+    /// @return `false` once the queue is closed and drained
+    /// @note Never waits for more than one item, so a batch is whatever has queued up meanwhile.
+    bool pop_some(size_t max_items, std::vector<T>& items) {
+        items.clear();
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        while (!items_.empty() && items.size() < std::max<size_t>(max_items, 1)) {
+            items.push_back(std::move(items_.front()));
+            items_.pop_front();
+        }
+        not_full_.notify_all();
+        return !items.empty();
+    }
+
+    /// @brief Signal that no more items will be pushed
+    void close() {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    /// @brief Items waiting now, e.g. for a gauge; stale as soon as it returns
+    size_t size() const {
+        std::lock_guard lock(mutex_);
+        return items_.size();
+    }
+
+private:
+    size_t const capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    mutable std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
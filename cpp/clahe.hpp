@@ -0,0 +1,189 @@
+/// clahe.hpp
+/// Purpose: CLAHE split into building the tile lookup tables and mapping through them, so tables
+/// computed on one frame can map the frames that follow.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/// @brief Tile lookup tables of `cv::CLAHE` on 8-bit images, kept between calls
+/// @note Follows OpenCV's implementation: frames whose size is not a multiple of the grid are padded
+///       with `BORDER_REFLECT_101` (a full tile row or column when only the other side is uneven, as
+///       OpenCV does), histograms are clipped at `clip_limit * tile area / 256` with the excess spread
+///       evenly and the residual on every n-th bin, and each pixel blends the tables of the four nearest
+///       tile centres bilinearly, in the float expression OpenCV uses. `compute()` then `apply()` on one
+///       image gives exactly what `cv::CLAHE::apply()` gives; the `clahe_lut` case of vessel_test checks it.
+class ClaheLut {
+public:
+    /// @param tiles Grid of tiles, `cv::createCLAHE`'s default 8x8
+    explicit ClaheLut(cv::Size tiles = cv::Size(8, 8)) : tiles_{tiles} {}
+
+    /// @brief Whether no tables were built yet
+    bool empty() const { return !ready_; }
+
+    /// @brief Size of the image the tables were computed for; `apply()` takes images of this size
+    cv::Size frame_size() const { return frame_; }
+
+    /// @brief Build the tables of `src`
+    /// @param src CV_8UC1 image
+    /// @param clip_limit Contrast limit, as `cv::CLAHE::setClipLimit()` takes it; 0 for none
+    void compute(cv::Mat const& src, double clip_limit) {
+        CV_Assert(src.type() == CV_8UC1 && !src.empty());
+        begin(src.size());
+        accumulate(src, 0);
+        finish(clip_limit);
+    }
+
+    /// @brief Start tables for a frame of `frame` size whose rows `accumulate()` then counts band by band
+    /// @note `begin()`, `accumulate()` over every row, then `finish()` build the tables `compute()` builds on
+    ///       the whole frame, holding only one band of it at a time.
+    void begin(cv::Size frame) {
+        CV_Assert(frame.area() > 0);
+        // OpenCV pads with a full tile row or column when only the other side is uneven
+        bool const uneven = frame.width % tiles_.width || frame.height % tiles_.height;
+        padding_ = uneven ? cv::Size(tiles_.width - frame.width % tiles_.width, tiles_.height - frame.height % tiles_.height)
+                          : cv::Size();
+        // every padded row and column mirrors one of the frame
+        CV_Assert(frame.width > padding_.width && frame.height > padding_.height);
+        frame_ = frame;
+        ready_ = false;
+        tile_ = cv::Size((frame.width + padding_.width) / tiles_.width, (frame.height + padding_.height) / tiles_.height);
+        histograms_.assign(size_t(tiles_.area()) * 256, 0);
+    }
+
+    /// @brief Count rows `y` to `y + rows.rows` of the frame into the tile histograms
+    /// @param rows CV_8UC1 rows of the `begin()` frame width
+    /// @note Rows the `BORDER_REFLECT_101` padding mirrors are counted a second time, into the padded tiles.
+    void accumulate(cv::Mat const& rows, int y) {
+        CV_Assert(rows.type() == CV_8UC1 && rows.cols == frame_.width && y >= 0 && y + rows.rows <= frame_.height);
+        int const width = frame_.width, height = frame_.height;
+        // each tile column counts into histograms of its own, so the columns run in parallel
+        cv::parallel_for_(cv::Range(0, tiles_.width), [&](cv::Range const& range) {
+            for (int tx = range.start; tx < range.end; tx++) {
+                int const first = tx * tile_.width;
+                int const last = std::min(first + tile_.width, width);
+                // padded columns of this tile, beyond the frame; small tiles can be entirely padding
+                int const padded_first = std::max(first, width), padded_last = first + tile_.width;
+                for (int r = 0; r < rows.rows; r++) {
+                    auto const* in = rows.ptr<uchar>(r);
+                    auto count = [&](int padded_row) {
+                        auto* hist = &histograms_[(size_t(padded_row / tile_.height) * tiles_.width + tx) * 256];
+                        for (int x = first; x < last; x++) hist[in[x]]++;
+                        // padded column `x` mirrors column `2 * (width - 1) - x`
+                        for (int x = padded_first; x < padded_last; x++) hist[in[2 * (width - 1) - x]]++;
+                    };
+                    int const row = y + r;
+                    count(row);
+                    // likewise padded row `2 * (height - 1) - row` mirrors `row`
+                    if (row >= height - 1 - padding_.height && row <= height - 2) count(2 * (height - 1) - row);
+                }
+            }
+        });
+    }
+
+    /// @brief Clip the histograms counted since `begin()` and turn them into the tables
+    /// @param clip_limit Contrast limit, as `cv::CLAHE::setClipLimit()` takes it; 0 for none
+    void finish(double clip_limit) {
+        int const tile_area = tile_.area();
+        int const limit = clip_limit > 0 ? std::max(static_cast<int>(clip_limit * tile_area / 256), 1) : 0;
+        float const scale = 255.f / tile_area;
+
+        luts_.resize(size_t(tiles_.area()) * 256);
+        cv::parallel_for_(cv::Range(0, tiles_.area()), [&](cv::Range const& range) {
+            for (int k = range.start; k < range.end; k++) {
+                auto* hist = &histograms_[size_t(k) * 256];
+                if (limit > 0) {
+                    int clipped = 0;
+                    for (int i = 0; i < 256; i++) {
+                        if (hist[i] > limit) {
+                            clipped += hist[i] - limit;
+                            hist[i] = limit;
+                        }
+                    }
+                    int const batch = clipped / 256;
+                    int residual = clipped - batch * 256;
+                    for (int i = 0; i < 256; i++) hist[i] += batch;
+                    if (residual) {
+                        int const step = std::max(256 / residual, 1);
+                        for (int i = 0; i < 256 && residual > 0; i += step, residual--) hist[i]++;
+                    }
+                }
+                auto* lut = &luts_[size_t(k) * 256];
+                int sum = 0;
+                for (int i = 0; i < 256; i++) {
+                    sum += hist[i];
+                    lut[i] = cv::saturate_cast<uchar>(sum * scale);
+                }
+            }
+        });
+
+        float const inv_width = 1.f / tile_.width;
+        columns_.resize(frame_.width);
+        for (int x = 0; x < frame_.width; x++) {
+            float const txf = x * inv_width - 0.5f;
+            int const tx = static_cast<int>(std::floor(txf));
+            auto& column = columns_[x];
+            column.weight = txf - tx;
+            column.left = std::max(tx, 0) * 256;
+            column.right = std::min(tx + 1, tiles_.width - 1) * 256;
+        }
+        ready_ = true;
+    }
+
+    /// @brief Map `src` through the tables of the last `compute()`
+    /// @param src CV_8UC1 image of `frame_size()`
+    /// @param dst CV_8UC1 result, reallocated only when its geometry differs; may alias `src`
+    void apply(cv::Mat const& src, cv::Mat& dst) const {
+        CV_Assert(src.size() == frame_);
+        apply_rows(src, 0, dst);
+    }
+
+    /// @brief Map rows `y` to `y + src.rows` of the frame through the tables
+    /// @param src CV_8UC1 rows of `frame_size()` width
+    /// @param dst CV_8UC1 result of `src` size, reallocated only when its geometry differs; may alias `src`
+    void apply_rows(cv::Mat const& src, int y, cv::Mat& dst) const {
+        CV_Assert(!empty() && src.type() == CV_8UC1 && src.cols == frame_.width && y >= 0 && y + src.rows <= frame_.height);
+        dst.create(src.size(), CV_8UC1);
+        float const inv_height = 1.f / tile_.height;
+        cv::parallel_for_(cv::Range(0, src.rows), [&](cv::Range const& range) {
+            for (int r = range.start; r < range.end; r++) {
+                float const tyf = (y + r) * inv_height - 0.5f;
+                int const ty = static_cast<int>(std::floor(tyf));
+                float const ya = tyf - ty, ya1 = 1.f - ya;
+                auto const* top = &luts_[size_t(std::max(ty, 0)) * tiles_.width * 256];
+                auto const* bottom = &luts_[size_t(std::min(ty + 1, tiles_.height - 1)) * tiles_.width * 256];
+                auto const* in = src.ptr<uchar>(r);
+                auto* out = dst.ptr<uchar>(r);
+                for (int x = 0; x < frame_.width; x++) {
+                    auto const& column = columns_[x];
+                    int const left = column.left + in[x], right = column.right + in[x];
+                    float const xa = column.weight, xa1 = 1.f - xa;
+                    float const value = (top[left] * xa1 + top[right] * xa) * ya1
+                        + (bottom[left] * xa1 + bottom[right] * xa) * ya;
+                    out[x] = cv::saturate_cast<uchar>(value);
+                }
+            }
+        });
+    }
+
+private:
+    /// @brief Offsets of the tables left and right of a column within a row of tiles, and the blend weight
+    struct Column {
+        int left;
+        int right;
+        float weight;
+    };
+
+    cv::Size tiles_;
+    cv::Size frame_{};
+    cv::Size padding_{};
+    cv::Size tile_{};
+    bool ready_ = false;
+    std::vector<int> histograms_;
+    std::vector<uchar> luts_;
+    std::vector<Column> columns_;
+};
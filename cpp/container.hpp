@@ -0,0 +1,216 @@
+/// container.hpp
+/// Purpose: One append-only file holding the results of a whole batch, indexed by id for random access.
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mapped_file.hpp"
+#include "mask_codec.hpp"
+
+/////////////////////////
+// Container layout, all integers little endian
+//
+// header:  "VCNT" | u32 version
+// records: encoded results back to back, in the order they were appended
+// index:   per record, u64 offset | u64 size | u8 format | u16 id length | id
+// trailer: u64 index offset | u64 record count | "VIDX"
+//
+// The index is written when the container is closed; reading starts from the trailer at the end of
+// the file. `format` is an `OutputFormat`, so each record decodes like the file `--output` would write.
+
+inline constexpr char container_magic[4] = {'V', 'C', 'N', 'T'};
+inline constexpr char container_index_magic[4] = {'V', 'I', 'D', 'X'};
+inline constexpr uint32_t container_version = 1;
+inline constexpr size_t container_trailer_bytes = 20;
+
+/// @brief Appends results from any thread, then writes the index and syncs once on `close()`
+/// @note One open, one fsync, and one close per batch instead of one per image.
+class ContainerWriter {
+public:
+    /// @param path Container file, replaced if it exists
+    explicit ContainerWriter(std::string const& path) {
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            error_ = path + ": " + std::strerror(errno);
+            return;
+        }
+        std::vector<unsigned char> header(container_magic, container_magic + 4);
+        put(header, container_version, 4);
+        write_all(header);
+    }
+
+    ~ContainerWriter() { close(); }
+
+    ContainerWriter(ContainerWriter const&) = delete;
+    ContainerWriter& operator=(ContainerWriter const&) = delete;
+
+    /// @brief Reason the container could not be written, empty while all is well
+    std::string error() const {
+        std::lock_guard lock(mutex_);
+        return error_;
+    }
+
+    /// @brief Append one record
+    /// @param id Key to look the record up by, e.g. the output path the record replaces
+    /// @param format How `data` is encoded
+    /// @param data Encoded result
+    /// @return `false` if the container could not be written
+    bool append(std::string const& id, OutputFormat format, std::span<unsigned char const> data) {
+        std::lock_guard lock(mutex_);
+        if (fd_ < 0 || id.size() > UINT16_MAX) return false;
+        index_.push_back(Entry{offset_, data.size(), format, id});
+        return write_all(data);
+    }
+
+    /// @brief Write the index and trailer, sync, and close; later appends fail
+    /// @return `false` if any write failed
+    bool close() {
+        std::lock_guard lock(mutex_);
+        if (fd_ < 0) return error_.empty();
+        std::vector<unsigned char> index;
+        for (auto const& e : index_) {
+            put(index, e.offset, 8);
+            put(index, e.size, 8);
+            index.push_back(static_cast<unsigned char>(e.format));
+            put(index, e.id.size(), 2);
+            index.insert(index.end(), e.id.begin(), e.id.end());
+        }
+        put(index, offset_, 8);
+        put(index, index_.size(), 8);
+        index.insert(index.end(), container_index_magic, container_index_magic + 4);
+        write_all(index);
+        if (error_.empty() && ::fsync(fd_) != 0) error_ = std::strerror(errno);
+        ::close(fd_);
+        fd_ = -1;
+        return error_.empty();
+    }
+
+private:
+    struct Entry {
+        uint64_t offset;
+        uint64_t size;
+        OutputFormat format;
+        std::string id;
+    };
+
+    static void put(std::vector<unsigned char>& out, uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; i++) out.push_back((v >> 8*i) & 0xff);
+    }
+
+    /// @brief Write at the end of the file; called with the lock held
+    bool write_all(std::span<unsigned char const> data) {
+        auto const* p = data.data();
+        auto size = data.size();
+        while (size) {
+            auto const n = ::write(fd_, p, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                error_ = std::strerror(errno);
+                ::close(fd_);
+                fd_ = -1;
+                return false;
+            }
+            p += n;
+            size -= n;
+            offset_ += n;
+        }
+        return true;
+    }
+
+    mutable std::mutex mutex_;
+    int fd_ = -1;
+    uint64_t offset_ = 0;
+    std::vector<Entry> index_;
+    std::string error_;
+};
+
+/// @brief Random access to the records of a container through a read-only memory mapping
+/// @note Records are views into the mapping, valid for the lifetime of the reader. When an id was
+///       appended more than once, `find()` returns the last record.
+class ContainerReader {
+public:
+    struct Record {
+        std::string_view id;
+        OutputFormat format;
+        std::span<unsigned char const> data;
+    };
+
+    /// @param path Container written by `ContainerWriter`
+    explicit ContainerReader(std::string const& path) : file_{path, MADV_RANDOM} {
+        error_ = file_.error();
+        if (error_.empty() && !parse()) error_ = path + ": not a complete container";
+        if (!error_.empty()) records_.clear();
+    }
+
+    /// @brief Reason the container could not be read, empty on success
+    std::string const& error() const { return error_; }
+
+    size_t size() const { return records_.size(); }
+
+    /// @brief The `i`-th record in append order
+    Record const& operator[](size_t i) const { return records_[i]; }
+
+    /// @brief Record appended under `id`, or `std::nullopt`
+    std::optional<Record> find(std::string_view id) const {
+        auto const it = by_id_.find(id);
+        if (it == by_id_.end()) return std::nullopt;
+        return records_[it->second];
+    }
+
+private:
+    static uint64_t get(unsigned char const* p, int bytes) {
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; i++) v |= uint64_t(p[i]) << 8*i;
+        return v;
+    }
+
+    bool parse() {
+        auto const* data = file_.data();
+        auto const size = file_.size();
+        if (size < 8 + container_trailer_bytes || std::memcmp(data, container_magic, 4) != 0
+            || get(data + 4, 4) != container_version) return false;
+        auto const* trailer = data + size - container_trailer_bytes;
+        if (std::memcmp(trailer + 16, container_index_magic, 4) != 0) return false;
+        auto const index_offset = get(trailer, 8);
+        auto const count = get(trailer + 8, 8);
+        if (index_offset < 8 || index_offset > size - container_trailer_bytes) return false;
+
+        auto const* p = data + index_offset;
+        auto const* end = trailer;
+        records_.reserve(std::min<uint64_t>(count, (end - p) / 19));
+        for (uint64_t i = 0; i < count; i++) {
+            if (end - p < 19) return false;
+            auto const offset = get(p, 8), length = get(p + 8, 8);
+            auto const format = p[16];
+            auto const id_length = get(p + 17, 2);
+            p += 19;
+            if (uint64_t(end - p) < id_length || offset < 8 || offset > index_offset || length > index_offset - offset
+                || format > static_cast<unsigned char>(OutputFormat::composite)) return false;
+            records_.push_back(Record{
+                std::string_view(reinterpret_cast<char const*>(p), id_length),
+                static_cast<OutputFormat>(format),
+                std::span<unsigned char const>(data + offset, length)});
+            by_id_[records_.back().id] = records_.size() - 1;
+            p += id_length;
+        }
+        return p == end;
+    }
+
+    MappedFile file_;
+    std::string error_;
+    std::vector<Record> records_;
+    std::unordered_map<std::string_view, size_t> by_id_;
+};
@@ -0,0 +1,241 @@
+/// device_backend.hpp
+/// Purpose: Run the image-to-image stages of `ExtractArteries` on an OpenCL or CUDA device.
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+#include <opencv2/imgproc.hpp>
+
+// Defined by the build when OpenCV provides, and the `vessel` library links, cudaarithm, cudafilters, and cudaimgproc
+#ifdef VESSEL_HAVE_CUDA
+#include <opencv2/cudaarithm.hpp>
+#include <opencv2/cudafilters.hpp>
+#include <opencv2/cudaimgproc.hpp>
+#endif
+
+#include "otsu.hpp"
+#include "profiler.hpp"
+
+/// @brief Plane `ExtractArteries::color_filter` enhances: L of Lab, or the green channel common in fundus work
+enum class Luminance { lab, green };
+
+/// @brief Where `ExtractArteries` runs `color_filter` through `threshold`
+enum class Backend { cpu, opencl, cuda };
+
+inline char const* backend_name(Backend backend) {
+    static char const* const names[] = { "cpu", "opencl", "cuda" };
+    return names[static_cast<int>(backend)];
+}
+
+/// @brief Whether `backend` was compiled in and has a usable device on this host
+inline bool backend_available(Backend backend) {
+    switch (backend) {
+    case Backend::cpu:
+        return true;
+    case Backend::opencl:
+        return cv::ocl::haveOpenCL();
+    case Backend::cuda:
+#ifdef VESSEL_HAVE_CUDA
+        return cv::cuda::getCudaEnabledDeviceCount() > 0;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+/// @brief Image-to-image stages of `ExtractArteries` kept resident on a device
+/// @note Only the binary threshold image comes back to the host, for `remove_blobs` and the final median.
+class DeviceStages {
+public:
+    virtual ~DeviceStages() = default;
+
+    /// @brief Run `color_filter`, `large_arteries`, the first median, and `threshold`
+    /// @param test_image Source image on the host, as decoded by `cv::imread`
+    /// @param fov Field of view of `test_image` size, or empty
+    /// @param profiler Receives per-stage times if not `nullptr`; the device is then synchronized after each stage
+    /// @return Binary threshold image on the host, valid until the next call
+    virtual cv::Mat const& segment(cv::Mat const& test_image, cv::Mat const& fov, Profiler* profiler) = 0;
+
+protected:
+    /// @brief Histogram of `image` inside `fov` from its histogram with outside pixels forced to 0
+    /// @param hist Histogram of `min(image, fov)` where `fov` is 0 or 255
+    /// @param outside Number of zero pixels in `fov`
+    static std::array<int, 256> masked_histogram(cv::Mat const& hist, int outside) {
+        std::array<int, 256> result{};
+        cv::Mat counts;
+        hist.reshape(1, 1).convertTo(counts, CV_32S);
+        for (int i = 0; i < 256; i++) result[i] = counts.at<int>(0, i);
+        result[0] -= outside;
+        return result;
+    }
+
+    /// @brief Normalize `fov` to 0/255 and count its outside pixels
+    static int binary_fov(cv::Mat const& fov, cv::Mat& binary) {
+        cv::compare(fov, 0, binary, cv::CMP_NE);
+        return static_cast<int>(fov.total()) - cv::countNonZero(binary);
+    }
+};
+
+/// @brief `DeviceStages` on `cv::UMat`, dispatched to OpenCL by the transparent API
+/// @note OpenCV only holds its OpenCL kernels to a tolerance of the CPU versions, one gray level for CLAHE
+///       and the Lab conversion, so the mask may differ slightly from the CPU path's.
+class OpenCLStages : public DeviceStages {
+public:
+    OpenCLStages(std::vector<cv::Mat> structuring_elements, double clip_limit, int median_size, Luminance luminance)
+    :
+    structuring_elements_{std::move(structuring_elements)},
+    clahe_{cv::createCLAHE(clip_limit)},
+    median_size_{median_size},
+    luminance_{luminance}
+    {
+        cv::ocl::setUseOpenCL(true);
+    }
+
+    cv::Mat const& segment(cv::Mat const& test_image, cv::Mat const& fov, Profiler* profiler) override {
+        // enqueued kernels run asynchronously; only wait when each stage is to be timed
+        auto sync = [&]() { if (profiler) cv::ocl::finish(); };
+        {
+            ScopedTimer timer(profiler, Stage::color_filter);
+            test_image.copyTo(image_);
+            if (luminance_ == Luminance::green) {
+                cv::extractChannel(image_, plane_, 1);
+            } else {
+                // see `ExtractArteries::lab_conversion`
+                cv::cvtColor(image_, lab_, cv::COLOR_RGB2Lab);
+                cv::extractChannel(lab_, plane_, 0);
+            }
+            clahe_->apply(plane_, equalized_);
+            sync();
+        }
+        {
+            ScopedTimer timer(profiler, Stage::large_arteries);
+            equalized_.copyTo(close_);
+            for (auto const& se : structuring_elements_) {
+                cv::morphologyEx(close_, open_, cv::MORPH_OPEN, se);
+                cv::morphologyEx(open_, close_, cv::MORPH_CLOSE, se);
+            }
+            cv::subtract(close_, equalized_, background_removed_);
+            clahe_->apply(background_removed_, large_arteries_);
+            sync();
+        }
+        {
+            ScopedTimer timer(profiler, Stage::median);
+            cv::medianBlur(large_arteries_, median_, median_size_);
+            sync();
+        }
+        ScopedTimer timer(profiler, Stage::threshold);
+        int outside = 0;
+        cv::UMat const* histogram_source = &median_;
+        if (!fov.empty()) {
+            outside = binary_fov(fov, host_fov_);
+            host_fov_.copyTo(fov_);
+            cv::min(median_, fov_, masked_);
+            histogram_source = &masked_;
+        }
+        // the 256-bin histogram is the only thing read back to pick the level
+        cv::calcHist(std::vector<cv::UMat>{*histogram_source}, {0}, cv::noArray(), hist_, {256}, {0, 256});
+        auto const level = otsu_level(masked_histogram(hist_.getMat(cv::ACCESS_READ), outside));
+        cv::threshold(median_, threshold_, level, 255, cv::THRESH_BINARY);
+        if (!fov.empty()) cv::bitwise_and(threshold_, fov_, threshold_);
+        threshold_.copyTo(host_threshold_);
+        return host_threshold_;
+    }
+
+private:
+    std::vector<cv::Mat> structuring_elements_;
+    cv::Ptr<cv::CLAHE> clahe_;
+    int median_size_;
+    Luminance luminance_;
+    cv::UMat image_, lab_, plane_, equalized_;
+    cv::UMat open_, close_, background_removed_, large_arteries_;
+    cv::UMat median_, fov_, masked_, hist_, threshold_;
+    cv::Mat host_fov_, host_threshold_;
+};
+
+#ifdef VESSEL_HAVE_CUDA
+/// @brief `DeviceStages` on `cv::cuda::GpuMat`, all queued on one stream
+/// @note CUDA CLAHE, morphology, and median filters treat the image border differently from
+///       their CPU counterparts, so pixels near the border may differ from the CPU path.
+class CudaStages : public DeviceStages {
+public:
+    CudaStages(std::vector<cv::Mat> const& structuring_elements, double clip_limit, int median_size, Luminance luminance)
+    :
+    luminance_{luminance},
+    clahe_{cv::cuda::createCLAHE(clip_limit)},
+    median_filter_{cv::cuda::createMedianFilter(CV_8UC1, median_size)}
+    {
+        for (auto const& se : structuring_elements) {
+            open_filters_.push_back(cv::cuda::createMorphologyFilter(cv::MORPH_OPEN, CV_8UC1, se));
+            close_filters_.push_back(cv::cuda::createMorphologyFilter(cv::MORPH_CLOSE, CV_8UC1, se));
+        }
+    }
+
+    cv::Mat const& segment(cv::Mat const& test_image, cv::Mat const& fov, Profiler* profiler) override {
+        auto sync = [&]() { if (profiler) stream_.waitForCompletion(); };
+        {
+            ScopedTimer timer(profiler, Stage::color_filter);
+            image_.upload(test_image, stream_);
+            if (luminance_ == Luminance::green) {
+                cv::cuda::split(image_, planes_, stream_);
+            } else {
+                // see `ExtractArteries::lab_conversion`
+                cv::cuda::cvtColor(image_, lab_, cv::COLOR_RGB2Lab, 0, stream_);
+                cv::cuda::split(lab_, planes_, stream_);
+            }
+            clahe_->apply(planes_[luminance_ == Luminance::green ? 1 : 0], equalized_, stream_);
+            sync();
+        }
+        {
+            ScopedTimer timer(profiler, Stage::large_arteries);
+            equalized_.copyTo(close_, stream_);
+            for (size_t i = 0; i < open_filters_.size(); i++) {
+                open_filters_[i]->apply(close_, open_, stream_);
+                close_filters_[i]->apply(open_, close_, stream_);
+            }
+            cv::cuda::subtract(close_, equalized_, background_removed_, cv::noArray(), -1, stream_);
+            clahe_->apply(background_removed_, large_arteries_, stream_);
+            sync();
+        }
+        {
+            ScopedTimer timer(profiler, Stage::median);
+            median_filter_->apply(large_arteries_, median_, stream_);
+            sync();
+        }
+        ScopedTimer timer(profiler, Stage::threshold);
+        int outside = 0;
+        cv::cuda::GpuMat const* histogram_source = &median_;
+        if (!fov.empty()) {
+            outside = binary_fov(fov, host_fov_);
+            fov_.upload(host_fov_, stream_);
+            cv::cuda::min(median_, fov_, masked_, stream_);
+            histogram_source = &masked_;
+        }
+        cv::cuda::calcHist(*histogram_source, hist_, stream_);
+        hist_.download(host_hist_, stream_);
+        stream_.waitForCompletion();
+        auto const level = otsu_level(masked_histogram(host_hist_, outside));
+        cv::cuda::threshold(median_, threshold_, level, 255, cv::THRESH_BINARY, stream_);
+        if (!fov.empty()) cv::cuda::bitwise_and(threshold_, fov_, threshold_, cv::noArray(), stream_);
+        threshold_.download(host_threshold_, stream_);
+        stream_.waitForCompletion();
+        return host_threshold_;
+    }
+
+private:
+    Luminance luminance_;
+    cv::cuda::Stream stream_;
+    cv::Ptr<cv::cuda::CLAHE> clahe_;
+    cv::Ptr<cv::cuda::Filter> median_filter_;
+    std::vector< cv::Ptr<cv::cuda::Filter> > open_filters_, close_filters_;
+    cv::cuda::GpuMat image_, lab_, equalized_;
+    std::vector<cv::cuda::GpuMat> planes_;
+    cv::cuda::GpuMat open_, close_, background_removed_, large_arteries_;
+    cv::cuda::GpuMat median_, fov_, masked_, hist_, threshold_;
+    cv::Mat host_fov_, host_hist_, host_threshold_;
+};
+#endif
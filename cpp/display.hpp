@@ -0,0 +1,18 @@
+/// display.hpp
+/// Purpose: HighGUI display of images, kept out of the `vessel` library.
+
+#pragma once
+
+#include <string>
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+
+inline void show_image(cv::Mat image, std::string const& title) {
+    cv::imshow(title, image);
+    int key = 0;
+
+    while (key != 27 && key !='q' && key != ' ') {
+        key = cv::waitKey(10) & 0xff;
+    }
+    cv::destroyWindow(title);
+}
@@ -0,0 +1,1036 @@
+/// extract_arteries.cpp by Jeff Benshetler, (c) 2023
+/// Purpose: Segment arteries from input image.
+
+#include "extract_arteries.hpp"
+
+#include <algorithm>
+
+ExtractArteries::ExtractArteries(ExtractConfig config)
+:
+config_{std::move(config)},
+cascade_{config_.morph_sizes}
+{
+    CV_Assert(!config_.morph_sizes.empty());
+    CV_Assert(config_.median_size >= 3 && config_.median_size % 2 == 1);
+    for (auto morph_size : config_.morph_sizes ) {
+        CV_Assert(morph_size > 0);
+        auto sz = 2*morph_size + 1;
+        structuringElements_.push_back(
+            cv::getStructuringElement( 
+                cv::MORPH_RECT, 
+                cv::Size(sz,sz),
+                cv::Point(morph_size,morph_size)
+            )
+        );
+    }
+
+    clahe_ = cv::createCLAHE();
+    clahe_->setClipLimit(config_.clip_limit);
+}
+
+void ExtractArteries::set_luminance(Luminance luminance) {
+    luminance_ = luminance;
+    if (device_) set_backend(backend_);
+}
+
+void ExtractArteries::set_pyramid(int factor) {
+    CV_Assert(factor == 1 || factor == 2 || factor == 4);
+    pyramid_factor_ = factor;
+    auto const& sizes = config_.morph_sizes;
+    fine_cascade_ = Cascade({sizes.front()});
+    std::vector<int> coarse;
+    for (size_t i = 1; i < sizes.size(); i++) {
+        coarse.push_back(std::max(1, (sizes[i] + factor/2) / factor));
+    }
+    coarse_cascade_ = Cascade(coarse);
+}
+
+void ExtractArteries::set_micro_batch(int images) {
+    CV_Assert(images >= 1);
+    micro_batch_ = images;
+}
+
+void ExtractArteries::set_backend(Backend backend) {
+    CV_Assert(backend_available(backend));
+    backend_ = backend;
+    device_.reset();
+    if (backend == Backend::opencl) {
+        device_ = std::make_unique<OpenCLStages>(structuringElements_, config_.clip_limit, config_.median_size, luminance_);
+    }
+#ifdef VESSEL_HAVE_CUDA
+    if (backend == Backend::cuda) {
+        device_ = std::make_unique<CudaStages>(structuringElements_, config_.clip_limit, config_.median_size, luminance_);
+    }
+#endif
+}
+
+std::string ExtractArteries::parameters() const {
+    std::string sizes;
+    for (auto size : config_.morph_sizes) sizes += (sizes.empty() ? "" : ",") + std::to_string(size);
+    return std::string("opencv=") + CV_VERSION + " se=" + sizes + " clip=" + std::to_string(config_.clip_limit)
+        + " median=" + std::to_string(config_.median_size) + " min_area=" + std::to_string(config_.min_valid_area)
+        + " luminance=" + (luminance_ == Luminance::green ? "green" : "lab")
+        + " pyramid=" + std::to_string(pyramid_factor_) + " backend=" + backend_name(backend_);
+}
+
+size_t ExtractArteries::allocations() const {
+    auto result = allocations_ + cascade_.allocations() + median_.allocations()
+        + fine_cascade_.allocations() + coarse_cascade_.allocations();
+    std::lock_guard lock(tile_workers_mutex_);
+    for (auto const& worker : idle_tile_workers_) {
+        result += worker->cascade.allocations() + worker->median.allocations();
+    }
+    return result;
+}
+
+cv::Mat ExtractArteries::clahe(cv::Mat image, int channel_index) {
+    cv::Mat channel = image;
+    if (image.channels() > 1) {
+        channel = fit(scratch_.channel, image.size(), CV_8UC1);
+        cv::extractChannel(image, channel, channel_index);
+    }
+    clahe_->apply(channel, fit(scratch_.clahe, image.size(), CV_8UC1));
+    return scratch_.clahe;
+}
+
+cv::Mat& ExtractArteries::luminance_plane(cv::Mat test_image) {
+    auto const size = test_image.size();
+    auto& luminance = fit(scratch_.luminance, size, CV_8UC1);
+    if (luminance_ == Luminance::green) {
+        cv::extractChannel(test_image, luminance, 1);
+    } else {
+        // Lab is converted a strip at a time so the three-channel intermediate stays in cache;
+        // only L is written to memory
+        auto& lab = fit(scratch_.lab, cv::Size(size.width, std::min(lab_strip_rows, size.height)), CV_8UC3);
+        for (int y = 0; y < size.height; y += lab_strip_rows) {
+            int const rows = std::min(lab_strip_rows, size.height - y);
+            cv::Mat lab_strip = lab.rowRange(0, rows);
+            cv::Mat luminance_strip = luminance.rowRange(y, y + rows);
+            cv::cvtColor(test_image.rowRange(y, y + rows), lab_strip, lab_conversion);
+            cv::extractChannel(lab_strip, luminance_strip, 0);
+        }
+    }
+    return luminance;
+}
+
+cv::Mat ExtractArteries::color_filter(cv::Mat test_image) {
+    clahe_->apply(luminance_plane(test_image), fit(scratch_.equalized, test_image.size(), CV_8UC1));
+    return scratch_.equalized;
+}
+
+cv::Mat ExtractArteries::erosion(cv::Mat image, cv::Mat se, int iterations) {
+    cv::Mat result;
+    cv::morphologyEx(image, result, cv::MORPH_OPEN, se, cv::Point(-1,-1), iterations);
+    return result;
+}
+
+cv::Mat ExtractArteries::dilation(cv::Mat image, cv::Mat se, int iterations) {
+    cv::Mat result;
+    cv::morphologyEx(image, result, cv::MORPH_CLOSE, se, cv::Point(-1,-1), iterations);
+    return result;
+}
+
+cv::Mat ExtractArteries::large_arteries(cv::Mat test_image) {
+    // open then close with each of `structuringElements_`, see `large_arteries_reference()`
+    auto& background_removed = fit(scratch_.background_removed, test_image.size(), test_image.type());
+    if (pyramid_factor_ > 1) {
+        auto& close = fit(scratch_.close, test_image.size(), test_image.type());
+        background_pyramid(test_image, close);
+        cv::subtract(close, test_image, background_removed);
+    } else if (kernels_.morphology == MorphologyKernel::opencv) {
+        auto& close = fit(scratch_.close, test_image.size(), test_image.type());
+        auto& open = fit(scratch_.open, test_image.size(), test_image.type());
+        test_image.copyTo(close);
+        for (auto const& se : structuringElements_) {
+            cv::morphologyEx(close, open, cv::MORPH_OPEN, se);
+            cv::morphologyEx(open, close, cv::MORPH_CLOSE, se);
+        }
+        cv::subtract(close, test_image, background_removed);
+    } else {
+        // the last pass of the cascade subtracts as it goes, the background is never stored
+        cascade_.apply_subtract(test_image, cv::Rect(0, 0, test_image.cols, test_image.rows), test_image, background_removed);
+    }
+    return clahe(background_removed);
+}
+
+void ExtractArteries::background_pyramid(cv::Mat const& image, cv::Mat& background) {
+    int const levels = (pyramid_factor_ == 4) ? 2 : 1;
+    scratch_.pyramid.resize(levels + 1);
+    scratch_.upsampled.resize(levels);
+    fine_cascade_.apply(image, fit(scratch_.fine, image.size(), image.type()));
+    scratch_.pyramid[0] = scratch_.fine;
+    for (int l = 1; l <= levels; l++) {
+        auto const& finer = scratch_.pyramid[l-1];
+        auto& coarser = fit(scratch_.pyramid[l], cv::Size((finer.cols + 1)/2, (finer.rows + 1)/2), image.type());
+        cv::pyrDown(finer, coarser, coarser.size());
+    }
+    auto& coarse = fit(scratch_.coarse, scratch_.pyramid[levels].size(), image.type());
+    coarse_cascade_.apply(scratch_.pyramid[levels], coarse);
+    cv::Mat up = coarse;
+    for (int l = levels - 1; l >= 0; l--) {
+        auto& finer = (l == 0) ? background : fit(scratch_.upsampled[l], scratch_.pyramid[l].size(), image.type());
+        cv::pyrUp(up, finer, scratch_.pyramid[l].size());
+        up = finer;
+    }
+}
+
+cv::Mat ExtractArteries::large_arteries_reference(cv::Mat test_image) {
+    cv::Mat close;
+    cv::Mat open;
+    test_image.copyTo(close);
+
+    for (auto const& se : structuringElements_) {
+        open = erosion(close, se);
+        close = dilation(open, se);
+    }
+
+    cv::Mat background_removed;
+    cv::subtract(close, test_image, background_removed);
+    return clahe(background_removed);
+}
+
+cv::Mat ExtractArteries::threshold(cv::Mat image, cv::Mat const& fov) {
+    auto& threshold_img = fit(scratch_.threshold, image.size(), CV_8UC1);
+    if (fov.empty()) {
+        cv::threshold(image, threshold_img, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU) ;
+        return threshold_img;
+    }
+
+    std::array<int, 256> hist{};
+    for (int y = 0; y < image.rows; y++) {
+        auto const* in = image.ptr<uchar>(y);
+        auto const* inside = fov.ptr<uchar>(y);
+        for (int x = 0; x < image.cols; x++) {
+            if (inside[x]) hist[in[x]]++;
+        }
+    }
+    return threshold(image, fov, hist);
+}
+
+cv::Mat ExtractArteries::threshold(cv::Mat image, cv::Mat const& fov, std::array<int, 256> const& hist) {
+    auto& threshold_img = fit(scratch_.threshold, image.size(), CV_8UC1);
+    auto const level = otsu_level(hist);
+    if (fov.empty()) {
+        cv::threshold(image, threshold_img, level, 255, cv::THRESH_BINARY);
+        return threshold_img;
+    }
+    for (int y = 0; y < image.rows; y++) {
+        auto const* in = image.ptr<uchar>(y);
+        auto const* inside = fov.ptr<uchar>(y);
+        auto* out = threshold_img.ptr<uchar>(y);
+        for (int x = 0; x < image.cols; x++) {
+            out[x] = (inside[x] && in[x] > level) ? 255 : 0;
+        }
+    }
+    return threshold_img;
+}
+
+cv::Mat ExtractArteries::remove_blobs(cv::Mat binary_image) {
+    auto& labels = fit(scratch_.labels, binary_image.size(), CV_32SC1);
+    int label_count;
+    if (kernels_.blobs == BlobKernel::stats) {
+        auto& stats = scratch_.stats;
+        label_count = cv::connectedComponentsWithStats(binary_image, labels, stats, scratch_.centroids, 8, CV_32S);
+        auto& areas = fit(scratch_.areas, label_count);
+        for (int i = 0; i < label_count; i++) areas[i] = stats.at<int>(i, cv::CC_STAT_AREA);
+    } else {
+        label_count = cv::connectedComponents(binary_image, labels, 8, CV_32S);
+        auto& areas = fit(scratch_.areas, label_count);
+        std::fill(areas.begin(), areas.end(), 0);
+        for (int y = 0; y < labels.rows; y++) {
+            auto const* label = labels.ptr<int>(y);
+            for (int x = 0; x < labels.cols; x++) areas[label[x]]++;
+        }
+    }
+    auto const& areas = scratch_.areas;
+
+    // label -> output value lookup table; label 0 is the background
+    auto& lut = fit(scratch_.lut, label_count);
+    for (int i = 0; i < label_count; i++) {
+        lut[i] = (i != 0 && areas[i] >= config_.min_valid_area) ? 255 : 0;
+    }
+
+    auto& result = fit(scratch_.cleaned, binary_image.size(), CV_8UC1);
+    for (int y = 0; y < labels.rows; y++) {
+        auto const* label = labels.ptr<int>(y);
+        auto* out = result.ptr<uchar>(y);
+        for (int x = 0; x < labels.cols; x++) out[x] = lut[label[x]];
+    }
+    return result;
+}
+
+cv::Mat ExtractArteries::detect_fov(cv::Mat const& image, int level) {
+    cv::Mat brightest = plane(image, 0);
+    for (int c = 1; c < image.channels(); c++) {
+        cv::max(brightest, plane(image, c), brightest);
+    }
+    cv::Mat candidates;
+    cv::threshold(brightest, candidates, level, 255, cv::THRESH_BINARY);
+
+    // keep the largest bright component
+    cv::Mat labels, stats, centroids;
+    auto count = cv::connectedComponentsWithStats(candidates, labels, stats, centroids, 8, CV_32S);
+    int largest = 0;
+    for (int i = 1; i < count; i++) {
+        if (!largest || stats.at<int>(i, cv::CC_STAT_AREA) > stats.at<int>(largest, cv::CC_STAT_AREA)) largest = i;
+    }
+    cv::Mat fov(image.size(), CV_8UC1);
+    for (int y = 0; y < fov.rows; y++) {
+        auto const* label = labels.ptr<int>(y);
+        auto* out = fov.ptr<uchar>(y);
+        for (int x = 0; x < fov.cols; x++) out[x] = (largest && label[x] == largest) ? 255 : 0;
+    }
+
+    // fill dark regions that do not reach the image border, e.g. a dark fovea
+    cv::Mat outside;
+    cv::threshold(fov, outside, 0, 255, cv::THRESH_BINARY_INV);
+    count = cv::connectedComponents(outside, labels, 4, CV_32S);
+    std::vector<bool> reaches_border(count, false);
+    for (int y = 0; y < labels.rows; y++) {
+        auto const* label = labels.ptr<int>(y);
+        reaches_border[label[0]] = reaches_border[label[labels.cols-1]] = true;
+        if (y == 0 || y == labels.rows-1) {
+            for (int x = 0; x < labels.cols; x++) reaches_border[label[x]] = true;
+        }
+    }
+    for (int y = 0; y < fov.rows; y++) {
+        auto const* label = labels.ptr<int>(y);
+        auto* out = fov.ptr<uchar>(y);
+        for (int x = 0; x < fov.cols; x++) {
+            if (label[x] && !reaches_border[label[x]]) out[x] = 255;
+        }
+    }
+    return fov;
+}
+
+cv::Mat ExtractArteries::extract(cv::Mat test_image) {
+    cv::Mat result;
+    extract(test_image, result);
+    return result;
+}
+
+void ExtractArteries::extract(cv::Mat test_image, cv::Mat& result) {
+    segment(test_image, cv::Mat(), result);
+}
+
+void ExtractArteries::extract(cv::Mat test_image, cv::Mat& result, cv::Mat const& fov) {
+    if (fov.empty()) {
+        segment(test_image, fov, result);
+        return;
+    }
+    CV_Assert(fov.size() == test_image.size() && fov.type() == CV_8UC1);
+    result.create(test_image.size(), CV_8UC1);
+    result.setTo(cv::Scalar(0));
+    auto const roi = cv::boundingRect(fov);
+    if (roi.empty()) return;
+
+    cv::Mat roi_result = result(roi);
+    cv::Mat const roi_fov = fov(roi);
+    segment(test_image(roi), roi_fov, roi_result);
+    for (int y = 0; y < roi_result.rows; y++) {
+        auto const* inside = roi_fov.ptr<uchar>(y);
+        auto* out = roi_result.ptr<uchar>(y);
+        for (int x = 0; x < roi_result.cols; x++) {
+            if (!inside[x]) out[x] = 0;
+        }
+    }
+}
+
+template <typename Fn>
+void ExtractArteries::for_each_tile(cv::Size size, Fn&& fn) {
+    tiles_.clear();
+    for (int y = 0; y < size.height; y += tile_size_) {
+        for (int x = 0; x < size.width; x += tile_size_) {
+            tiles_.emplace_back(x, y, std::min(tile_size_, size.width - x), std::min(tile_size_, size.height - y));
+        }
+    }
+    fit(tile_histograms_, tiles_.size());
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles_.size())), [&](cv::Range const& range) {
+        auto worker = acquire_tile_worker();
+        for (int i = range.start; i < range.end; i++) fn(tiles_[i], *worker, size_t(i));
+        release_tile_worker(std::move(worker));
+    }, static_cast<double>(tiles_.size()));
+}
+
+template <typename Fn>
+void ExtractArteries::for_each_strip(int width, int min_width, Fn&& fn) {
+    int const strips = std::clamp(width / std::max(min_width, 1), 1, std::max(cv::getNumThreads(), 1));
+    fit(tile_histograms_, strips);
+    cv::parallel_for_(cv::Range(0, strips), [&](cv::Range const& range) {
+        auto worker = acquire_tile_worker();
+        for (int i = range.start; i < range.end; i++) {
+            int const first = int(int64_t(width) * i / strips), last = int(int64_t(width) * (i + 1) / strips);
+            fn(cv::Range(first, last), *worker, size_t(i));
+        }
+        release_tile_worker(std::move(worker));
+    }, static_cast<double>(strips));
+}
+
+void ExtractArteries::extract_batch(std::span<cv::Mat const> images, std::span<cv::Mat> results, std::span<cv::Mat const> fovs) {
+    CV_Assert(results.size() == images.size() && (fovs.empty() || fovs.size() == images.size()));
+    auto const fov = [&](size_t i) { return fovs.empty() ? cv::Mat() : fovs[i]; };
+    for (size_t i = 0; i < images.size(); ) {
+        size_t n = 1;
+        if (micro_batch_ > 1 && fov(i).empty() && stackable(images[i])) {
+            while (n < size_t(micro_batch_) && i + n < images.size() && fov(i + n).empty()
+                && images[i + n].size() == images[i].size() && images[i + n].type() == images[i].type()) n++;
+        }
+        if (n > 1) {
+            segment_stack(images.subspan(i, n), results.subspan(i, n));
+        } else {
+            extract(images[i], results[i], fov(i));
+        }
+        i += n;
+    }
+}
+
+void ExtractArteries::segment(cv::Mat test_image, cv::Mat const& fov, cv::Mat& result) {
+    ScopedTimer total(profiler_, Stage::extract);
+    cv::Mat threshold_img, cleaned_img;
+    // tiles run the fused 3x3 median, which reads a halo of one pixel
+    bool const tiled = !device_ && tile_size_ > 0 && config_.median_size == 3
+        && (test_image.cols > tile_size_ || test_image.rows > tile_size_);
+    if (device_) {
+        threshold_img = device_->segment(test_image, fov, profiler_);
+    } else if (tiled) {
+        segment_tiled(test_image, fov, threshold_img);
+    } else {
+        segment_host(test_image, fov, threshold_img);
+    }
+    observe("extract(): threshold", threshold_img);
+    {
+        ScopedTimer timer(profiler_, Stage::remove_blobs);
+        cleaned_img = remove_blobs( threshold_img );
+    }
+    observe("extract(): cleaned", cleaned_img);
+    ScopedTimer timer(profiler_, Stage::final_median);
+    if (tiled) {
+        result.create(cleaned_img.size(), CV_8UC1);
+        for_each_tile(cleaned_img.size(), [&](cv::Rect tile, TileWorker& worker, size_t index) {
+            cv::Mat out = result(tile);
+            worker.median.apply(cleaned_img, tile, out, cv::Mat(), tile_histograms_[index]);
+        });
+    } else {
+        cv::medianBlur(cleaned_img, result, config_.median_size);
+    }
+}
+
+void ExtractArteries::segment_host(cv::Mat test_image, cv::Mat const& fov, cv::Mat& threshold_img) {
+    cv::Mat filtered_img, large_arteries_img;
+    {
+        ScopedTimer timer(profiler_, Stage::color_filter);
+        filtered_img = color_filter(test_image);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::large_arteries);
+        large_arteries_img = large_arteries(filtered_img);
+    }
+    observe("extract(): large_arteries_img", large_arteries_img);
+    bool const fused = config_.median_size == 3 && kernels_.median == MedianKernel::fused;
+    {
+        // also counts the histogram Otsu's level is picked from
+        ScopedTimer timer(profiler_, Stage::median);
+        if (fused) {
+            median_.apply(large_arteries_img, scratch_.median, fov, scratch_.histogram);
+        } else {
+            cv::medianBlur(large_arteries_img, fit(scratch_.median, large_arteries_img.size(), CV_8UC1), config_.median_size);
+        }
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::threshold);
+        threshold_img = fused ? threshold(scratch_.median, fov, scratch_.histogram) : threshold(scratch_.median, fov);
+    }
+}
+
+void ExtractArteries::segment_tiled(cv::Mat test_image, cv::Mat const& fov, cv::Mat& threshold_img) {
+    auto const size = test_image.size();
+    cv::Mat filtered_img, large_arteries_img;
+    {
+        ScopedTimer timer(profiler_, Stage::color_filter);
+        filtered_img = color_filter(test_image);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::large_arteries);
+        if (pyramid_factor_ > 1) {
+            // the reduced background is cheap enough whole, and pyrDown/pyrUp do not tile exactly
+            large_arteries_img = large_arteries(filtered_img);
+        } else {
+            auto& background_removed = fit(scratch_.background_removed, size, CV_8UC1);
+            int const halo = cascade_.halo();
+            cv::Rect const frame(0, 0, size.width, size.height);
+            for_each_tile(size, [&](cv::Rect tile, TileWorker& worker, size_t) {
+                auto const grown = cv::Rect(tile.x - halo, tile.y - halo, tile.width + 2*halo, tile.height + 2*halo) & frame;
+                cv::Mat out = background_removed(tile);
+                worker.cascade.apply_subtract(filtered_img(grown), tile - grown.tl(), filtered_img(tile), out);
+            });
+            large_arteries_img = clahe(background_removed);
+        }
+    }
+    observe("extract(): large_arteries_img", large_arteries_img);
+    {
+        ScopedTimer timer(profiler_, Stage::median);
+        auto& median = fit(scratch_.median, size, CV_8UC1);
+        for_each_tile(size, [&](cv::Rect tile, TileWorker& worker, size_t index) {
+            cv::Mat out = median(tile);
+            worker.median.apply(large_arteries_img, tile, out, fov, tile_histograms_[index]);
+        });
+        scratch_.histogram.fill(0);
+        for (auto const& hist : tile_histograms_) {
+            for (int i = 0; i < 256; i++) scratch_.histogram[i] += hist[i];
+        }
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::threshold);
+        threshold_img = threshold(scratch_.median, fov, scratch_.histogram);
+    }
+}
+
+std::unique_ptr<ExtractArteries::TileWorker> ExtractArteries::acquire_tile_worker() {
+    std::lock_guard lock(tile_workers_mutex_);
+    if (idle_tile_workers_.empty()) return std::make_unique<TileWorker>(config_.morph_sizes);
+    auto worker = std::move(idle_tile_workers_.back());
+    idle_tile_workers_.pop_back();
+    return worker;
+}
+
+void ExtractArteries::release_tile_worker(std::unique_ptr<TileWorker> worker) {
+    std::lock_guard lock(tile_workers_mutex_);
+    idle_tile_workers_.push_back(std::move(worker));
+}
+
+namespace {
+
+/// @brief `r` grown by `by` pixels on every side, clipped to a frame of `size`
+cv::Rect grown(cv::Rect r, int by, cv::Size size) {
+    return cv::Rect(r.x - by, r.y - by, r.width + 2*by, r.height + 2*by) & cv::Rect(0, 0, size.width, size.height);
+}
+
+/// @brief Bounding box of the pixels where `a` and `b` differ
+cv::Rect changed_rect(cv::Mat const& a, cv::Mat const& b) {
+    cv::Mat differs;
+    cv::compare(a, b, differs, cv::CMP_NE);
+    return cv::boundingRect(differs);
+}
+
+/// @brief Copy `rect` of `from` into `to`
+void copy_rect(cv::Mat const& from, cv::Mat& to, cv::Rect rect) {
+    cv::Mat out = to(rect);
+    from(rect).copyTo(out);
+}
+
+/// @brief Header over the pixels of `view` that does not know the image around it
+/// @note `cv::CLAHE` pads with `cv::copyMakeBorder`, which reads outside a view into the rest of its image;
+///       over a header of its own, a view is padded as if it had been allocated alone.
+cv::Mat isolated(cv::Mat const& view) {
+    return cv::Mat(view.rows, view.cols, view.type(), view.data, view.step);
+}
+
+} // namespace
+
+void ExtractArteries::median_region(cv::Mat const& src, cv::Rect roi, cv::Mat dst, std::array<int, 256>& hist) {
+    if (config_.median_size == 3) {
+        median_.apply(src, roi, dst, cv::Mat(), hist);
+        return;
+    }
+    // a copy of the crop ends where the crop does, so `cv::medianBlur` replicates only the frame's own border
+    auto const crop = grown(roi, config_.median_size / 2, src.size());
+    cv::Mat filtered;
+    cv::medianBlur(src(crop).clone(), filtered, config_.median_size);
+    filtered(roi - crop.tl()).copyTo(dst);
+    hist.fill(0);
+    for (int y = 0; y < dst.rows; y++) {
+        auto const* in = dst.ptr<uchar>(y);
+        for (int x = 0; x < dst.cols; x++) hist[in[x]]++;
+    }
+}
+
+void ExtractArteries::extract_state(cv::Mat test_image, SegmentationState& state) {
+    CV_Assert(!test_image.empty() && pyramid_factor_ == 1);
+    ScopedTimer total(profiler_, Stage::extract);
+    auto const size = test_image.size();
+    cv::Rect const frame(0, 0, size.width, size.height);
+    {
+        ScopedTimer timer(profiler_, Stage::color_filter);
+        color_filter(test_image).copyTo(state.equalized);
+        scratch_.luminance.copyTo(state.luminance);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::large_arteries);
+        state.background.create(size, CV_8UC1);
+        cascade_.apply(state.equalized, state.background);
+        auto& background_removed = fit(scratch_.background_removed, size, CV_8UC1);
+        cv::subtract(state.background, state.equalized, background_removed);
+        clahe(background_removed).copyTo(state.large_arteries);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::median);
+        state.median.create(size, CV_8UC1);
+        median_region(state.large_arteries, frame, state.median, state.histogram);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::threshold);
+        state.level = otsu_level(state.histogram);
+        cv::threshold(state.median, state.threshold, state.level, 255, cv::THRESH_BINARY);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::remove_blobs);
+        relabel_blobs(state, frame);
+    }
+    ScopedTimer timer(profiler_, Stage::final_median);
+    std::array<int, 256> hist;
+    state.mask.create(size, CV_8UC1);
+    median_region(state.cleaned, frame, state.mask, hist);
+}
+
+cv::Rect ExtractArteries::update_region(cv::Mat test_image, cv::Rect dirty, SegmentationState& state) {
+    CV_Assert(test_image.size() == state.mask.size() && pyramid_factor_ == 1);
+    ScopedTimer total(profiler_, Stage::extract);
+    auto const size = test_image.size();
+    cv::Rect const frame(0, 0, size.width, size.height);
+    dirty = dirty & frame;
+    if (dirty.empty()) return {};
+
+    cv::Rect changed;
+    {
+        ScopedTimer timer(profiler_, Stage::color_filter);
+        cv::Mat luminance = state.luminance(dirty);
+        if (luminance_ == Luminance::green) {
+            cv::extractChannel(test_image(dirty), luminance, 1);
+        } else {
+            cv::Mat lab;
+            cv::cvtColor(test_image(dirty), lab, lab_conversion);
+            cv::extractChannel(lab, luminance, 0);
+        }
+        auto& equalized = fit(scratch_.equalized, size, CV_8UC1);
+        clahe_->apply(state.luminance, equalized);
+        changed = changed_rect(equalized, state.equalized);
+        if (changed.empty()) return {};
+        copy_rect(equalized, state.equalized, changed);
+    }
+    {
+        // the background changes up to one halo from a changed input pixel, and is exact one halo further in
+        ScopedTimer timer(profiler_, Stage::large_arteries);
+        int const halo = cascade_.halo();
+        changed = grown(changed, halo, size);
+        auto const input = grown(changed, halo, size);
+        auto close = grow_view(scratch_.close, input.size(), CV_8UC1, allocations_);
+        cascade_.apply(state.equalized(input), close);
+        cv::Mat background = state.background(changed);
+        close(changed - input.tl()).copyTo(background);
+        auto& background_removed = fit(scratch_.background_removed, size, CV_8UC1);
+        cv::subtract(state.background, state.equalized, background_removed);
+        auto const large_arteries = clahe(background_removed);
+        changed = changed_rect(large_arteries, state.large_arteries);
+        if (changed.empty()) return {};
+        copy_rect(large_arteries, state.large_arteries, changed);
+    }
+    {
+        // Otsu's histogram loses the old medians of the changed part and gains the new ones
+        ScopedTimer timer(profiler_, Stage::median);
+        changed = grown(changed, config_.median_size / 2, size);
+        cv::Mat median = state.median(changed);
+        for (int y = 0; y < median.rows; y++) {
+            auto const* in = median.ptr<uchar>(y);
+            for (int x = 0; x < median.cols; x++) state.histogram[in[x]]--;
+        }
+        std::array<int, 256> hist;
+        median_region(state.large_arteries, changed, median, hist);
+        for (int i = 0; i < 256; i++) state.histogram[i] += hist[i];
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::threshold);
+        auto const level = otsu_level(state.histogram);
+        if (level != state.level) {
+            state.level = level;
+            changed = frame;
+        }
+        cv::Mat out = state.threshold(changed);
+        cv::threshold(state.median(changed), out, state.level, 255, cv::THRESH_BINARY);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::remove_blobs);
+        changed = relabel_blobs(state, changed);
+    }
+    ScopedTimer timer(profiler_, Stage::final_median);
+    changed = grown(changed, config_.median_size / 2, size);
+    std::array<int, 256> hist;
+    median_region(state.cleaned, changed, state.mask(changed), hist);
+    return changed;
+}
+
+cv::Rect ExtractArteries::relabel_blobs(SegmentationState& state, cv::Rect changed) const {
+    auto const size = state.threshold.size();
+    cv::Rect const frame(0, 0, size.width, size.height);
+    if (changed == frame || state.labels.size() != size) {
+        cv::Mat stats, centroids;
+        auto const count = cv::connectedComponentsWithStats(state.threshold, state.labels, stats, centroids, 8, CV_32S);
+        state.areas.resize(count);
+        state.boxes.resize(count);
+        for (int i = 0; i < count; i++) {
+            state.areas[i] = (i == 0) ? 0 : stats.at<int>(i, cv::CC_STAT_AREA);
+            state.boxes[i] = cv::Rect(stats.at<int>(i, cv::CC_STAT_LEFT), stats.at<int>(i, cv::CC_STAT_TOP),
+                stats.at<int>(i, cv::CC_STAT_WIDTH), stats.at<int>(i, cv::CC_STAT_HEIGHT));
+        }
+        state.cleaned.create(size, CV_8UC1);
+        for (int y = 0; y < size.height; y++) {
+            auto const* label = state.labels.ptr<int>(y);
+            auto* out = state.cleaned.ptr<uchar>(y);
+            for (int x = 0; x < size.width; x++) out[x] = state.areas[label[x]] >= config_.min_valid_area && label[x] ? 255 : 0;
+        }
+        return frame;
+    }
+
+    // Outside `changed` the threshold is as before, so a blob that now touches `changed` is made of
+    // changed pixels and of old blobs that touched `changed` or a pixel next to it. The boxes of those
+    // old blobs and `changed` bound every blob that has to be relabelled.
+    auto const touching = grown(changed, 1, size);
+    std::vector<bool> replaced(state.areas.size(), false);
+    auto bounds = touching;
+    for (int y = touching.y; y < touching.br().y; y++) {
+        auto const* label = state.labels.ptr<int>(y);
+        for (int x = touching.x; x < touching.br().x; x++) {
+            if (label[x] && !replaced[label[x]]) {
+                replaced[label[x]] = true;
+                bounds = bounds | state.boxes[label[x]];
+            }
+        }
+    }
+
+    cv::Mat local, stats, centroids;
+    auto const count = cv::connectedComponentsWithStats(state.threshold(bounds), local, stats, centroids, 8, CV_32S);
+    // a local blob is new if it has a changed pixel or a pixel of a replaced blob; the others are untouched
+    // parts of blobs that extend beyond `bounds`
+    std::vector<int> relabel(count, 0);
+    for (int y = 0; y < bounds.height; y++) {
+        auto const* label = local.ptr<int>(y);
+        auto const* old = state.labels.ptr<int>(bounds.y + y) + bounds.x;
+        bool const row_changed = bounds.y + y >= changed.y && bounds.y + y < changed.br().y;
+        for (int x = 0; x < bounds.width; x++) {
+            if (!label[x] || relabel[label[x]]) continue;
+            bool const in_changed = row_changed && bounds.x + x >= changed.x && bounds.x + x < changed.br().x;
+            if (in_changed || replaced[old[x]]) relabel[label[x]] = -1;
+        }
+    }
+    for (size_t i = 0; i < replaced.size(); i++) {
+        if (replaced[i]) state.areas[i] = 0;
+    }
+    for (int i = 1; i < count; i++) {
+        if (!relabel[i]) continue;
+        relabel[i] = static_cast<int>(state.areas.size());
+        state.areas.push_back(stats.at<int>(i, cv::CC_STAT_AREA));
+        state.boxes.emplace_back(bounds.x + stats.at<int>(i, cv::CC_STAT_LEFT), bounds.y + stats.at<int>(i, cv::CC_STAT_TOP),
+            stats.at<int>(i, cv::CC_STAT_WIDTH), stats.at<int>(i, cv::CC_STAT_HEIGHT));
+    }
+
+    for (int y = 0; y < bounds.height; y++) {
+        auto const* label = local.ptr<int>(y);
+        auto* global = state.labels.ptr<int>(bounds.y + y) + bounds.x;
+        auto* out = state.cleaned.ptr<uchar>(bounds.y + y) + bounds.x;
+        for (int x = 0; x < bounds.width; x++) {
+            if (label[x] && relabel[label[x]]) {
+                global[x] = relabel[label[x]];
+                out[x] = state.areas[global[x]] >= config_.min_valid_area ? 255 : 0;
+            } else if (!label[x]) {
+                global[x] = 0;
+                out[x] = 0;
+            }
+        }
+    }
+    return bounds;
+}
+
+bool ExtractArteries::extract_frame(cv::Mat frame, cv::Mat& result, SequenceState& state) {
+    CV_Assert(!frame.empty() && state.refresh_interval >= 1);
+    ScopedTimer total(profiler_, Stage::extract);
+    auto const size = frame.size();
+    bool refresh;
+    {
+        ScopedTimer timer(profiler_, Stage::color_filter);
+        auto const& luminance = luminance_plane(frame);
+        // the L1 norm is one pass over the frame, far cheaper than the cascade it may save
+        refresh = state.reference.size() != size || state.age >= state.refresh_interval
+            || cv::norm(luminance, state.reference, cv::NORM_L1) > state.max_change * size.area();
+        auto& equalized = fit(scratch_.equalized, size, CV_8UC1);
+        // a keyframe is mapped through the tables it just built, CLAHE's own second pass would repeat them
+        if (refresh) {
+            luminance.copyTo(state.reference);
+            state.luminance_lut.compute(luminance, config_.clip_limit);
+            state.age = 0;
+        }
+        state.luminance_lut.apply(luminance, equalized);
+        state.age++;
+    }
+    observe("extract_frame(): equalized", scratch_.equalized);
+    cv::Mat large_arteries_img;
+    {
+        ScopedTimer timer(profiler_, Stage::large_arteries);
+        auto const& equalized = scratch_.equalized;
+        if (refresh) {
+            state.background.create(size, CV_8UC1);
+            if (pyramid_factor_ > 1) {
+                background_pyramid(equalized, state.background);
+            } else {
+                cascade_.apply(equalized, state.background);
+            }
+        }
+        auto& background_removed = fit(scratch_.background_removed, size, CV_8UC1);
+        cv::subtract(state.background, equalized, background_removed);
+        if (refresh) state.background_lut.compute(background_removed, config_.clip_limit);
+        state.background_lut.apply(background_removed, fit(scratch_.clahe, size, CV_8UC1));
+        large_arteries_img = scratch_.clahe;
+    }
+    observe("extract_frame(): large_arteries_img", large_arteries_img);
+    bool const fused = config_.median_size == 3;
+    {
+        ScopedTimer timer(profiler_, Stage::median);
+        if (fused) {
+            median_.apply(large_arteries_img, scratch_.median, cv::Mat(), scratch_.histogram);
+        } else {
+            cv::medianBlur(large_arteries_img, fit(scratch_.median, size, CV_8UC1), config_.median_size);
+        }
+    }
+    cv::Mat threshold_img, cleaned_img;
+    {
+        ScopedTimer timer(profiler_, Stage::threshold);
+        threshold_img = fused ? threshold(scratch_.median, cv::Mat(), scratch_.histogram) : threshold(scratch_.median);
+    }
+    {
+        ScopedTimer timer(profiler_, Stage::remove_blobs);
+        cleaned_img = remove_blobs(threshold_img);
+    }
+    ScopedTimer timer(profiler_, Stage::final_median);
+    cv::medianBlur(cleaned_img, result, config_.median_size);
+    return refresh;
+}
+
+bool ExtractArteries::stackable(cv::Mat const& image) const {
+    bool const tiled = tile_size_ > 0 && (image.cols > tile_size_ || image.rows > tile_size_);
+    return !device_ && !tiled && pyramid_factor_ == 1 && config_.median_size == 3 && image.type() == CV_8UC3;
+}
+
+void ExtractArteries::segment_stack(std::span<cv::Mat const> images, std::span<cv::Mat> results) {
+    // stages that run over the whole stack record each image's share of the time
+    ScopedTimer total(profiler_, Stage::extract, images.size());
+    auto const size = images.front().size();
+    int const gap = cascade_.max_radius();
+    int const pitch = size.height + gap;
+    cv::Size const stack_size(size.width, static_cast<int>(images.size()) * pitch - gap);
+    ImageStack const layout{size.height, gap};
+    auto const image_of = [&](cv::Mat const& stack, size_t i) {
+        return isolated(stack.rowRange(static_cast<int>(i) * pitch, static_cast<int>(i) * pitch + size.height));
+    };
+
+    auto& equalized = fit(scratch_.stack_equalized, stack_size, CV_8UC1);
+    for (size_t i = 0; i < images.size(); i++) {
+        ScopedTimer timer(profiler_, Stage::color_filter);
+        cv::Mat out = image_of(equalized, i);
+        clahe_->apply(luminance_plane(images[i]), out);
+    }
+    auto& large_arteries = fit(scratch_.stack_large_arteries, stack_size, CV_8UC1);
+    {
+        ScopedTimer timer(profiler_, Stage::large_arteries, images.size());
+        auto& background_removed = fit(scratch_.stack_background_removed, stack_size, CV_8UC1);
+        cascade_.apply_subtract(equalized, cv::Rect(0, 0, stack_size.width, stack_size.height), equalized,
+            background_removed, layout);
+        for (size_t i = 0; i < images.size(); i++) {
+            cv::Mat out = image_of(large_arteries, i);
+            clahe_->apply(image_of(background_removed, i), out);
+        }
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+        auto const large_arteries_img = image_of(large_arteries, i);
+        observe("extract(): large_arteries_img", large_arteries_img);
+        cv::Mat threshold_img, cleaned_img;
+        {
+            ScopedTimer timer(profiler_, Stage::median);
+            median_.apply(large_arteries_img, scratch_.median, cv::Mat(), scratch_.histogram);
+        }
+        {
+            ScopedTimer timer(profiler_, Stage::threshold);
+            threshold_img = threshold(scratch_.median, cv::Mat(), scratch_.histogram);
+        }
+        observe("extract(): threshold", threshold_img);
+        {
+            ScopedTimer timer(profiler_, Stage::remove_blobs);
+            cleaned_img = remove_blobs(threshold_img);
+        }
+        observe("extract(): cleaned", cleaned_img);
+        ScopedTimer timer(profiler_, Stage::final_median);
+        cv::medianBlur(cleaned_img, results[i], config_.median_size);
+    }
+}
+
+std::string ExtractArteries::extract_stream(RowSource& source, RowSink& sink, StreamConfig const& stream) {
+    CV_Assert(stream.band_rows > 0 && pyramid_factor_ == 1);
+    ScopedTimer total(profiler_, Stage::extract);
+    auto const size = source.size();
+    int const band = stream.band_rows;
+    int const width = size.width;
+    if (size.area() <= 0) return "the source image is empty";
+    auto bands = [&](auto&& fn) {
+        for (int y = 0; y < size.height; y += band) {
+            if (!fn(y, std::min(y + band, size.height))) return false;
+        }
+        return true;
+    };
+
+    // the luminance is spilled while the tables of the first CLAHE pass are counted
+    ClaheLut equalize, enhance;
+    equalize.begin(size);
+    auto luminance_spill = std::make_unique<SpillFile>(stream.spill_directory, width);
+    if (!luminance_spill->error().empty()) return luminance_spill->error();
+    {
+        int y = 0;
+        cv::Mat rows;
+        while (true) {
+            {
+                ScopedTimer timer(profiler_, Stage::read);
+                if (!source.read(rows)) break;
+            }
+            if (rows.type() != CV_8UC3 || rows.cols != width || y + rows.rows > size.height) {
+                return "the source delivered rows that do not fit its size";
+            }
+            ScopedTimer timer(profiler_, Stage::color_filter);
+            auto const& luminance = luminance_plane(rows);
+            equalize.accumulate(luminance, y);
+            if (!luminance_spill->write(luminance)) return luminance_spill->error();
+            y += rows.rows;
+        }
+        if (!source.error().empty()) return source.error();
+        if (y != size.height) return "the source ended after " + std::to_string(y) + " of " + std::to_string(size.height) + " rows";
+        equalize.finish(config_.clip_limit);
+    }
+
+    // the cascade over a window of equalized rows, counting the tables of the second CLAHE pass
+    enhance.begin(size);
+    auto background_spill = std::make_unique<SpillFile>(stream.spill_directory, width);
+    if (!background_spill->error().empty()) return background_spill->error();
+    {
+        int const halo = cascade_.halo();
+        BandWindow window(size, band, halo, CV_8UC1);
+        auto equalized_band = [&](cv::Mat& rows, int y) {
+            if (luminance_spill->read(y, rows)) equalize.apply_rows(rows, y, rows);
+        };
+        bool const done = bands([&](int y0, int y1) {
+            int const first = std::max(y0 - halo, 0);
+            cv::Mat equalized;
+            {
+                ScopedTimer timer(profiler_, Stage::color_filter);
+                equalized = window.rows(first, std::min(y1 + halo, size.height), equalized_band);
+            }
+            if (!luminance_spill->error().empty()) return false;
+            ScopedTimer timer(profiler_, Stage::large_arteries);
+            auto& background_removed = fit(scratch_.background_removed, cv::Size(width, y1 - y0), CV_8UC1);
+            for_each_strip(width, 4 * halo, [&](cv::Range columns, TileWorker& worker, size_t) {
+                int const grown_first = std::max(columns.start - halo, 0), grown_last = std::min(columns.end + halo, width);
+                cv::Rect const roi(columns.start - grown_first, y0 - first, columns.size(), y1 - y0);
+                cv::Mat out = background_removed.colRange(columns);
+                worker.cascade.apply_subtract(equalized.colRange(grown_first, grown_last), roi,
+                    equalized(cv::Rect(columns.start, y0 - first, columns.size(), y1 - y0)), out);
+            });
+            enhance.accumulate(background_removed, y0);
+            return background_spill->write(background_removed);
+        });
+        if (!done) return !luminance_spill->error().empty() ? luminance_spill->error() : background_spill->error();
+        enhance.finish(config_.clip_limit);
+    }
+    luminance_spill.reset();
+
+    // the first median over a window of enhanced rows, counting Otsu's histogram
+    auto median_spill = std::make_unique<SpillFile>(stream.spill_directory, width);
+    if (!median_spill->error().empty()) return median_spill->error();
+    std::array<int, 256> histogram{};
+    {
+        int const halo = config_.median_size / 2;
+        BandWindow window(size, band, halo, CV_8UC1);
+        auto enhanced_band = [&](cv::Mat& rows, int y) {
+            if (background_spill->read(y, rows)) enhance.apply_rows(rows, y, rows);
+        };
+        bool const done = bands([&](int y0, int y1) {
+            int const first = std::max(y0 - halo, 0);
+            cv::Mat large_arteries;
+            {
+                ScopedTimer timer(profiler_, Stage::large_arteries);
+                large_arteries = window.rows(first, std::min(y1 + halo, size.height), enhanced_band);
+            }
+            if (!background_spill->error().empty()) return false;
+            ScopedTimer timer(profiler_, Stage::median);
+            auto& median = fit(scratch_.median, cv::Size(width, y1 - y0), CV_8UC1);
+            if (config_.median_size == 3) {
+                for_each_strip(width, 64, [&](cv::Range columns, TileWorker& worker, size_t index) {
+                    cv::Mat out = median.colRange(columns);
+                    worker.median.apply(large_arteries, cv::Rect(columns.start, y0 - first, columns.size(), y1 - y0),
+                        out, cv::Mat(), tile_histograms_[index]);
+                });
+                for (auto const& hist : tile_histograms_) {
+                    for (int i = 0; i < 256; i++) histogram[i] += hist[i];
+                }
+            } else {
+                // the window ends where the frame does or holds the halo, so replicating its border is exact
+                cv::Mat filtered;
+                cv::medianBlur(isolated(large_arteries), filtered, config_.median_size);
+                filtered.rowRange(y0 - first, y1 - first).copyTo(median);
+                for (int y = 0; y < median.rows; y++) {
+                    auto const* in = median.ptr<uchar>(y);
+                    for (int x = 0; x < width; x++) histogram[in[x]]++;
+                }
+            }
+            return median_spill->write(median);
+        });
+        if (!done) return !background_spill->error().empty() ? background_spill->error() : median_spill->error();
+    }
+    background_spill.reset();
+    auto const level = otsu_level(histogram);
+
+    // blob areas across bands, then again over the same bands to clear the small ones
+    BandBlobs blobs;
+    bool const labelled = bands([&](int y0, int y1) {
+        auto& binary = fit(scratch_.threshold, cv::Size(width, y1 - y0), CV_8UC1);
+        if (!median_spill->read(y0, binary)) return false;
+        {
+            ScopedTimer timer(profiler_, Stage::threshold);
+            cv::threshold(binary, binary, level, 255, cv::THRESH_BINARY);
+        }
+        ScopedTimer timer(profiler_, Stage::remove_blobs);
+        blobs.add(binary);
+        return true;
+    });
+    if (!labelled) return median_spill->error();
+    blobs.finish(config_.min_valid_area);
+
+    int const halo = config_.median_size / 2;
+    BandWindow window(size, band, halo, CV_8UC1);
+    auto cleaned_band = [&](cv::Mat& rows, int y) {
+        if (!median_spill->read(y, rows)) return;
+        {
+            ScopedTimer timer(profiler_, Stage::threshold);
+            cv::threshold(rows, rows, level, 255, cv::THRESH_BINARY);
+        }
+        ScopedTimer timer(profiler_, Stage::remove_blobs);
+        blobs.clean(rows, rows);
+    };
+    bool const written = bands([&](int y0, int y1) {
+        int const first = std::max(y0 - halo, 0);
+        auto const cleaned = window.rows(first, std::min(y1 + halo, size.height), cleaned_band);
+        if (!median_spill->error().empty()) return false;
+        auto& mask = fit(scratch_.cleaned, cv::Size(width, y1 - y0), CV_8UC1);
+        {
+            ScopedTimer timer(profiler_, Stage::final_median);
+            if (config_.median_size == 3) {
+                for_each_strip(width, 64, [&](cv::Range columns, TileWorker& worker, size_t index) {
+                    cv::Mat out = mask.colRange(columns);
+                    worker.median.apply(cleaned, cv::Rect(columns.start, y0 - first, columns.size(), y1 - y0),
+                        out, cv::Mat(), tile_histograms_[index]);
+                });
+            } else {
+                cv::Mat filtered;
+                cv::medianBlur(isolated(cleaned), filtered, config_.median_size);
+                filtered.rowRange(y0 - first, y1 - first).copyTo(mask);
+            }
+        }
+        ScopedTimer timer(profiler_, Stage::write);
+        return sink.write(mask);
+    });
+    if (!written) return !median_spill->error().empty() ? median_spill->error() : sink.error();
+    return sink.close() ? std::string() : sink.error();
+}
@@ -0,0 +1,529 @@
+/// extract_arteries.hpp by Jeff Benshetler, (c) 2023
+/// Purpose: Segment arteries from input image. Public header of the `vessel` library, which needs
+/// only the OpenCV core and imgproc modules.
+
+#pragma once
+
+#include <array>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "band_stream.hpp"
+#include "clahe.hpp"
+#include "device_backend.hpp"
+#include "median.hpp"
+#include "morphology.hpp"
+#include "otsu.hpp"
+#include "profiler.hpp"
+
+/////////////////////////
+// Utility functions
+
+inline void print_info(std::string const& str, cv::Mat image) {
+    std::cout << str << " " << image.size() << " " << image.channels() << std::endl;
+}
+
+inline cv::Mat plane(cv::Mat image, int index) {
+    cv::Mat result;
+    cv::extractChannel(image, result, index);
+    return result;
+}
+
+/// @brief Receives intermediate images of `extract()`, e.g. to display them
+/// @param stage Name of the intermediate, e.g. "extract(): threshold"
+/// @param image The intermediate, valid only during the call
+using StageObserver = std::function<void(std::string const& stage, cv::Mat const& image)>;
+
+/// @brief Half sizes of the rectangular structuring elements the morphology kernels are compiled for
+inline constexpr std::array<int, 3> default_morph_sizes{2, 5, 11};
+
+/// @brief Settings that shape the mask, fixed when an `ExtractArteries` is constructed
+/// @note The defaults are the original pipeline's and run kernels specialized for them at compile time:
+///       every fused pass of `default_morph_sizes` and the 3x3 median. Other values are for experiments
+///       and run the generic kernels; a median other than 3x3 is `cv::medianBlur` and disables tiling.
+struct ExtractConfig {
+    /// Half sizes of the rectangular structuring elements, smallest first
+    std::vector<int> morph_sizes{default_morph_sizes.begin(), default_morph_sizes.end()};
+    /// Contrast limit of every CLAHE pass
+    double clip_limit = 3;
+    /// Aperture of both median filters, odd
+    int median_size = 3;
+    /// Blobs of fewer pixels are removed by `remove_blobs`
+    int min_valid_area = 25;
+};
+
+/// @brief Implementation of the open/close cascade of `large_arteries()`: van Herk passes, or `cv::morphologyEx`
+enum class MorphologyKernel { van_herk, opencv };
+
+/// @brief Implementation of the first median and the histogram Otsu's level is picked from: `FusedMedian`, or
+///        `cv::medianBlur` followed by a histogram pass
+enum class MedianKernel { fused, opencv };
+
+/// @brief How `remove_blobs()` measures blobs: labels then a counting pass, or `cv::connectedComponentsWithStats`
+enum class BlobKernel { labeling, stats };
+
+inline char const* morphology_kernel_name(MorphologyKernel kernel) {
+    static char const* const names[] = { "van_herk", "opencv" };
+    return names[static_cast<int>(kernel)];
+}
+
+inline char const* median_kernel_name(MedianKernel kernel) {
+    static char const* const names[] = { "fused", "opencv" };
+    return names[static_cast<int>(kernel)];
+}
+
+inline char const* blob_kernel_name(BlobKernel kernel) {
+    static char const* const names[] = { "labeling", "stats" };
+    return names[static_cast<int>(kernel)];
+}
+
+/// @brief Interchangeable implementations of the stages, chosen by `ExtractArteries::set_kernels()`
+/// @note Every combination gives the same mask; which is fastest depends on the host and the image size,
+///       see `autotune.hpp`.
+struct StageKernels {
+    MorphologyKernel morphology = MorphologyKernel::van_herk;
+    MedianKernel median = MedianKernel::fused;
+    BlobKernel blobs = BlobKernel::labeling;
+
+    bool operator==(StageKernels const&) const = default;
+};
+
+/// @brief How `ExtractArteries::extract_stream()` splits an image into bands
+struct StreamConfig {
+    /// Rows segmented at a time; memory grows with this times the image width
+    int band_rows = 256;
+    /// Directory of the spill files, empty for `std::filesystem::temp_directory_path()`
+    std::string spill_directory;
+};
+
+/// @brief Intermediates of one frame kept by `ExtractArteries::extract_state()` for `update_region()`
+/// @note Owns its images; one state per frame being edited, any number per `ExtractArteries`.
+struct SegmentationState {
+    /// Plane `color_filter` enhances, before CLAHE
+    cv::Mat luminance;
+    /// Output of `color_filter`
+    cv::Mat equalized;
+    /// Result of the open/close cascade, the background estimate of `large_arteries`
+    cv::Mat background;
+    /// Output of `large_arteries`
+    cv::Mat large_arteries;
+    /// First median and its histogram, from which Otsu's level is picked
+    cv::Mat median;
+    std::array<int, 256> histogram{};
+    int level = 0;
+    cv::Mat threshold;
+    /// 8-connected components of `threshold`, CV_32SC1, with the pixel count and bounding box of each label
+    /// @note Labels are not renumbered by updates; those of replaced components keep an area of 0.
+    cv::Mat labels;
+    std::vector<int> areas;
+    std::vector<cv::Rect> boxes;
+    /// Output of `remove_blobs`
+    cv::Mat cleaned;
+    /// Binary mask of large arteries, as `extract()` returns it
+    cv::Mat mask;
+};
+
+/// @brief What `ExtractArteries::extract_frame()` carries from one frame of a sequence to the next
+/// @note One state per stream of frames. The estimates are refreshed on the first frame, when the frame
+///       size changes, when the luminance has moved more than `max_change` from the last refreshed frame,
+///       and after `refresh_interval` frames.
+struct SequenceState {
+    /// Largest mean absolute difference, in gray levels, between the luminance of a frame and that of the
+    /// last refreshed frame at which the kept estimates are reused
+    double max_change = 2;
+    /// Refresh at least every this many frames; 1 refreshes every frame
+    int refresh_interval = 30;
+
+    /// Tables of the CLAHE pass of `color_filter` and of the one of `large_arteries`
+    ClaheLut luminance_lut;
+    ClaheLut background_lut;
+    /// Luminance of the last refreshed frame, which the change is measured against
+    cv::Mat reference;
+    /// Result of the open/close cascade on the last refreshed frame
+    cv::Mat background;
+    /// Frames since the last refresh, counting the refreshed one
+    int age = 0;
+};
+
+/////////////////////////
+// Does the segmentation
+struct ExtractArteries {
+    /// @brief Construct structuring elements and adaptive contrast enhancement data structures
+    /// @param config Element sizes, clip limit, median aperture, and smallest blob kept
+    /// @note Based on [Contour Based Blood Vessel Segmentation in Retinal Fundus Images](https://github.com/sachinmb27/Contour-Based-Blood-Vessel-Segmentation-in-Retinal-Fundus-Images/blob/main/segmentation.py)
+    explicit ExtractArteries(ExtractConfig config = {});
+
+    ExtractConfig const& config() const { return config_; }
+
+    /// @brief Pass intermediate images to `observer` as they are produced, or stop if empty
+    void set_observer(StageObserver observer) { observer_ = std::move(observer); }
+
+    /// @brief Choose the plane `color_filter` enhances
+    void set_luminance(Luminance luminance);
+
+    Luminance luminance() const { return luminance_; }
+
+    /// @brief Split frames larger than `tile_size` pixels on either side into tiles processed in parallel
+    /// @param tile_size Side of a tile, 0 to process every frame whole
+    /// @note The morphology cascade, both medians, and the subtract run per tile on `cv::parallel_for_`.
+    ///       Tiles read a halo of `AlternatingSequentialFilter::halo()` pixels for the cascade and of one
+    ///       pixel for the medians, and both CLAHE passes, Otsu's level, and blob removal see the whole
+    ///       frame, so the output is identical to the untiled one. Only used by the CPU backend.
+    void set_tile_size(int tile_size) { tile_size_ = tile_size; }
+
+    int tile_size() const { return tile_size_; }
+
+    /// @brief Estimate the background of `large_arteries()` at 1/`factor` resolution
+    /// @param factor 1 for the exact full-resolution cascade, or 2 or 4
+    /// @note Only the smallest structuring element runs at full resolution. The result of that opening and
+    ///       closing is reduced with `cv::pyrDown`, the larger elements run there with radii divided by `factor`,
+    ///       and the estimate is brought back with `cv::pyrUp`. The background varies slowly, so the mask
+    ///       changes little, but the output is no longer identical; measure the effect before relying on it.
+    ///       CPU backend only; tiled frames run this stage whole.
+    void set_pyramid(int factor);
+
+    int pyramid() const { return pyramid_factor_; }
+
+    /// @brief Run `color_filter` through `threshold` on `backend`
+    /// @note The device keeps every intermediate; `remove_blobs` and the final median stay on the host.
+    ///       Only the host stages are passed to the observer.
+    void set_backend(Backend backend);
+
+    Backend backend() const { return backend_; }
+
+    /// @brief Let `extract_batch()` run up to `images` same-size images through the cascade as one stack
+    /// @param images Largest stack, 1 to process every image on its own
+    /// @note Consecutive images of one size and type without a field of view are stacked vertically,
+    ///       `AlternatingSequentialFilter::max_radius()` rows apart, and the cascade and the subtract run
+    ///       once over the stack, with the gaps read as outside every image. Each image is converted into the
+    ///       stack directly, and CLAHE, both medians, Otsu's level, and blob removal still see one image at a
+    ///       time, so every mask is identical to `extract()`'s. Only CPU frames that are not tiled, with the
+    ///       3x3 median and without the pyramid, are stacked; others are processed one by one. The profiler
+    ///       gets one `extract` and one `large_arteries` sample per image, each an equal share of the stack's time.
+    void set_micro_batch(int images);
+
+    int micro_batch() const { return micro_batch_; }
+
+    /// @brief Choose the implementation of each stage
+    /// @note Applies to `extract()` and `extract_batch()` on whole frames on the CPU. Tiles, stacks, streams,
+    ///       and the state and sequence paths always run the van Herk cascade and the fused median.
+    void set_kernels(StageKernels kernels) { kernels_ = kernels; }
+
+    StageKernels const& kernels() const { return kernels_; }
+
+    /// @brief Record per-stage timings of `extract()` into `profiler`, or stop recording if `nullptr`
+    void set_profiler(Profiler* profiler) { profiler_ = profiler; }
+
+    /// @brief Number of times a buffer owned by this instance was (re)allocated
+    /// @note Grows on the first `extract()` and whenever the image geometry changes; steady-state
+    ///       calls on same-size images leave it unchanged. OpenCV-internal temporaries are not counted.
+    size_t allocations() const;
+
+    /// @brief Every setting that changes the mask, as text, e.g. to key cached results
+    /// @note Tile size and micro batch are left out because they do not change the output; the OpenCV version is
+    ///       included because CLAHE and the colour conversion come from it.
+    std::string parameters() const;
+
+    /// @brief Conversion `color_filter` applies to the decoded image for `Luminance::lab`
+    /// @note The original pipeline swapped the decoded BGR image to RGB order before converting
+    ///       BGR to Lab; RGB to Lab on the decoded image is that computation without the copy,
+    ///       so results in `output/` are unchanged.
+    static constexpr int lab_conversion = cv::COLOR_RGB2Lab;
+
+    /// @brief Rows per Lab conversion strip of `color_filter`
+    static constexpr int lab_strip_rows = 16;
+
+    /// @brief Perform adaptive contrast enhancement
+    /// @param image Source for contrast enhancement
+    /// @param channel_index Optional channel index for multi-channel images
+    /// @return Contrast enhanced image, valid until the next call
+    cv::Mat clahe(cv::Mat image, int channel_index = 0);
+
+    /// @brief Perform contrast enhancement on luminance
+    /// @param test_image Source for filtering, as decoded by `cv::imread`
+    /// @return Contrast-enhanced single-channel luminance image, valid until the next call
+    cv::Mat color_filter(cv::Mat test_image);
+
+    /// @brief Morphological opening
+    /// @param image Source for morpho operation
+    /// @param se Structuring element
+    /// @param iterations How many times to perform operation
+    /// @return Opening result
+    cv::Mat erosion(cv::Mat image, cv::Mat se, int iterations = 1);
+
+    /// @brief Morphological closing
+    /// @param image Source for morpho operation
+    /// @param se Structing element
+    /// @param iterations How many time to perform operation
+    /// @return Closing result
+    cv::Mat dilation(cv::Mat image, cv::Mat se, int iterations = 1);
+
+    /// @brief Extract the large arteries 
+    /// @param test_image Source for extraction
+    /// @return Grayscale image with everything other than larger arteries suppressed, valid until the next call
+    /// @note "Large arteries" is a relative
+    cv::Mat large_arteries(cv::Mat test_image);
+
+    /// @brief Multi-resolution estimate of the cascade result, see `set_pyramid()`
+    /// @param image Source of `large_arteries()`
+    /// @param background Receives the estimate, of `image` size
+    void background_pyramid(cv::Mat const& image, cv::Mat& background);
+
+    /// @brief `large_arteries()` built from `erosion()` and `dilation()` calls
+    /// @param test_image Source for extraction
+    /// @return Same result as `large_arteries()`
+    cv::Mat large_arteries_reference(cv::Mat test_image);
+
+    /// @brief Set everything below the image mean to black
+    /// @param image Source for threshold
+    /// @param fov Optional field of view; when given, the level is computed from, and set only for, its pixels
+    /// @return Binary image with thresholding results, valid until the next call
+    /// @note The level is Otsu's; the image mean the original version passed to `cv::threshold` was ignored with `THRESH_OTSU`, so it is no longer computed.
+    cv::Mat threshold(cv::Mat image, cv::Mat const& fov = cv::Mat());
+
+    /// @brief Binarize at Otsu's level of a histogram counted beforehand, e.g. by `FusedMedian`
+    /// @param image Source for threshold
+    /// @param fov Optional field of view; when given, `hist` must count only its pixels and the rest is set to 0
+    /// @param hist Histogram of `image`, inside `fov` if given
+    /// @return Same as `threshold(image, fov)`, valid until the next call
+    cv::Mat threshold(cv::Mat image, cv::Mat const& fov, std::array<int, 256> const& hist);
+
+    /// @brief Remove blobs from image based on size
+    /// @param binary_image Source for suppression
+    /// @return Binary image with blobs suppressed, valid until the next call
+    /// @note Blobs are 8-connected components; those with fewer than `ExtractConfig::min_valid_area` pixels are
+    ///       cleared. Labeling, area count, and remap are each one raster pass, whatever the blob count.
+    cv::Mat remove_blobs(cv::Mat binary_image);
+
+
+    /// @brief Estimate the field of view of a fundus image
+    /// @param image Source image, any number of 8-bit channels
+    /// @param level Pixels whose brightest channel exceeds this are candidates
+    /// @return CV_8UC1 mask, 255 inside the largest bright region with its holes filled, 0 elsewhere
+    static cv::Mat detect_fov(cv::Mat const& image, int level = 20);
+
+    /// @brief Primary interface to extract arteries from image
+    /// @param test_image Source image as decoded by `cv::imread`
+    /// @return Binary image with mask of large arteries
+    cv::Mat extract(cv::Mat test_image);
+
+    /// @brief Extract arteries into a caller-owned image
+    /// @param test_image Source image as decoded by `cv::imread`
+    /// @param result Binary image with mask of large arteries, reused when its geometry matches
+    /// @note Once the buffers are sized, repeated calls on same-size images do not allocate.
+    void extract(cv::Mat test_image, cv::Mat& result);
+
+    /// @brief Extract arteries inside a field of view only
+    /// @param test_image Source image as decoded by `cv::imread`
+    /// @param result Binary image with mask of large arteries, 0 outside `fov`
+    /// @param fov CV_8UC1 mask of `test_image` size, non-zero inside the field of view; empty for the whole frame
+    /// @note All stages run on the bounding box of `fov`, and Otsu's level is computed from pixels inside it,
+    ///       so the black border of the frame costs nothing and does not bias the threshold.
+    void extract(cv::Mat test_image, cv::Mat& result, cv::Mat const& fov);
+
+    /// @brief Extract arteries from a batch of images with one set of buffers
+    /// @param images Sources as decoded by `cv::imread`
+    /// @param results Receives one mask per image, each reused when its geometry matches; same size as `images`
+    /// @param fovs Optional field of view per image, empty for whole frames; same size as `images` if not empty
+    /// @note Construction, device setup, and buffer sizing are paid once for the batch. Images of one size
+    ///       after the first do not allocate. For parallelism, give each thread its own instance.
+    ///       See `set_micro_batch()` to run several images through the cascade at once.
+    void extract_batch(std::span<cv::Mat const> images, std::span<cv::Mat> results, std::span<cv::Mat const> fovs = {});
+
+    /// @brief Extract arteries and keep every intermediate, for `update_region()`
+    /// @param test_image Source image as decoded by `cv::imread`
+    /// @param state Receives the intermediates; `state.mask` equals the result of `extract(test_image)`
+    /// @note Runs on the CPU whatever `set_backend()` chose, on the whole frame, and without the pyramid;
+    ///       `set_pyramid()` must be 1.
+    void extract_state(cv::Mat test_image, SegmentationState& state);
+
+    /// @brief Bring `state` up to date after the pixels of `dirty` changed
+    /// @param test_image Edited source image, of the size `extract_state()` saw
+    /// @param dirty Rectangle of `test_image` holding every changed pixel
+    /// @param state From `extract_state()` or an earlier update; updated in place
+    /// @return Rectangle of `state.mask` that was rewritten, empty if the mask cannot have changed
+    /// @note `state.mask` then equals `extract(test_image)`. The luminance is converted only in `dirty`.
+    ///       Both CLAHE passes see the whole frame, since a change moves the contrast mapping of the
+    ///       neighbouring CLAHE tiles too; the images they produce are compared with the kept ones, and
+    ///       only the part that differs, grown by `AlternatingSequentialFilter::halo()` for the cascade
+    ///       and half the aperture for each median, runs through the later stages. Otsu's level is
+    ///       updated from the histogram of that part; if the level moves, threshold and blob removal
+    ///       redo the frame. Otherwise only blobs that touch the changed threshold pixels are relabelled.
+    cv::Rect update_region(cv::Mat test_image, cv::Rect dirty, SegmentationState& state);
+
+    /// @brief Extract arteries from one frame of a video, reusing estimates of earlier frames
+    /// @param frame Source frame as decoded by `cv::VideoCapture`
+    /// @param result Binary image with mask of large arteries, reused when its geometry matches
+    /// @param state Kept between the frames of one sequence, see `SequenceState`
+    /// @return `true` if the estimates were refreshed on this frame, whose mask then equals `extract(frame)`
+    /// @note A refreshed frame builds the `ClaheLut` tables of both CLAHE passes and is mapped through them.
+    ///       Between refreshes the luminance is equalized with the kept tables of the first CLAHE pass, the
+    ///       kept background is subtracted instead of running the cascade, and the difference is equalized
+    ///       with the kept tables of the second pass. The median, Otsu's level, and blob removal still run on
+    ///       every frame. Runs on the CPU on the whole frame; the pyramid applies to refreshed frames.
+    bool extract_frame(cv::Mat frame, cv::Mat& result, SequenceState& state);
+
+    /// @brief Extract arteries from an image too large to hold, a band of rows at a time
+    /// @param source Delivers the image top to bottom and is read once
+    /// @param sink Receives the mask top to bottom, a band at a time
+    /// @param stream Band height and where the intermediates are spilled
+    /// @return Error message, empty on success
+    /// @note Each stage runs over the bands in turn, and what a later stage needs of the whole image is
+    ///       collected on the way: the CLAHE tile histograms, Otsu's histogram, and blob areas, merged across
+    ///       bands in a union-find forest. Stages that read neighbouring rows see a sliding window of the
+    ///       band grown by their halo, `AlternatingSequentialFilter::halo()` rows for the cascade and half the
+    ///       aperture for the medians, whose rows are carried over from the band before. The luminance, the
+    ///       background-subtracted image, and the first median are spilled to unlinked files of one byte
+    ///       per pixel, at most two at a time, and read back band by band; the blob labels are computed
+    ///       again from the spilled median rather than stored. Memory is then about ten bytes per pixel of
+    ///       a band and its halos, plus a few bytes per blob. The mask equals `extract()`'s: both CLAHE passes
+    ///       run through `ClaheLut`, which builds and blends the tables as `cv::CLAHE` does. CPU only, without
+    ///       the pyramid or a field of view; the cascade and the medians run on column strips in parallel. Stage times are recorded
+    ///       per band, and `extract` includes reading the source and writing the sink.
+    std::string extract_stream(RowSource& source, RowSink& sink, StreamConfig const& stream = {});
+
+
+protected:
+    /// @brief Run every stage of `extract()`
+    /// @param test_image Source image as decoded by `cv::imread`
+    /// @param fov Field of view of `test_image` size, or empty
+    /// @param result Binary image with mask of large arteries, written in place if already sized
+    void segment(cv::Mat test_image, cv::Mat const& fov, cv::Mat& result);
+
+    /// @brief Run `color_filter` through `threshold` on the host
+    /// @param test_image Source image as decoded by `cv::imread`
+    /// @param fov Field of view of `test_image` size, or empty
+    /// @param threshold_img Receives the binary threshold image, valid until the next call
+    void segment_host(cv::Mat test_image, cv::Mat const& fov, cv::Mat& threshold_img);
+
+    /// @brief `segment_host()` with the cascade and the median run on tiles in parallel, see `set_tile_size()`
+    void segment_tiled(cv::Mat test_image, cv::Mat const& fov, cv::Mat& threshold_img);
+
+    /// @brief Whether `image` can join a stack of `set_micro_batch()`
+    bool stackable(cv::Mat const& image) const;
+
+    /// @brief Run every stage of `extract()` on images of one size, with the cascade over one stack of them
+    /// @param images Sources as decoded by `cv::imread`, all of one size and type, each `stackable()`
+    /// @param results Receives one mask per image
+    void segment_stack(std::span<cv::Mat const> images, std::span<cv::Mat> results);
+
+    /// @brief Pass `image` to the observer, if any
+    void observe(std::string const& stage, cv::Mat const& image) const {
+        if (observer_) observer_(stage, image);
+    }
+
+    /// @brief Median of `roi` of `src` into `dst`, reading the pixels around `roi`, as when filtering `src` whole
+    /// @param hist Receives the histogram of `dst`
+    void median_region(cv::Mat const& src, cv::Rect roi, cv::Mat dst, std::array<int, 256>& hist);
+
+    /// @brief Relabel the blobs of `state.threshold` whose pixels changed in `changed` and update `state.cleaned`
+    /// @return Rectangle of `state.cleaned` that was rewritten
+    cv::Rect relabel_blobs(SegmentationState& state, cv::Rect changed) const;
+
+    /// @brief Plane of `test_image` that `color_filter` enhances, before CLAHE
+    /// @return CV_8UC1 image, valid until the next call
+    cv::Mat& luminance_plane(cv::Mat test_image);
+
+    /// @brief Morphology cascade with kernels compiled for the fused passes of `default_morph_sizes`
+    using Cascade = SpecializedAlternatingSequentialFilter<default_morph_sizes>;
+
+    /// @brief Buffers of one thread working on tiles
+    struct TileWorker {
+        explicit TileWorker(std::vector<int> const& morph_sizes) : cascade{morph_sizes} {}
+
+        Cascade cascade;
+        FusedMedian median;
+    };
+
+    /// @brief Call `fn(tile, worker, index)` for every tile of a frame of `size`, in parallel
+    /// @note Each parallel stripe borrows an idle `TileWorker`, so buffers are reused across stripes and calls.
+    ///       `tile_histograms_` has one entry per tile during the call.
+    template <typename Fn>
+    void for_each_tile(cv::Size size, Fn&& fn);
+
+    /// @brief Call `fn(columns, worker, index)` for column strips of rows `width` wide, in parallel
+    /// @param min_width Narrowest strip worth a worker, e.g. a few times the halo it reads on each side
+    /// @note `tile_histograms_` has one entry per strip during the call.
+    template <typename Fn>
+    void for_each_strip(int width, int min_width, Fn&& fn);
+
+    std::unique_ptr<TileWorker> acquire_tile_worker();
+
+    void release_tile_worker(std::unique_ptr<TileWorker> worker);
+
+    /// @brief Buffers behind the intermediate images, sized on first use
+    struct Scratch {
+        cv::Mat lab;
+        cv::Mat luminance;
+        cv::Mat equalized;
+        cv::Mat close;
+        cv::Mat open;
+        cv::Mat background_removed;
+        cv::Mat channel;
+        cv::Mat clahe;
+        cv::Mat median;
+        std::array<int, 256> histogram;
+        cv::Mat fine;
+        std::vector<cv::Mat> pyramid;
+        std::vector<cv::Mat> upsampled;
+        cv::Mat coarse;
+        cv::Mat threshold;
+        cv::Mat labels;
+        cv::Mat stats;
+        cv::Mat centroids;
+        std::vector<int> areas;
+        std::vector<uchar> lut;
+        cv::Mat cleaned;
+        cv::Mat stack_equalized;
+        cv::Mat stack_background_removed;
+        cv::Mat stack_large_arteries;
+    };
+
+    /// @brief Make `buffer` hold an image of `size` and `type`, allocating only when they change
+    cv::Mat& fit(cv::Mat& buffer, cv::Size size, int type) {
+        if (buffer.size() != size || buffer.type() != type) {
+            buffer.create(size, type);
+            allocations_++;
+        }
+        return buffer;
+    }
+
+    /// @brief Make `buffer` hold `size` elements, allocating only when it has to grow
+    template <typename T>
+    std::vector<T>& fit(std::vector<T>& buffer, size_t size) {
+        if (size > buffer.capacity()) allocations_++;
+        buffer.resize(size);
+        return buffer;
+    }
+
+    ExtractConfig config_;
+    StageObserver observer_;
+    std::vector< cv::Mat > structuringElements_;
+    cv::Ptr<cv::CLAHE> clahe_;
+    Cascade cascade_;
+    Cascade fine_cascade_{{}};
+    Cascade coarse_cascade_{{}};
+    int pyramid_factor_ = 1;
+    int micro_batch_ = 1;
+    StageKernels kernels_;
+    FusedMedian median_;
+    Scratch scratch_;
+    size_t allocations_ = 0;
+    Profiler* profiler_ = nullptr;
+    Luminance luminance_ = Luminance::lab;
+    int tile_size_ = 0;
+    std::vector<cv::Rect> tiles_;
+    std::vector< std::array<int, 256> > tile_histograms_;
+    mutable std::mutex tile_workers_mutex_;
+    std::vector< std::unique_ptr<TileWorker> > idle_tile_workers_;
+    Backend backend_ = Backend::cpu;
+    std::unique_ptr<DeviceStages> device_;
+
+};
@@ -0,0 +1,583 @@
+/// image_io.hpp
+/// Purpose: Decode images and DRIVE masks through read-only memory mappings, and encode PNG with chosen settings.
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+
+// Defined by the build when libpng and libtiff are found; without them OpenCV's codecs are used
+#ifdef VESSEL_HAVE_PNG
+#include <png.h>
+#include <zlib.h>
+#endif
+#ifdef VESSEL_HAVE_TIFF
+#include <tiffio.h>
+#endif
+
+#include "band_stream.hpp"
+#include "mapped_file.hpp"
+
+inline bool libpng_available() {
+#ifdef VESSEL_HAVE_PNG
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// @brief Row filter libpng applies before compression; `adaptive` tries all of them per row
+enum class PngFilter { none, sub, up, average, paeth, adaptive };
+
+/// @brief How PNG outputs are compressed
+/// @note The defaults are those of `cv::imwrite` without a compression parameter: zlib level 1 with
+///       run-length matching and the sub filter. Given a level, `cv::imwrite` switches to libpng's adaptive
+///       filter search, which the defaults avoid. `fast()` also skips filtering, which costs nothing on a
+///       binary mask and little on the composite.
+struct PngSettings {
+    /// zlib level, 0 stores, 9 compresses hardest
+    int level = 1;
+    /// Restrict zlib to run-length matches, far faster on masks of long constant runs
+    bool rle = true;
+    /// Row filter, see `encodable()` for builds without libpng
+    PngFilter filter = PngFilter::sub;
+
+    bool operator==(PngSettings const&) const = default;
+
+    /// @brief Whether `encode_png()` can honour these settings in this build
+    /// @note Without libpng, `cv::imencode` picks the filter: sub at the default settings, adaptive at any other.
+    bool encodable() const {
+        return libpng_available() || *this == PngSettings{} || filter == PngFilter::adaptive;
+    }
+
+    static PngSettings fast() { return PngSettings{1, true, PngFilter::none}; }
+};
+
+/// @brief Whether `data` starts with a TIFF header, `II*\0` or `MM\0*`, or the BigTIFF one
+inline bool is_tiff(unsigned char const* data, size_t size) {
+    if (size < 4) return false;
+    if (data[0] == 'I' && data[1] == 'I') return (data[2] == 42 || data[2] == 43) && data[3] == 0;
+    if (data[0] == 'M' && data[1] == 'M') return data[2] == 0 && (data[3] == 42 || data[3] == 43);
+    return false;
+}
+
+/// @brief Whether the file at `path` starts with a TIFF header, see `is_tiff()`
+inline bool is_tiff_file(std::string const& path) {
+    unsigned char header[4];
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) return false;
+    bool const read = std::fread(header, 1, sizeof(header), file) == sizeof(header);
+    std::fclose(file);
+    return read && is_tiff(header, sizeof(header));
+}
+
+#ifdef VESSEL_HAVE_TIFF
+/// @brief Stop libtiff from printing warnings and errors to STDERR
+/// @note Installed once per process. Every failure is reported by the callers instead, through the
+///       log format the tool was asked for; the default handlers would break `--log-format json`.
+inline void silence_libtiff() {
+    static bool const silenced = [] {
+        TIFFSetWarningHandler(nullptr);
+        TIFFSetErrorHandler(nullptr);
+        return true;
+    }();
+    (void)silenced;
+}
+
+/// @brief Decode a baseline 8-bit RGB TIFF straight from memory with libtiff
+/// @param image Receives the BGR image, as `cv::imdecode` would return it
+/// @return `false` if this is not a strip-organized 8-bit RGB TIFF; the caller then falls back to `cv::imdecode`
+/// @note Each strip is decoded into a small buffer and swapped to BGR while it is still in cache,
+///       instead of decoding the whole image and converting it in a second pass.
+inline bool decode_tiff(unsigned char const* data, size_t size, cv::Mat& image) {
+    if (!is_tiff(data, size)) return false;
+    struct Source {
+        unsigned char const* data;
+        toff_t size, offset;
+    } source{data, size, 0};
+    auto read = [](thandle_t handle, tdata_t buffer, tsize_t n) -> tsize_t {
+        auto& s = *static_cast<Source*>(handle);
+        auto const count = std::min<toff_t>(n, s.size - std::min(s.offset, s.size));
+        // an offset past the end would form a pointer outside the mapping, even for a copy of nothing
+        if (count == 0) return 0;
+        std::memcpy(buffer, s.data + s.offset, count);
+        s.offset += count;
+        return static_cast<tsize_t>(count);
+    };
+    auto write = [](thandle_t, tdata_t, tsize_t) -> tsize_t { return 0; };
+    auto seek = [](thandle_t handle, toff_t offset, int whence) -> toff_t {
+        auto& s = *static_cast<Source*>(handle);
+        s.offset = (whence == SEEK_SET ? 0 : whence == SEEK_CUR ? s.offset : s.size) + offset;
+        return s.offset;
+    };
+    auto close = [](thandle_t) { return 0; };
+    auto file_size = [](thandle_t handle) { return static_cast<Source*>(handle)->size; };
+    // the bytes are already mapped; let libtiff read strips from them without a copy
+    auto map = [](thandle_t handle, tdata_t* base, toff_t* length) {
+        auto& s = *static_cast<Source*>(handle);
+        *base = const_cast<unsigned char*>(s.data);
+        *length = s.size;
+        return 1;
+    };
+    auto unmap = [](thandle_t, tdata_t, toff_t) {};
+
+    silence_libtiff();
+    TIFF* tif = TIFFClientOpen("memory", "r", &source, read, write, seek, close, file_size, map, unmap);
+    if (!tif) return false;
+    uint32_t width = 0, height = 0, rows_per_strip = 0;
+    uint16_t bits = 0, samples = 0, planar = 0, photometric = 0, format = SAMPLEFORMAT_UINT;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    bool ok = !TIFFIsTiled(tif) && bits == 8 && samples == 3 && planar == PLANARCONFIG_CONTIG
+        && photometric == PHOTOMETRIC_RGB && format == SAMPLEFORMAT_UINT
+        && width > 0 && height > 0 && rows_per_strip > 0 && width <= INT32_MAX / 3 && height <= INT32_MAX;
+    if (ok) {
+        rows_per_strip = std::min(rows_per_strip, height);
+        image.create(static_cast<int>(height), static_cast<int>(width), CV_8UC3);
+        cv::Mat strip(static_cast<int>(rows_per_strip), static_cast<int>(width), CV_8UC3);
+        for (uint32_t y = 0; y < height; y += rows_per_strip) {
+            int const rows = static_cast<int>(std::min(rows_per_strip, height - y));
+            auto const bytes = tsize_t(rows) * width * 3;
+            ok = TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, y, 0), strip.data, bytes) == bytes;
+            if (!ok) break;
+            cv::Mat rows_out = image.rowRange(static_cast<int>(y), static_cast<int>(y) + rows);
+            cv::cvtColor(strip.rowRange(0, rows), rows_out, cv::COLOR_RGB2BGR);
+        }
+    }
+    TIFFClose(tif);
+    if (!ok) image.release();
+    return ok;
+}
+#endif
+
+/// @brief Decode an encoded image held in memory
+/// @param flags `cv::imdecode` flags
+/// @return Decoded image, or an empty `Mat` on failure
+/// @note Colour TIFFs, the DRIVE inputs, go through libtiff when the build has it; everything else,
+///       and TIFF layouts `decode_tiff` does not handle, through `cv::imdecode`.
+inline cv::Mat decode_image(unsigned char const* data, size_t size, int flags) {
+    if (!size) return cv::Mat();
+    cv::Mat image;
+#ifdef VESSEL_HAVE_TIFF
+    if (flags == cv::IMREAD_COLOR && decode_tiff(data, size, image)) return image;
+#endif
+    cv::Mat const encoded(1, static_cast<int>(size), CV_8UC1, const_cast<unsigned char*>(data));
+    return cv::imdecode(encoded, flags);
+}
+
+/// @brief Decode a memory-mapped image file
+/// @param file Mapping of the image file
+/// @param path Image file, used in error text
+/// @param flags `cv::imdecode` flags
+/// @param error Receives the reason on failure
+/// @return Decoded image, or an empty `Mat` on failure
+inline cv::Mat decode_mapped(MappedFile const& file, std::string const& path, int flags, std::string& error) {
+    // The decoder reads straight from the page cache, there is no intermediate stdio buffer
+    auto image = decode_image(file.data(), file.size(), flags);
+    if (image.empty()) {
+        error = path + " could not be decoded";
+    }
+    return image;
+}
+
+/// @brief Decode an image file through a read-only memory mapping
+/// @param path Image file
+/// @param flags `cv::imdecode` flags
+/// @param error Receives the reason on failure
+/// @return Decoded image, or an empty `Mat` on failure
+inline cv::Mat imread_mapped(std::string const& path, int flags, std::string& error) {
+    MappedFile file(path);
+    if (!file.error().empty()) {
+        error = path + ": " + file.error();
+        return cv::Mat();
+    }
+    return decode_mapped(file, path, flags, error);
+}
+
+/// @brief Read a single-channel mask
+/// @param path Mask image; GIF, which older OpenCV releases cannot `imread`, is read through `cv::VideoCapture`
+/// @return CV_8UC1 mask, or an empty `Mat` if it could not be read
+inline cv::Mat read_mask(std::string const& path) {
+    std::string error;
+    auto mask = imread_mapped(path, cv::IMREAD_GRAYSCALE, error);
+    if (mask.empty()) {
+        cv::VideoCapture capture(path);
+        cv::Mat frame;
+        if (capture.isOpened() && capture.read(frame) && !frame.empty()) {
+            if (frame.channels() == 1) {
+                mask = frame;
+            } else {
+                cv::cvtColor(frame, mask, cv::COLOR_BGR2GRAY);
+            }
+        }
+    }
+    return mask;
+}
+
+#ifdef VESSEL_HAVE_PNG
+/// @brief `encode_png` through libpng, which exposes the row filter
+inline bool encode_png_libpng(cv::Mat const& image, bool bilevel, PngSettings const& settings, std::vector<unsigned char>& out) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (!info) {
+        png_destroy_write_struct(&png, nullptr);
+        return false;
+    }
+    // everything libpng may longjmp over is set up before setjmp
+    std::vector<unsigned char> packed;
+    std::vector<png_bytep> rows(image.rows);
+    if (bilevel) {
+        size_t const row_bytes = (image.cols + 7) / 8;
+        packed.assign(row_bytes * image.rows, 0);
+        for (int y = 0; y < image.rows; y++) {
+            auto const* row = image.ptr<uint8_t>(y);
+            auto* bits = packed.data() + row_bytes * y;
+            for (int x = 0; x < image.cols; x++) bits[x >> 3] |= (row[x] != 0) << (7 - (x & 7));
+            rows[y] = bits;
+        }
+    } else {
+        for (int y = 0; y < image.rows; y++) rows[y] = const_cast<png_bytep>(image.ptr<uint8_t>(y));
+    }
+    out.clear();
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+    png_set_write_fn(png, &out, [](png_structp p, png_bytep data, png_size_t size) {
+        auto& buffer = *static_cast<std::vector<unsigned char>*>(png_get_io_ptr(p));
+        buffer.insert(buffer.end(), data, data + size);
+    }, nullptr);
+    int const color = image.channels() == 1 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB;
+    png_set_IHDR(png, info, image.cols, image.rows, bilevel ? 1 : 8, color,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, settings.level);
+    png_set_compression_strategy(png, settings.rle ? Z_RLE : Z_DEFAULT_STRATEGY);
+    static int const filters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, filters[static_cast<int>(settings.filter)]);
+    png_write_info(png, info);
+    if (image.channels() == 3) png_set_bgr(png);
+    png_write_image(png, rows.data());
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+#endif
+
+/// @brief Encode a PNG
+/// @param image CV_8UC1 or BGR CV_8UC3 image
+/// @param bilevel Store a CV_8UC1 mask at 1 bit per pixel, non-zero pixels white
+/// @param settings Compression level and filter
+/// @param out Receives the file contents
+/// @return `false` if the encoder failed, or `settings` are not `encodable()`
+inline bool encode_png(cv::Mat const& image, bool bilevel, PngSettings const& settings, std::vector<unsigned char>& out) {
+    CV_Assert(image.depth() == CV_8U && (image.channels() == 1 || image.channels() == 3));
+    CV_Assert(!bilevel || image.channels() == 1);
+#ifdef VESSEL_HAVE_PNG
+    return encode_png_libpng(image, bilevel, settings, out);
+#else
+    // without a level OpenCV encodes at the defaults, sub filter included
+    if (settings == PngSettings{}) return cv::imencode(".png", image, out, {cv::IMWRITE_PNG_BILEVEL, bilevel ? 1 : 0});
+    if (settings.filter != PngFilter::adaptive) return false;
+    // a level resets OpenCV's strategy to the default, so the strategy has to come after it
+    return cv::imencode(".png", image, out, {cv::IMWRITE_PNG_BILEVEL, bilevel ? 1 : 0,
+        cv::IMWRITE_PNG_COMPRESSION, settings.level,
+        cv::IMWRITE_PNG_STRATEGY, settings.rle ? cv::IMWRITE_PNG_STRATEGY_RLE : cv::IMWRITE_PNG_STRATEGY_DEFAULT});
+#endif
+}
+
+/// @brief `RowSource` over an image that is already decoded, served `rows` at a time
+class DecodedRowSource : public RowSource {
+public:
+    DecodedRowSource(cv::Mat image, int rows) : image_{std::move(image)}, rows_{rows} {}
+
+    cv::Size size() const override { return image_.size(); }
+
+    bool read(cv::Mat& rows) override {
+        if (y_ >= image_.rows) return false;
+        int const n = std::min(rows_, image_.rows - y_);
+        rows = image_.rowRange(y_, y_ + n);
+        y_ += n;
+        return true;
+    }
+
+    std::string const& error() const override { return error_; }
+
+private:
+    cv::Mat image_;
+    int rows_;
+    int y_ = 0;
+    std::string error_;
+};
+
+#ifdef VESSEL_HAVE_TIFF
+/// @brief `RowSource` reading an 8-bit RGB TIFF file a strip, a row of tiles, or `rows` scanlines at a time
+/// @note Only the rows being converted are held: a strip, a row of tiles, or, for strips taller than `rows`
+///       such as a whole image in one strip, `rows` scanlines read one by one. Memory is thus the width times
+///       the larger of `rows` and the tile height. Check `error()` after construction; other layouts are
+///       rejected there, like `decode_tiff` does.
+class TiffRowSource : public RowSource {
+public:
+    /// @param rows Most rows read at once from a stripped file
+    explicit TiffRowSource(std::string const& path, int rows = 256) {
+        // libtiff is only given files that claim to be TIFFs
+        if (!is_tiff_file(path)) {
+            error_ = path + ": not a TIFF file";
+            return;
+        }
+        silence_libtiff();
+        tif_ = TIFFOpen(path.c_str(), "r");
+        if (!tif_) {
+            error_ = path + ": not a TIFF file";
+            return;
+        }
+        uint32_t width = 0, height = 0;
+        uint16_t bits = 0, samples = 0, planar = 0, photometric = 0, format = SAMPLEFORMAT_UINT;
+        TIFFGetField(tif_, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tif_, TIFFTAG_IMAGELENGTH, &height);
+        TIFFGetFieldDefaulted(tif_, TIFFTAG_BITSPERSAMPLE, &bits);
+        TIFFGetFieldDefaulted(tif_, TIFFTAG_SAMPLESPERPIXEL, &samples);
+        TIFFGetFieldDefaulted(tif_, TIFFTAG_PLANARCONFIG, &planar);
+        TIFFGetFieldDefaulted(tif_, TIFFTAG_SAMPLEFORMAT, &format);
+        TIFFGetField(tif_, TIFFTAG_PHOTOMETRIC, &photometric);
+        tiled_ = TIFFIsTiled(tif_);
+        if (tiled_) {
+            TIFFGetField(tif_, TIFFTAG_TILEWIDTH, &tile_width_);
+            TIFFGetField(tif_, TIFFTAG_TILELENGTH, &chunk_rows_);
+        } else {
+            TIFFGetFieldDefaulted(tif_, TIFFTAG_ROWSPERSTRIP, &chunk_rows_);
+        }
+        if (bits != 8 || samples != 3 || planar != PLANARCONFIG_CONTIG || photometric != PHOTOMETRIC_RGB
+            || format != SAMPLEFORMAT_UINT || width == 0 || height == 0 || width > INT32_MAX / 3 || height > INT32_MAX
+            || chunk_rows_ == 0 || (tiled_ && tile_width_ == 0)) {
+            error_ = path + ": not an 8-bit RGB TIFF";
+            return;
+        }
+        size_ = cv::Size(static_cast<int>(width), static_cast<int>(height));
+        chunk_rows_ = std::min<uint32_t>(chunk_rows_, height);
+        // libtiff decodes a strip whole, so tall strips are read a scanline at a time instead
+        scanlines_ = !tiled_ && chunk_rows_ > uint32_t(std::max(rows, 1));
+        if (scanlines_) chunk_rows_ = uint32_t(std::max(rows, 1));
+        rgb_.create(static_cast<int>(chunk_rows_), size_.width, CV_8UC3);
+        if (tiled_) tile_.resize(TIFFTileSize(tif_));
+    }
+
+    ~TiffRowSource() override {
+        if (tif_) TIFFClose(tif_);
+    }
+
+    TiffRowSource(TiffRowSource const&) = delete;
+    TiffRowSource& operator=(TiffRowSource const&) = delete;
+
+    cv::Size size() const override { return size_; }
+
+    bool read(cv::Mat& rows) override {
+        if (!error_.empty() || y_ >= uint32_t(size_.height)) return false;
+        int const n = static_cast<int>(std::min<uint32_t>(chunk_rows_, size_.height - y_));
+        if (tiled_) {
+            // a row of tiles, each copied into place; tiles at the edges are padded by the file
+            size_t const tile_row_bytes = size_t(tile_width_) * 3;
+            for (uint32_t x = 0; x < uint32_t(size_.width); x += tile_width_) {
+                if (TIFFReadTile(tif_, tile_.data(), x, y_, 0, 0) < 0) {
+                    error_ = "cannot read the tile at " + std::to_string(x) + "," + std::to_string(y_);
+                    return false;
+                }
+                size_t const bytes = size_t(std::min<uint32_t>(tile_width_, size_.width - x)) * 3;
+                for (int r = 0; r < n; r++) std::memcpy(rgb_.ptr<uchar>(r) + size_t(x) * 3, tile_.data() + r * tile_row_bytes, bytes);
+            }
+        } else if (scanlines_) {
+            for (int r = 0; r < n; r++) {
+                if (TIFFReadScanline(tif_, rgb_.ptr<uchar>(r), y_ + r, 0) < 0) {
+                    error_ = "cannot read row " + std::to_string(y_ + r);
+                    return false;
+                }
+            }
+        } else {
+            auto const bytes = tsize_t(n) * size_.width * 3;
+            if (TIFFReadEncodedStrip(tif_, TIFFComputeStrip(tif_, y_, 0), rgb_.data, bytes) != bytes) {
+                error_ = "cannot read the strip at row " + std::to_string(y_);
+                return false;
+            }
+        }
+        cv::cvtColor(rgb_.rowRange(0, n), bgr_, cv::COLOR_RGB2BGR);
+        rows = bgr_;
+        y_ += n;
+        return true;
+    }
+
+    std::string const& error() const override { return error_; }
+
+private:
+    TIFF* tif_ = nullptr;
+    bool tiled_ = false;
+    /// Whether strips are taller than the rows read at once
+    bool scanlines_ = false;
+    uint32_t tile_width_ = 0;
+    /// Rows per strip, per row of tiles, or per read of scanlines
+    uint32_t chunk_rows_ = 0;
+    cv::Size size_;
+    uint32_t y_ = 0;
+    cv::Mat rgb_, bgr_;
+    std::vector<unsigned char> tile_;
+    std::string error_;
+};
+#endif
+
+/// @brief Open `path` for `ExtractArteries::extract_stream()`
+/// @param rows Rows per read when the image has to be decoded whole, and most rows of a TIFF held at once
+/// @param error Receives the reason on failure
+/// @return Source, or `nullptr` on failure
+/// @note 8-bit RGB TIFFs stream strip by strip when the build has libtiff; every other image is decoded
+///       whole first, so only the intermediates of the segmentation stream.
+inline std::unique_ptr<RowSource> open_row_source(std::string const& path, int rows, std::string& error) {
+#ifdef VESSEL_HAVE_TIFF
+    if (is_tiff_file(path)) {
+        auto tiff = std::make_unique<TiffRowSource>(path, rows);
+        if (tiff->error().empty()) return tiff;
+    }
+#endif
+    auto image = imread_mapped(path, cv::IMREAD_COLOR, error);
+    if (image.empty()) return nullptr;
+    return std::make_unique<DecodedRowSource>(std::move(image), rows);
+}
+
+/// @brief `RowSink` writing a binary PBM (`P4`), the layout of `encode_bits`, row by row
+class PbmRowSink : public RowSink {
+public:
+    PbmRowSink(std::string const& path, cv::Size size) : path_{path}, size_{size} {
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) {
+            error_ = path + ": " + std::strerror(errno);
+            return;
+        }
+        std::fprintf(file_, "P4\n%d %d\n", size.width, size.height);
+        packed_.resize((size.width + 7) / 8);
+    }
+
+    ~PbmRowSink() override {
+        if (file_) std::fclose(file_);
+    }
+
+    PbmRowSink(PbmRowSink const&) = delete;
+    PbmRowSink& operator=(PbmRowSink const&) = delete;
+
+    bool write(cv::Mat const& rows) override {
+        CV_Assert(rows.type() == CV_8UC1 && rows.cols == size_.width);
+        for (int y = 0; y < rows.rows && error_.empty(); y++) {
+            auto const* row = rows.ptr<uint8_t>(y);
+            std::fill(packed_.begin(), packed_.end(), 0);
+            for (int x = 0; x < rows.cols; x++) packed_[x >> 3] |= (row[x] != 0) << (7 - (x & 7));
+            if (std::fwrite(packed_.data(), 1, packed_.size(), file_) != packed_.size()) error_ = path_ + ": write failed";
+        }
+        return error_.empty();
+    }
+
+    bool close() override {
+        if (file_ && std::fclose(file_) != 0 && error_.empty()) error_ = path_ + ": write failed";
+        file_ = nullptr;
+        return error_.empty();
+    }
+
+    std::string const& error() const override { return error_; }
+
+private:
+    std::string path_;
+    cv::Size size_;
+    std::FILE* file_ = nullptr;
+    std::vector<unsigned char> packed_;
+    std::string error_;
+};
+
+#ifdef VESSEL_HAVE_PNG
+/// @brief `RowSink` writing a 1-bit PNG with libpng, row by row
+class PngRowSink : public RowSink {
+public:
+    PngRowSink(std::string const& path, cv::Size size, PngSettings const& settings) : path_{path}, size_{size} {
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) {
+            error_ = path + ": " + std::strerror(errno);
+            return;
+        }
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        info_ = png_ ? png_create_info_struct(png_) : nullptr;
+        if (!info_ || setjmp(png_jmpbuf(png_))) {
+            fail();
+            return;
+        }
+        packed_.resize((size.width + 7) / 8);
+        png_init_io(png_, file_);
+        png_set_IHDR(png_, info_, size.width, size.height, 1, PNG_COLOR_TYPE_GRAY,
+            PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_compression_level(png_, settings.level);
+        png_set_compression_strategy(png_, settings.rle ? Z_RLE : Z_DEFAULT_STRATEGY);
+        static int const filters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+        png_set_filter(png_, PNG_FILTER_TYPE_BASE, filters[static_cast<int>(settings.filter)]);
+        png_write_info(png_, info_);
+    }
+
+    ~PngRowSink() override {
+        png_destroy_write_struct(&png_, &info_);
+        if (file_) std::fclose(file_);
+    }
+
+    PngRowSink(PngRowSink const&) = delete;
+    PngRowSink& operator=(PngRowSink const&) = delete;
+
+    bool write(cv::Mat const& rows) override {
+        CV_Assert(rows.type() == CV_8UC1 && rows.cols == size_.width);
+        if (!error_.empty()) return false;
+        if (setjmp(png_jmpbuf(png_))) {
+            fail();
+            return false;
+        }
+        for (int y = 0; y < rows.rows; y++) {
+            auto const* row = rows.ptr<uint8_t>(y);
+            std::fill(packed_.begin(), packed_.end(), 0);
+            for (int x = 0; x < rows.cols; x++) packed_[x >> 3] |= (row[x] != 0) << (7 - (x & 7));
+            png_write_row(png_, packed_.data());
+        }
+        return true;
+    }
+
+    bool close() override {
+        if (!error_.empty()) return false;
+        if (setjmp(png_jmpbuf(png_))) {
+            fail();
+            return false;
+        }
+        png_write_end(png_, info_);
+        if (std::fclose(file_) != 0) error_ = path_ + ": write failed";
+        file_ = nullptr;
+        return error_.empty();
+    }
+
+    std::string const& error() const override { return error_; }
+
+private:
+    void fail() { error_ = path_ + ": PNG encoding failed"; }
+
+    std::string path_;
+    cv::Size size_;
+    std::FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+    std::vector<unsigned char> packed_;
+    std::string error_;
+};
+#endif
@@ -0,0 +1,76 @@
+/// logging.hpp
+/// Purpose: Diagnostics on STDERR, as the usual text or as one JSON object per line for log collectors.
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <utility>
+
+enum class LogFormat { text, json };
+
+enum class LogLevel { info, warning, error };
+
+inline char const* log_level_name(LogLevel level) {
+    static char const* const names[] = { "info", "warning", "error" };
+    return names[static_cast<int>(level)];
+}
+
+/// @brief Field of a JSON log line besides the time, level, and message
+using LogField = std::pair<char const*, std::string>;
+
+/// @brief `text` as the contents of a JSON string, without the quotes
+inline std::string json_escape(std::string const& text) {
+    std::string out;
+    out.reserve(text.size());
+    for (unsigned char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+    }
+    return out;
+}
+
+/// @brief Write one diagnostic to STDERR
+/// @param fields Extra members of a JSON line; text lines leave them out, the message already says it
+/// @note Text lines read as they always have, `Error: <message>` for errors and the bare message
+///       otherwise. JSON lines are `{"time": "<UTC, ISO 8601>", "level": "...", "message": "...", ...}`.
+///       Either is written in one call, so lines of concurrent workers do not interleave.
+inline void log_message(LogFormat format, LogLevel level, std::string const& message,
+    std::initializer_list<LogField> fields = {})
+{
+    std::string line;
+    if (format == LogFormat::text) {
+        line = (level == LogLevel::error ? "Error: " : "") + message + "\n";
+    } else {
+        auto const now = std::chrono::system_clock::now();
+        auto const seconds = std::chrono::system_clock::to_time_t(now);
+        auto const millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+        std::tm utc{};
+        ::gmtime_r(&seconds, &utc);
+        char time[32];
+        auto const length = std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &utc);
+        std::snprintf(time + length, sizeof(time) - length, ".%03dZ", static_cast<int>(millis));
+        line = std::string("{\"time\": \"") + time + "\", \"level\": \"" + log_level_name(level)
+            + "\", \"message\": \"" + json_escape(message) + "\"";
+        for (auto const& [key, value] : fields) line += std::string(", \"") + key + "\": \"" + json_escape(value) + "\"";
+        line += "}\n";
+    }
+    std::cerr << line << std::flush;
+}
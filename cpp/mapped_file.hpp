@@ -0,0 +1,61 @@
+/// mapped_file.hpp
+/// Purpose: Read-only memory mapping of a whole file, for decoding images without a stdio copy.
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// @brief Maps a file for reading for the lifetime of the object
+/// @note Check `error()` after construction; an empty file maps to `size() == 0` without error.
+class MappedFile {
+public:
+    /// @param path File to map
+    /// @param advice `madvise` hint for the expected access pattern
+    explicit MappedFile(std::string const& path, int advice = MADV_SEQUENTIAL) {
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error_ = std::strerror(errno);
+            return;
+        }
+        struct stat st{};
+        if (::fstat(fd, &st) != 0) {
+            error_ = std::strerror(errno);
+        } else if (!S_ISREG(st.st_mode)) {
+            error_ = "not a regular file";
+        } else if (st.st_size > 0) {
+            void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                error_ = std::strerror(errno);
+            } else {
+                data_ = static_cast<unsigned char const*>(data);
+                size_ = st.st_size;
+                // decoders read front to back, index lookups jump around
+                ::madvise(data, size_, advice);
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_) ::munmap(const_cast<unsigned char*>(data_), size_);
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    unsigned char const* data() const { return data_; }
+    size_t size() const { return size_; }
+    /// @brief Reason the file could not be mapped, empty on success
+    std::string const& error() const { return error_; }
+
+private:
+    unsigned char const* data_ = nullptr;
+    size_t size_ = 0;
+    std::string error_;
+};
@@ -0,0 +1,163 @@
+/// mask_codec.hpp
+/// Purpose: Compact encodings of binary masks: 1 bit per pixel, and run lengths with optional zstd.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// Defined by the build when libzstd is found
+#ifdef VESSEL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/// @brief How the command line tool and the server store a segmentation result
+enum class OutputFormat { mask, bits, rle, rle_zstd, composite };
+
+inline bool zstd_available() {
+#ifdef VESSEL_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// @brief Binary PBM (`P4`): rows of 1 bit per pixel, most significant bit first, padded to a byte
+/// @param mask CV_8UC1 mask; non-zero pixels are stored as 1, which PBM viewers show black
+/// @param out Receives the file contents
+inline void encode_bits(cv::Mat const& mask, std::vector<unsigned char>& out) {
+    CV_Assert(mask.type() == CV_8UC1);
+    auto const header = "P4\n" + std::to_string(mask.cols) + " " + std::to_string(mask.rows) + "\n";
+    size_t const row_bytes = (mask.cols + 7) / 8;
+    out.assign(header.begin(), header.end());
+    out.resize(header.size() + row_bytes * mask.rows);
+    auto* packed = out.data() + header.size();
+    for (int y = 0; y < mask.rows; y++, packed += row_bytes) {
+        auto const* row = mask.ptr<uint8_t>(y);
+        int x = 0;
+        for (size_t b = 0; b < row_bytes; b++) {
+            unsigned char byte = 0;
+            for (int bit = 7; bit >= 0 && x < mask.cols; bit--, x++) {
+                byte |= (row[x] != 0) << bit;
+            }
+            packed[b] = byte;
+        }
+    }
+}
+
+/////////////////////////
+// Run-length mask
+//
+// "VRLE" | u32 width | u32 height | u8 compression (0 none, 1 zstd) | runs
+//
+// Integers are little endian. `runs` are LEB128 varints of alternating zero and non-zero run lengths
+// over the pixels in raster order, starting with a zero run that may be empty. With compression 1
+// the runs are one zstd frame.
+
+inline constexpr char rle_magic[4] = {'V', 'R', 'L', 'E'};
+inline constexpr size_t rle_header_bytes = 13;
+
+/// @brief Run-length encode a mask
+/// @param mask CV_8UC1 mask, non-zero pixels are foreground; decoded back as 255
+/// @param compress Wrap the runs in a zstd frame; requires `zstd_available()`
+/// @param out Receives the encoded mask
+inline void encode_rle(cv::Mat const& mask, bool compress, std::vector<unsigned char>& out) {
+    CV_Assert(mask.type() == CV_8UC1);
+    CV_Assert(!compress || zstd_available());
+    out.assign(rle_magic, rle_magic + 4);
+    auto put_u32 = [&](uint32_t v) {
+        for (int i = 0; i < 4; i++) out.push_back((v >> 8*i) & 0xff);
+    };
+    put_u32(mask.cols);
+    put_u32(mask.rows);
+    out.push_back(compress ? 1 : 0);
+
+    std::vector<unsigned char> runs;
+    auto put_run = [&](uint64_t n) {
+        do {
+            unsigned char const low = n & 0x7f;
+            n >>= 7;
+            runs.push_back(low | (n ? 0x80 : 0));
+        } while (n);
+    };
+    bool value = false;
+    uint64_t run = 0;
+    for (int y = 0; y < mask.rows; y++) {
+        auto const* row = mask.ptr<uint8_t>(y);
+        for (int x = 0; x < mask.cols; x++) {
+            if ((row[x] != 0) != value) {
+                put_run(run);
+                value = !value;
+                run = 0;
+            }
+            run++;
+        }
+    }
+    put_run(run);
+
+    if (!compress) {
+        out.insert(out.end(), runs.begin(), runs.end());
+        return;
+    }
+#ifdef VESSEL_HAVE_ZSTD
+    auto const offset = out.size();
+    out.resize(offset + ZSTD_compressBound(runs.size()));
+    auto const size = ZSTD_compress(out.data() + offset, out.size() - offset, runs.data(), runs.size(), 3);
+    CV_Assert(!ZSTD_isError(size));
+    out.resize(offset + size);
+#endif
+}
+
+/// @brief Decode a mask written by `encode_rle`
+/// @return CV_8UC1 mask of 0 and 255, or an empty `Mat` if `data` is not a valid encoding
+inline cv::Mat decode_rle(unsigned char const* data, size_t size) {
+    if (size < rle_header_bytes || std::memcmp(data, rle_magic, 4) != 0) return cv::Mat();
+    auto get_u32 = [&](size_t at) {
+        return uint32_t(data[at]) | uint32_t(data[at+1]) << 8 | uint32_t(data[at+2]) << 16 | uint32_t(data[at+3]) << 24;
+    };
+    auto const cols = get_u32(4), rows = get_u32(8);
+    if (cols > uint32_t(INT32_MAX) || rows > uint32_t(INT32_MAX)) return cv::Mat();
+    auto const* runs = data + rle_header_bytes;
+    size_t runs_size = size - rle_header_bytes;
+
+    std::vector<unsigned char> decompressed;
+    if (data[12] == 1) {
+#ifdef VESSEL_HAVE_ZSTD
+        auto const bound = ZSTD_getFrameContentSize(runs, runs_size);
+        if (bound == ZSTD_CONTENTSIZE_ERROR || bound == ZSTD_CONTENTSIZE_UNKNOWN) return cv::Mat();
+        decompressed.resize(bound);
+        auto const n = ZSTD_decompress(decompressed.data(), decompressed.size(), runs, runs_size);
+        if (ZSTD_isError(n)) return cv::Mat();
+        runs = decompressed.data();
+        runs_size = n;
+#else
+        return cv::Mat();
+#endif
+    } else if (data[12] != 0) {
+        return cv::Mat();
+    }
+
+    cv::Mat mask(rows, cols, CV_8UC1);
+    auto* pixel = mask.data;
+    uint64_t remaining = uint64_t(rows) * cols;
+    unsigned char value = 0;
+    size_t at = 0;
+    while (at < runs_size) {
+        uint64_t run = 0;
+        bool complete = false;
+        for (int shift = 0; at < runs_size && shift < 64 && !complete; shift += 7) {
+            auto const byte = runs[at++];
+            run |= uint64_t(byte & 0x7f) << shift;
+            complete = !(byte & 0x80);
+        }
+        if (!complete || run > remaining) return cv::Mat();
+        std::memset(pixel, value, run);
+        pixel += run;
+        remaining -= run;
+        value ^= 255;
+    }
+    return remaining ? cv::Mat() : mask;
+}
@@ -0,0 +1,157 @@
+/// median.hpp
+/// Purpose: 3x3 median filter that builds the histogram of its output in the same pass.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+/// @brief `cv::medianBlur(src, dst, 3)` fused with the 256-bin histogram of `dst`
+/// @note Each column triple is sorted once into low/middle/high, and the median of the 3x3 window is
+///       med(max of lows, med of middles, min of highs), 16 min/max per pixel. Rows are vectorized with
+///       OpenCV universal intrinsics; the histogram is counted from the freshly written row while it is
+///       still in L1, so the image is swept once instead of once for the median and once for Otsu.
+///       The border is replicated, as `cv::medianBlur` does, so the result is identical.
+class FusedMedian {
+public:
+    /// @brief Filter and count
+    /// @param src CV_8UC1 source
+    /// @param dst CV_8UC1 result, must not alias `src`; (re)allocated only when its geometry differs
+    /// @param fov Optional mask of `src` size; when given, only pixels where it is non-zero are counted
+    /// @param hist Receives the histogram of `dst`
+    void apply(cv::Mat const& src, cv::Mat& dst, cv::Mat const& fov, std::array<int, 256>& hist) {
+        apply(src, cv::Rect(0, 0, src.cols, src.rows), dst, fov, hist);
+    }
+
+    /// @brief Filter and count the part of `src` inside `roi`
+    /// @param src CV_8UC1 source; pixels around `roi` are read as neighbours, the border of `src` is replicated
+    /// @param roi Rectangle of `src` to filter
+    /// @param dst CV_8UC1 result of `roi` size, must not alias `src`; may be a view into a larger image
+    /// @param fov Optional mask of `src` size; when given, only pixels where it is non-zero are counted
+    /// @param hist Receives the histogram of `dst`
+    /// @note Filtering the tiles of an image one by one gives exactly the result of filtering it whole.
+    void apply(cv::Mat const& src, cv::Rect roi, cv::Mat& dst, cv::Mat const& fov, std::array<int, 256>& hist) {
+        CV_Assert(src.type() == CV_8UC1 && (fov.empty() || (fov.size() == src.size() && fov.type() == CV_8UC1)));
+        CV_Assert((roi & cv::Rect(0, 0, src.cols, src.rows)) == roi);
+        if (dst.size() != roi.size() || dst.type() != CV_8UC1) {
+            dst.create(roi.size(), CV_8UC1);
+            allocations_++;
+        }
+        int const cols = roi.width;
+        // padded by one neighbouring, or replicated, column on each side
+        if (size_t(cols + 2) > lo_.capacity()) allocations_++;
+        lo_.resize(cols + 2);
+        mid_.resize(cols + 2);
+        hi_.resize(cols + 2);
+        for (auto& h : counts_) h.fill(0);
+
+        int const first = std::max(roi.x - 1, 0);
+        int const last = std::min(roi.x + roi.width + 1, src.cols);
+        int const offset = first - (roi.x - 1);
+        for (int y = 0; y < roi.height; y++) {
+            int const row = roi.y + y;
+            sort_columns(src.ptr<uint8_t>(std::max(row-1, 0)) + first, src.ptr<uint8_t>(row) + first,
+                src.ptr<uint8_t>(std::min(row+1, src.rows-1)) + first, offset, last - first);
+            auto* out = dst.ptr<uint8_t>(y);
+            merge_columns(out, cols);
+            count(out, fov.empty() ? nullptr : fov.ptr<uint8_t>(row) + roi.x, cols);
+        }
+
+        for (int i = 0; i < 256; i++) {
+            hist[i] = counts_[0][i] + counts_[1][i] + counts_[2][i] + counts_[3][i];
+        }
+    }
+
+    /// @brief Number of times an internal buffer had to be (re)allocated, `dst` included
+    size_t allocations() const { return allocations_; }
+
+private:
+    static uint8_t med3(uint8_t a, uint8_t b, uint8_t c) {
+        return std::max(std::min(a, b), std::min(std::max(a, b), c));
+    }
+
+    /// @brief Sort each column of the rows above, at, and below into `lo_`, `mid_`, `hi_`
+    /// @param offset Index of the first column in the padded buffers, 1 when it must be replicated to the left
+    /// @param cols Number of columns to sort; the padded buffers' last entry is replicated if not covered
+    void sort_columns(uint8_t const* a, uint8_t const* b, uint8_t const* c, int offset, int cols) {
+        auto* lo = lo_.data() + offset;
+        auto* mid = mid_.data() + offset;
+        auto* hi = hi_.data() + offset;
+        int x = 0;
+#if CV_SIMD
+        int const lanes = cv::VTraits<cv::v_uint8>::vlanes();
+        for (; x + lanes <= cols; x += lanes) {
+            auto const va = cv::vx_load(a + x), vb = cv::vx_load(b + x), vc = cv::vx_load(c + x);
+            auto const t = cv::v_min(va, vb), u = cv::v_max(va, vb);
+            auto const v = cv::v_max(t, vc);
+            cv::v_store(lo + x, cv::v_min(t, vc));
+            cv::v_store(mid + x, cv::v_min(u, v));
+            cv::v_store(hi + x, cv::v_max(u, v));
+        }
+#endif
+        for (; x < cols; x++) {
+            uint8_t const t = std::min(a[x], b[x]), u = std::max(a[x], b[x]);
+            uint8_t const v = std::max(t, c[x]);
+            lo[x] = std::min(t, c[x]);
+            mid[x] = std::min(u, v);
+            hi[x] = std::max(u, v);
+        }
+        if (offset) {
+            lo_[0] = lo_[1]; mid_[0] = mid_[1]; hi_[0] = hi_[1];
+        }
+        auto const end = lo_.size() - 1;
+        if (size_t(offset + cols) == end) {
+            lo_[end] = lo_[end-1]; mid_[end] = mid_[end-1]; hi_[end] = hi_[end-1];
+        }
+    }
+
+    /// @brief Median of each 3x3 window from the sorted columns at `x-1`, `x`, `x+1`
+    void merge_columns(uint8_t* out, int cols) const {
+        auto const* lo = lo_.data();
+        auto const* mid = mid_.data();
+        auto const* hi = hi_.data();
+        int x = 0;
+#if CV_SIMD
+        int const lanes = cv::VTraits<cv::v_uint8>::vlanes();
+        for (; x + lanes <= cols; x += lanes) {
+            auto const max_lo = cv::v_max(cv::v_max(cv::vx_load(lo + x), cv::vx_load(lo + x+1)), cv::vx_load(lo + x+2));
+            auto const min_hi = cv::v_min(cv::v_min(cv::vx_load(hi + x), cv::vx_load(hi + x+1)), cv::vx_load(hi + x+2));
+            auto const m0 = cv::vx_load(mid + x), m1 = cv::vx_load(mid + x+1), m2 = cv::vx_load(mid + x+2);
+            auto const med_mid = cv::v_max(cv::v_min(m0, m1), cv::v_min(cv::v_max(m0, m1), m2));
+            auto const result = cv::v_max(cv::v_min(max_lo, med_mid), cv::v_min(cv::v_max(max_lo, med_mid), min_hi));
+            cv::v_store(out + x, result);
+        }
+#endif
+        for (; x < cols; x++) {
+            uint8_t const max_lo = std::max(std::max(lo[x], lo[x+1]), lo[x+2]);
+            uint8_t const min_hi = std::min(std::min(hi[x], hi[x+1]), hi[x+2]);
+            out[x] = med3(max_lo, med3(mid[x], mid[x+1], mid[x+2]), min_hi);
+        }
+    }
+
+    /// @brief Add a row to the histogram; four interleaved sub-histograms break store-to-load chains on runs of equal values
+    void count(uint8_t const* row, uint8_t const* inside, int cols) {
+        int x = 0;
+        if (!inside) {
+            for (; x + 4 <= cols; x += 4) {
+                counts_[0][row[x]]++;
+                counts_[1][row[x+1]]++;
+                counts_[2][row[x+2]]++;
+                counts_[3][row[x+3]]++;
+            }
+            for (; x < cols; x++) counts_[0][row[x]]++;
+        } else {
+            for (; x < cols; x++) {
+                if (inside[x]) counts_[x & 3][row[x]]++;
+            }
+        }
+    }
+
+    std::vector<uint8_t> lo_, mid_, hi_;
+    std::array< std::array<int, 256>, 4 > counts_{};
+    size_t allocations_ = 0;
+};
@@ -0,0 +1,349 @@
+/// metrics.hpp
+/// Purpose: Live counters, gauges, and per-stage latency histograms in the Prometheus text format, scraped
+/// over HTTP or written to a file at the end of a run.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "profiler.hpp"
+
+/// @brief Upper bounds, in seconds, of the stage latency buckets; `+Inf` comes on top
+inline constexpr std::array<double, 14> latency_buckets{
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+/// @brief `# HELP` text of each `Counter`, exported as `vessel_<counter_name>_total`
+inline char const* counter_help(Counter counter) {
+    static char const* const help[] = {
+        "Images and requests processed, failed or not",
+        "Images and requests that failed",
+        "Scratch buffers the extractors allocated, counted when a worker stops",
+        "Inputs whose mask was found in the result cache",
+        "Inputs looked up in the result cache and not found",
+        "Video frames that reused the CLAHE tables and background of an earlier frame"
+    };
+    return help[static_cast<int>(counter)];
+}
+
+/// @brief Counters, stage latency histograms, and gauges of the running process
+/// @note Each recording thread gets a shard of its own, aligned to a cache line, and records with relaxed
+///       atomic adds: no lock, and no line bounced between workers. `write()` sums the shards, so a
+///       scrape may see a sample in its bucket before its time is in the sum, which rates taken over a
+///       scrape interval absorb. Shards outlive their threads, so the counts of stopped workers remain.
+class Metrics final : public ProfileSink {
+public:
+    Metrics()
+    :
+    id_{next_id_.fetch_add(1)},
+    start_time_{std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()}
+    {}
+
+    Metrics(Metrics const&) = delete;
+    Metrics& operator=(Metrics const&) = delete;
+
+    void observe(Stage stage, double seconds) override {
+        auto& shard = local();
+        auto const s = static_cast<size_t>(stage);
+        seconds = std::max(seconds, 0.0);
+        auto const bucket = std::lower_bound(latency_buckets.begin(), latency_buckets.end(), seconds) - latency_buckets.begin();
+        shard.buckets[s][bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.nanoseconds[s].fetch_add(static_cast<uint64_t>(seconds * 1e9), std::memory_order_relaxed);
+    }
+
+    void add(Counter counter, size_t n = 1) override {
+        local().counters[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /// @brief Registration of a gauge, which is read at every scrape until the handle is destroyed
+    class Gauge {
+    public:
+        Gauge() = default;
+        Gauge(Metrics* metrics, uint64_t id) : metrics_{metrics}, id_{id} {}
+        Gauge(Gauge&& other) noexcept : metrics_{std::exchange(other.metrics_, nullptr)}, id_{other.id_} {}
+        Gauge& operator=(Gauge&& other) noexcept {
+            std::swap(metrics_, other.metrics_);
+            std::swap(id_, other.id_);
+            return *this;
+        }
+        ~Gauge() {
+            if (metrics_) metrics_->remove_gauge(id_);
+        }
+
+    private:
+        Metrics* metrics_ = nullptr;
+        uint64_t id_ = 0;
+    };
+
+    /// @brief Export `read()` as a gauge
+    /// @param name Metric name with its labels, if any, e.g. `vessel_queue_depth{queue="requests"}`
+    /// @param help `# HELP` text, shared by every gauge of the same name before the labels
+    /// @param read Current value, called on the scraping thread while the handle lives; must be thread safe
+    [[nodiscard]] Gauge gauge(std::string name, std::string help, std::function<double()> read) {
+        std::lock_guard lock(mutex_);
+        auto const id = next_gauge_++;
+        gauges_.push_back(GaugeEntry{id, std::move(name), std::move(help), std::move(read)});
+        return Gauge(this, id);
+    }
+
+    /// @brief Write every metric in the Prometheus text exposition format, version 0.0.4
+    void write(std::ostream& os) const {
+        constexpr size_t stages = static_cast<size_t>(Stage::count);
+        constexpr size_t counters = static_cast<size_t>(Counter::count);
+        std::array<std::array<uint64_t, latency_buckets.size() + 1>, stages> buckets{};
+        std::array<uint64_t, stages> nanoseconds{};
+        std::array<uint64_t, counters> totals{};
+        // gauges are read under the lock, which the destruction of a handle waits for
+        std::vector< std::pair<GaugeEntry const*, double> > gauges;
+        std::unique_lock lock(mutex_);
+        for (auto const& shard : shards_) {
+            for (size_t s = 0; s < stages; s++) {
+                for (size_t b = 0; b < buckets[s].size(); b++) buckets[s][b] += shard->buckets[s][b].load(std::memory_order_relaxed);
+                nanoseconds[s] += shard->nanoseconds[s].load(std::memory_order_relaxed);
+            }
+            for (size_t c = 0; c < counters; c++) totals[c] += shard->counters[c].load(std::memory_order_relaxed);
+        }
+        for (auto const& gauge : gauges_) gauges.emplace_back(&gauge, gauge.read());
+
+        std::ostringstream out;
+        out << std::setprecision(12);
+        out << "# HELP vessel_stage_seconds Time per stage; extract spans color_filter to final_median\n"
+            << "# TYPE vessel_stage_seconds histogram\n";
+        for (size_t s = 0; s < stages; s++) {
+            auto const* name = stage_name(static_cast<Stage>(s));
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < buckets[s].size(); b++) {
+                cumulative += buckets[s][b];
+                out << "vessel_stage_seconds_bucket{stage=\"" << name << "\",le=\"";
+                if (b < latency_buckets.size()) out << latency_buckets[b];
+                else out << "+Inf";
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "vessel_stage_seconds_sum{stage=\"" << name << "\"} " << nanoseconds[s] * 1e-9 << "\n"
+                << "vessel_stage_seconds_count{stage=\"" << name << "\"} " << cumulative << "\n";
+        }
+        for (size_t c = 0; c < counters; c++) {
+            auto const* name = counter_name(static_cast<Counter>(c));
+            out << "# HELP vessel_" << name << "_total " << counter_help(static_cast<Counter>(c)) << "\n"
+                << "# TYPE vessel_" << name << "_total counter\n"
+                << "vessel_" << name << "_total " << totals[c] << "\n";
+        }
+        // one HELP and TYPE per family, which requires the gauges of a family to be adjacent
+        std::stable_sort(gauges.begin(), gauges.end(), [](auto const& a, auto const& b) {
+            return a.first->family() < b.first->family();
+        });
+        std::string family;
+        for (auto const& [gauge, value] : gauges) {
+            if (gauge->family() != family) {
+                family = gauge->family();
+                out << "# HELP " << family << " " << gauge->help << "\n" << "# TYPE " << family << " gauge\n";
+            }
+            out << gauge->name << " " << value << "\n";
+        }
+        lock.unlock();
+        out << "# HELP process_start_time_seconds Start time of the process since the Unix epoch\n"
+            << "# TYPE process_start_time_seconds gauge\n"
+            << "process_start_time_seconds " << std::fixed << std::setprecision(3) << start_time_ << "\n";
+        os << out.str();
+    }
+
+    /// @brief Write the metrics to `path`, e.g. for the node exporter's textfile collector
+    /// @return `false` if the file could not be written
+    /// @note Written aside and renamed, so a collector reading the file never sees half of it.
+    bool write_file(std::filesystem::path const& path) const {
+        auto const temporary = path.string() + ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream out(temporary);
+            write(out);
+            if (!out) return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, path, ec);
+        if (ec) std::filesystem::remove(temporary, ec);
+        return !ec;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::array<std::array<std::atomic<uint64_t>, latency_buckets.size() + 1>, static_cast<size_t>(Stage::count)> buckets{};
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(Stage::count)> nanoseconds{};
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::count)> counters{};
+    };
+
+    struct GaugeEntry {
+        uint64_t id;
+        std::string name;
+        std::string help;
+        std::function<double()> read;
+
+        std::string family() const { return name.substr(0, name.find('{')); }
+    };
+
+    /// @brief Shard of the calling thread, created on its first sample
+    /// @note Looked up by instance id rather than address, so a thread never reuses the shard of a
+    ///       destroyed instance that another one has replaced at the same address.
+    Shard& local() {
+        thread_local std::vector<std::pair<uint64_t, Shard*>> owned;
+        for (auto const& [id, shard] : owned) {
+            if (id == id_) return *shard;
+        }
+        std::lock_guard lock(mutex_);
+        shards_.push_back(std::make_unique<Shard>());
+        owned.emplace_back(id_, shards_.back().get());
+        return *shards_.back();
+    }
+
+    void remove_gauge(uint64_t id) {
+        std::lock_guard lock(mutex_);
+        std::erase_if(gauges_, [id](GaugeEntry const& gauge) { return gauge.id == id; });
+    }
+
+    static inline std::atomic<uint64_t> next_id_{1};
+    uint64_t const id_;
+    double const start_time_;
+    /// Guards the list of shards, not their contents, and the gauges
+    mutable std::mutex mutex_;
+    std::vector< std::unique_ptr<Shard> > shards_;
+    std::vector<GaugeEntry> gauges_;
+    uint64_t next_gauge_ = 1;
+};
+
+/// @brief HTTP endpoint answering `GET /metrics` with `Metrics::write()`, for Prometheus to scrape
+/// @note One thread answers one scrape at a time, which is all a scraper needs; a client that stalls is
+///       dropped after a second, so it cannot hold up the next scrape. Other paths get 404.
+class MetricsEndpoint {
+public:
+    explicit MetricsEndpoint(Metrics const& metrics) : metrics_{metrics} {}
+
+    ~MetricsEndpoint() {
+        stop_.store(true);
+        if (thread_.joinable()) thread_.join();
+        if (listener_ >= 0) ::close(listener_);
+    }
+
+    MetricsEndpoint(MetricsEndpoint const&) = delete;
+    MetricsEndpoint& operator=(MetricsEndpoint const&) = delete;
+
+    /// @brief Listen on `address` and answer scrapes on a thread of its own until destroyed
+    /// @param address `<port>` or `<host>:<port>`, `[<ipv6>]:<port>` for an IPv6 literal; without a host,
+    ///        every interface
+    /// @return Empty once listening, otherwise the reason
+    std::string start(std::string const& address) {
+        auto const colon = address.rfind(':');
+        std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+        std::string const port = colon == std::string::npos ? address : address.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        int number = 0;
+        auto [ptr, ec] = std::from_chars(port.data(), port.data() + port.size(), number);
+        if (ec != std::errc() || ptr != port.data() + port.size() || number < 1 || number > 65535) {
+            return address + ": expected [<host>:]<port>";
+        }
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* found = nullptr;
+        if (int const status = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found); status != 0) {
+            return address + ": " + ::gai_strerror(status);
+        }
+        std::string error = address + ": no usable address";
+        for (auto* candidate = found; candidate && listener_ < 0; candidate = candidate->ai_next) {
+            int const fd = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+            if (fd < 0) continue;
+            int const on = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (::bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && ::listen(fd, 16) == 0) {
+                listener_ = fd;
+            } else {
+                error = address + ": " + std::strerror(errno);
+                ::close(fd);
+            }
+        }
+        ::freeaddrinfo(found);
+        if (listener_ < 0) return error;
+        thread_ = std::jthread([this]() { run(); });
+        return {};
+    }
+
+private:
+    void run() {
+        while (!stop_.load()) {
+            pollfd pending{listener_, POLLIN, 0};
+            // wake up now and then to notice the destructor
+            if (::poll(&pending, 1, 200) <= 0) continue;
+            int const client = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            answer(client);
+            ::close(client);
+        }
+    }
+
+    void answer(int client) const {
+        timeval timeout{1, 0};
+        ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        // the request line and headers; the body of a GET is empty
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            auto const n = ::recv(client, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            request.append(buffer, n);
+        }
+        std::istringstream line(request.substr(0, request.find("\r\n")));
+        std::string method, target;
+        line >> method >> target;
+        target = target.substr(0, target.find('?'));
+
+        std::string status = "200 OK", body;
+        if (method != "GET" && method != "HEAD") {
+            status = "405 Method Not Allowed";
+        } else if (target == "/metrics") {
+            std::ostringstream out;
+            metrics_.write(out);
+            body = out.str();
+        } else {
+            status = "404 Not Found";
+        }
+        std::string reply = "HTTP/1.1 " + status + "\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n";
+        if (method != "HEAD") reply += body;
+        for (size_t sent = 0; sent < reply.size(); ) {
+            auto const n = ::send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            sent += n;
+        }
+    }
+
+    Metrics const& metrics_;
+    int listener_ = -1;
+    std::atomic<bool> stop_{false};
+    std::jthread thread_;
+};
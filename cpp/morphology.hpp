@@ -0,0 +1,428 @@
+/// morphology.hpp
+/// Purpose: Rectangular grayscale morphology whose cost does not depend on the structuring element size.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+/////////////////////////
+// van Herk / Gil-Werman running min/max
+//
+// A window of k = 2r+1 samples never spans more than two blocks of k samples. Prefix extrema `g`
+// (reset at each block start) and suffix extrema `h` (reset at each block end) combine as
+// op(h[x], g[x+k-1]), three comparisons per sample regardless of k.
+// Samples outside the image take the identity of `op`, which matches OpenCV's default
+// morphology border (`morphologyDefaultBorderValue()`): the border never wins.
+
+struct MinOp {
+    static constexpr uint8_t identity = 255;
+    uint8_t operator()(uint8_t a, uint8_t b) const { return std::min(a, b); }
+#if CV_SIMD
+    cv::v_uint8 operator()(cv::v_uint8 const& a, cv::v_uint8 const& b) const { return cv::v_min(a, b); }
+#endif
+};
+
+struct MaxOp {
+    static constexpr uint8_t identity = 0;
+    uint8_t operator()(uint8_t a, uint8_t b) const { return std::max(a, b); }
+#if CV_SIMD
+    cv::v_uint8 operator()(cv::v_uint8 const& a, cv::v_uint8 const& b) const { return cv::v_max(a, b); }
+#endif
+};
+
+/// @brief `out[x] = op(a[x], b[x])` for `width` bytes, with OpenCV universal intrinsics
+template <typename Op>
+void combine_rows(uint8_t const* a, uint8_t const* b, uint8_t* out, int width) {
+    Op op;
+    int x = 0;
+#if CV_SIMD
+    int const lanes = cv::VTraits<cv::v_uint8>::vlanes();
+    for (; x + lanes <= width; x += lanes) cv::v_store(out + x, op(cv::vx_load(a + x), cv::vx_load(b + x)));
+#endif
+    for (; x < width; x++) out[x] = op(a[x], b[x]);
+}
+
+/// @brief `out[x] = op(a[x], b[x]) - minus[x]`, saturated at 0 as `cv::subtract` does on 8-bit images
+template <typename Op>
+void combine_rows_subtract(uint8_t const* a, uint8_t const* b, uint8_t const* minus, uint8_t* out, int width) {
+    Op op;
+    int x = 0;
+#if CV_SIMD
+    int const lanes = cv::VTraits<cv::v_uint8>::vlanes();
+    for (; x + lanes <= width; x += lanes) {
+        // v_sub on 8-bit lanes saturates
+        cv::v_store(out + x, cv::v_sub(op(cv::vx_load(a + x), cv::vx_load(b + x)), cv::vx_load(minus + x)));
+    }
+#endif
+    for (; x < width; x++) {
+        uint8_t const value = op(a[x], b[x]);
+        out[x] = value > minus[x] ? value - minus[x] : 0;
+    }
+}
+
+/// @brief Horizontal running min/max over a window of `2*radius+1` pixels
+/// @param src First row of the source
+/// @param src_step Bytes between source rows
+/// @param dst First row of the destination, must not alias `src`
+/// @param dst_step Bytes between destination rows
+/// @param rows Number of rows
+/// @param cols Number of pixels per row
+/// @param cn Interleaved channels per pixel, each filtered independently
+/// @param radius Half width of the window
+/// @param g Scratch line, resized as needed
+/// @param h Scratch line, resized as needed
+/// @tparam Radius `radius` known at compile time, which turns the block arithmetic into constants; 0 to use the argument
+/// @note The padded line is laid out in `g` once, identity at both ends, so the block loops read it without
+///       bounds checks; `h` is built from it backwards, then `g` is turned into the prefix extrema in place.
+template <typename Op, int Radius = 0>
+void van_herk_rows(
+    uint8_t const* src, size_t src_step, uint8_t* dst, size_t dst_step,
+    int rows, int cols, int cn, int radius,
+    std::vector<uint8_t>& g, std::vector<uint8_t>& h)
+{
+    if constexpr (Radius > 0) radius = Radius;
+    Op op;
+    int const k = 2*radius + 1;
+    int const padded = cols + 2*radius;
+    g.resize(padded);
+    h.resize(padded);
+
+    for (int y = 0; y < rows; y++) {
+        auto const* in = src + y*src_step;
+        auto* out = dst + y*dst_step;
+        for (int c = 0; c < cn; c++) {
+            auto* line = g.data();
+            std::fill(line, line + radius, Op::identity);
+            if (cn == 1) {
+                std::copy(in, in + cols, line + radius);
+            } else {
+                for (int x = 0; x < cols; x++) line[radius + x] = in[x*cn + c];
+            }
+            std::fill(line + radius + cols, line + padded, Op::identity);
+            for (int start = 0; start < padded; start += k) {
+                int const end = std::min(start + k, padded);
+                h[end-1] = line[end-1];
+                for (int i = end-2; i >= start; i--) h[i] = op(h[i+1], line[i]);
+                for (int i = start+1; i < end; i++) g[i] = op(g[i-1], line[i]);
+            }
+            for (int x = 0; x < cols; x++) {
+                out[x*cn + c] = op(h[x], g[x + k - 1]);
+            }
+        }
+    }
+}
+
+/// @brief Layout of images of one size stacked vertically in one buffer, separated by rows of none of them
+/// @note Column passes take gap rows for samples outside the image, so as long as `gap_rows` is at least
+///       the radius of every pass, each image is filtered exactly as if it were alone.
+struct ImageStack {
+    /// Rows of each image, 0 when the buffer holds a single image
+    int image_rows = 0;
+    /// Rows between consecutive images; their content is never read
+    int gap_rows = 0;
+
+    bool gap(int y) const { return image_rows && y % (image_rows + gap_rows) >= image_rows; }
+};
+
+/// @brief Vertical running min/max over a window of `2*radius+1` rows, handing each output row to `store`
+/// @param src First row of the source
+/// @param src_step Bytes between source rows
+/// @param rows Number of rows
+/// @param width Number of bytes per row, all channels included
+/// @param radius Half height of the window
+/// @param g Scratch plane of `(rows + 2*radius) * width` bytes, resized as needed
+/// @param h Scratch plane of `(rows + 2*radius) * width` bytes, resized as needed
+/// @param store Called as `store(y, a, b)` for every row in order; output row `y` is `op(a[x], b[x])`,
+///        e.g. through `combine_rows()`, so the result can be consumed without being written first
+/// @param stack Rows that are gaps between stacked images, read as outside the image
+/// @tparam Radius `radius` known at compile time; 0 to use the argument
+/// @note Works on whole rows at a time so the inner loops are contiguous and run on universal intrinsics.
+template <typename Op, int Radius = 0, typename Store>
+void van_herk_cols(
+    uint8_t const* src, size_t src_step,
+    int rows, int width, int radius,
+    std::vector<uint8_t>& g, std::vector<uint8_t>& h, Store&& store, ImageStack const& stack = {})
+{
+    if constexpr (Radius > 0) radius = Radius;
+    int const k = 2*radius + 1;
+    int const padded = rows + 2*radius;
+    g.resize(size_t(padded) * width);
+    h.resize(size_t(padded) * width);
+
+    // Rows outside the image are the identity of `op`; they reset or pass through the running value
+    auto row_in = [&](int i) -> uint8_t const* {
+        int const y = i - radius;
+        return (y < 0 || y >= rows || stack.gap(y)) ? nullptr : src + y*src_step;
+    };
+    auto g_row = [&](int i) { return g.data() + size_t(i)*width; };
+    auto h_row = [&](int i) { return h.data() + size_t(i)*width; };
+    auto accumulate = [&](uint8_t* out, uint8_t const* in, uint8_t const* running) {
+        if (!running) {
+            if (in) std::copy(in, in + width, out);
+            else std::fill(out, out + width, Op::identity);
+        } else if (!in) {
+            std::copy(running, running + width, out);
+        } else {
+            combine_rows<Op>(running, in, out, width);
+        }
+    };
+
+    for (int start = 0; start < padded; start += k) {
+        int const end = std::min(start + k, padded);
+        accumulate(g_row(start), row_in(start), nullptr);
+        for (int i = start+1; i < end; i++) accumulate(g_row(i), row_in(i), g_row(i-1));
+        accumulate(h_row(end-1), row_in(end-1), nullptr);
+        for (int i = end-2; i >= start; i--) accumulate(h_row(i), row_in(i), h_row(i+1));
+    }
+    for (int y = 0; y < rows; y++) store(y, h_row(y), g_row(y + k - 1));
+}
+
+/// @brief Vertical running min/max over a window of `2*radius+1` rows
+/// @param dst First row of the destination, must not alias `src`
+/// @param dst_step Bytes between destination rows
+/// @note Other parameters as for the overload taking `store`.
+template <typename Op, int Radius = 0>
+void van_herk_cols(
+    uint8_t const* src, size_t src_step, uint8_t* dst, size_t dst_step,
+    int rows, int width, int radius,
+    std::vector<uint8_t>& g, std::vector<uint8_t>& h)
+{
+    van_herk_cols<Op, Radius>(src, src_step, rows, width, radius, g, h,
+        [&](int y, uint8_t const* a, uint8_t const* b) { combine_rows<Op>(a, b, dst + y*dst_step, width); });
+}
+
+
+/// @brief Header over the top-left `size` of `storage`, which is only reallocated when too small or of another type
+/// @param allocations Incremented when `storage` is reallocated
+/// @note Lets buffers serve images whose size varies from call to call, e.g. the tiles of one frame.
+inline cv::Mat grow_view(cv::Mat& storage, cv::Size size, int type, size_t& allocations) {
+    if (storage.type() != type || storage.cols < size.width || storage.rows < size.height) {
+        auto const cols = (storage.type() == type) ? std::max(storage.cols, size.width) : size.width;
+        auto const rows = (storage.type() == type) ? std::max(storage.rows, size.height) : size.height;
+        storage.create(rows, cols, type);
+        allocations++;
+    }
+    return storage(cv::Rect(0, 0, size.width, size.height));
+}
+
+
+/////////////////////////
+// Alternating sequential filter
+
+/// @brief Radii of the passes `AlternatingSequentialFilter` runs for elements of `radii` after fusion
+/// @note Open = erode, dilate and close = dilate, erode, so neighbouring elements share a pass:
+///       r1, 2*r1, r1+r2, 2*r2, ..., 2*rn, rn; {2,5,11} gives {2,4,7,10,16,22,11}.
+template <size_t N>
+constexpr std::array<int, 2*N + 1> fused_radii(std::array<int, N> const& radii) {
+    std::array<int, 2*N + 1> result{};
+    result[0] = radii[0];
+    for (size_t i = 0; i < N; i++) {
+        result[2*i + 1] = 2*radii[i];
+        result[2*i + 2] = (i + 1 < N) ? radii[i] + radii[i+1] : radii[i];
+    }
+    return result;
+}
+
+/// @brief Open then close with each rectangular structuring element in turn
+/// @tparam Fixed Pass radii whose kernels are instantiated with the radius as a constant; passes of
+///         any other radius run the generic kernels, so every configuration works
+/// @note Identical to `cv::morphologyEx` OPEN followed by CLOSE per element with default border,
+///       but consecutive erosions (and dilations) are fused into one wider pass, a rectangle is
+///       applied as separate row and column passes, and all intermediates live in two buffers
+///       that are reused across calls.
+template <int... Fixed>
+class BasicAlternatingSequentialFilter {
+public:
+    /// @param radii Half sizes of the square structuring elements, smallest first
+    explicit BasicAlternatingSequentialFilter(std::vector<int> const& radii) {
+        for (auto radius : radii) {
+            // open = erode, dilate; close = dilate, erode
+            add_pass(Op::erode, radius);
+            add_pass(Op::dilate, radius);
+            add_pass(Op::dilate, radius);
+            add_pass(Op::erode, radius);
+        }
+    }
+
+    /// @brief Filter an 8-bit image
+    /// @param src Source, CV_8U with any number of channels
+    /// @param dst Result, (re)allocated only when its geometry differs from `src`
+    /// @param stack Layout when `src` holds stacked images; gaps of at least `max_radius()` rows keep them apart
+    void apply(cv::Mat const& src, cv::Mat& dst, ImageStack const& stack = {}) {
+        CV_Assert(src.depth() == CV_8U);
+        if (passes_.empty()) {
+            src.copyTo(dst);
+            return;
+        }
+        CV_Assert(!stack.image_rows || stack.gap_rows >= max_radius());
+        reserve(src.size(), src.type());
+        dst.create(src.size(), src.type());
+
+        cv::Mat const* input = &src;
+        for (size_t i = 0; i < passes_.size(); i++) {
+            auto& output = (i + 1 == passes_.size()) ? dst : result_;
+            if (passes_[i].op == Op::erode) {
+                pass<MinOp>(*input, output, passes_[i].radius, stack);
+            } else {
+                pass<MaxOp>(*input, output, passes_[i].radius, stack);
+            }
+            input = &result_;
+        }
+    }
+
+    /// @brief Filter an 8-bit image and subtract another from part of the result
+    /// @param src Source, CV_8U with any number of channels
+    /// @param roi Rectangle of `src` whose result is kept
+    /// @param subtrahend Image of `roi` size and `src` type
+    /// @param dst Receives the result in `roi` minus `subtrahend`, saturated at 0 as `cv::subtract` computes it;
+    ///        (re)allocated only when its geometry differs, so it may be a view into a larger image
+    /// @param stack Layout when `src` holds stacked images, as for `apply()`
+    /// @note Equals `apply()` then `cv::subtract()`, but the last column pass writes the difference directly,
+    ///       so the filter result is never stored and read back, and the rows outside `roi` are not combined.
+    void apply_subtract(cv::Mat const& src, cv::Rect roi, cv::Mat const& subtrahend, cv::Mat& dst, ImageStack const& stack = {}) {
+        CV_Assert(src.depth() == CV_8U && subtrahend.type() == src.type() && subtrahend.size() == roi.size());
+        CV_Assert((roi & cv::Rect(0, 0, src.cols, src.rows)) == roi);
+        CV_Assert(!stack.image_rows || stack.gap_rows >= max_radius());
+        if (passes_.empty()) {
+            cv::subtract(src(roi), subtrahend, dst);
+            return;
+        }
+        reserve(src.size(), src.type());
+        dst.create(roi.size(), src.type());
+
+        cv::Mat const* input = &src;
+        for (size_t i = 0; i + 1 < passes_.size(); i++) {
+            if (passes_[i].op == Op::erode) {
+                pass<MinOp>(*input, result_, passes_[i].radius, stack);
+            } else {
+                pass<MaxOp>(*input, result_, passes_[i].radius, stack);
+            }
+            input = &result_;
+        }
+        Difference const difference{roi, subtrahend, dst};
+        if (passes_.back().op == Op::erode) {
+            pass<MinOp>(*input, result_, passes_.back().radius, stack, &difference);
+        } else {
+            pass<MaxOp>(*input, result_, passes_.back().radius, stack, &difference);
+        }
+    }
+
+    /// @brief Size every internal buffer for images of `size` and `type`
+    /// @note Called by `apply()`; buffers are only reallocated when the geometry grows or the type changes.
+    void reserve(cv::Size size, int type) {
+        int max_radius = 0;
+        for (auto const& p : passes_) max_radius = std::max(max_radius, p.radius);
+        auto const width = size_t(size.width) * CV_MAT_CN(type);
+        rows_ = grow_view(rows_storage_, size, type, allocations_);
+        result_ = grow_view(result_storage_, size, type, allocations_);
+        fit(line_g_, size.width + 2*max_radius);
+        fit(line_h_, size.width + 2*max_radius);
+        fit(plane_g_, (size.height + 2*max_radius) * width);
+        fit(plane_h_, (size.height + 2*max_radius) * width);
+    }
+
+    /// @brief Number of times an internal buffer had to be (re)allocated
+    size_t allocations() const { return allocations_; }
+
+    /// @brief Number of row+column passes after fusion, e.g. 7 for the three elements of `ExtractArteries`
+    size_t pass_count() const { return passes_.size(); }
+
+    /// @brief Largest radius of a pass after fusion, the gap `ImageStack` needs between images
+    int max_radius() const {
+        int result = 0;
+        for (auto const& p : passes_) result = std::max(result, p.radius);
+        return result;
+    }
+
+    /// @brief Distance over which an output pixel depends on the input, the sum of all pass radii
+    /// @note A crop grown by `halo()` on every side (clipped to the image) filters its centre exactly,
+    ///       because outside samples take the identity of each pass just like the image border.
+    int halo() const {
+        int result = 0;
+        for (auto const& p : passes_) result += p.radius;
+        return result;
+    }
+
+private:
+    enum class Op { erode, dilate };
+    struct Pass {
+        Op op;
+        int radius;
+    };
+
+    /// @brief Where the last pass of `apply_subtract()` writes instead of its destination
+    struct Difference {
+        cv::Rect roi;
+        cv::Mat const& subtrahend;
+        cv::Mat& dst;
+    };
+
+    void add_pass(Op op, int radius) {
+        if (!passes_.empty() && passes_.back().op == op) {
+            // Two rectangular erosions (dilations) with ignored borders are one with the summed radius
+            passes_.back().radius += radius;
+        } else {
+            passes_.push_back(Pass{op, radius});
+        }
+    }
+
+    void fit(std::vector<uint8_t>& buffer, size_t size) {
+        if (size > buffer.capacity()) allocations_++;
+        buffer.resize(size);
+    }
+
+    template <typename RunOp>
+    void pass(cv::Mat const& src, cv::Mat& dst, int radius, ImageStack const& stack, Difference const* difference = nullptr) {
+        bool const fixed = ((radius == Fixed && (fixed_pass<RunOp, Fixed>(src, dst, radius, stack, difference), true)) || ...);
+        if (!fixed) fixed_pass<RunOp, 0>(src, dst, radius, stack, difference);
+    }
+
+    /// @brief Row then column pass, with the kernels for `Radius` or, if 0, the generic ones
+    /// @param difference If not `nullptr`, the column pass writes there and `dst` is left alone
+    template <typename RunOp, int Radius>
+    void fixed_pass(cv::Mat const& src, cv::Mat& dst, int radius, ImageStack const& stack, Difference const* difference) {
+        int const cn = src.channels();
+        int const width = src.cols * cn;
+        van_herk_rows<RunOp, Radius>(src.ptr(), src.step, rows_.ptr(), rows_.step,
+            src.rows, src.cols, cn, radius, line_g_, line_h_);
+        if (!difference) {
+            auto* out = dst.ptr();
+            van_herk_cols<RunOp, Radius>(rows_.ptr(), rows_.step, src.rows, width, radius, plane_g_, plane_h_,
+                [&](int y, uint8_t const* a, uint8_t const* b) { combine_rows<RunOp>(a, b, out + y*dst.step, width); }, stack);
+            return;
+        }
+        auto const roi = difference->roi;
+        van_herk_cols<RunOp, Radius>(rows_.ptr(), rows_.step, src.rows, width, radius, plane_g_, plane_h_,
+            [&](int y, uint8_t const* a, uint8_t const* b) {
+                if (y < roi.y || y >= roi.y + roi.height) return;
+                int const offset = roi.x * cn;
+                combine_rows_subtract<RunOp>(a + offset, b + offset, difference->subtrahend.ptr(y - roi.y),
+                    difference->dst.ptr(y - roi.y), roi.width * cn);
+            }, stack);
+    }
+
+    std::vector<Pass> passes_;
+    // ping-pong buffers: row pass output, column pass output, as views of storage that only grows
+    cv::Mat rows_storage_, rows_;
+    cv::Mat result_storage_, result_;
+    std::vector<uint8_t> line_g_, line_h_;
+    std::vector<uint8_t> plane_g_, plane_h_;
+    size_t allocations_ = 0;
+};
+
+/// @brief Filter without compile-time radii
+using AlternatingSequentialFilter = BasicAlternatingSequentialFilter<>;
+
+template <auto Radii, size_t... I>
+BasicAlternatingSequentialFilter<Radii[I]...> specialized_filter(std::index_sequence<I...>);
+
+/// @brief Filter whose kernels are compiled for the fused passes of the elements `Radii`, a `std::array<int, N>`
+template <auto Radii>
+using SpecializedAlternatingSequentialFilter =
+    decltype(specialized_filter<fused_radii(Radii)>(std::make_index_sequence<2*Radii.size() + 1>{}));
@@ -0,0 +1,40 @@
+/// otsu.hpp
+/// Purpose: Otsu's threshold from a histogram, for thresholds restricted to a mask or computed off the host.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+
+/// @brief Otsu's threshold of a 256-bin histogram
+/// @param hist Pixel count per gray level
+/// @return Level maximizing the between-class variance, as `cv::threshold` with `THRESH_OTSU` picks it
+inline int otsu_level(std::array<int, 256> const& hist) {
+    double total = 0, mu = 0;
+    for (int i = 0; i < 256; i++) {
+        total += hist[i];
+        mu += i * double(hist[i]);
+    }
+    if (total == 0) return 0;
+    double const scale = 1. / total;
+    mu *= scale;
+
+    double mu1 = 0, q1 = 0, max_sigma = 0;
+    int max_val = 0;
+    for (int i = 0; i < 256; i++) {
+        double const p_i = hist[i] * scale;
+        mu1 *= q1;
+        q1 += p_i;
+        double const q2 = 1. - q1;
+        if (std::min(q1, q2) < FLT_EPSILON || std::max(q1, q2) > 1. - FLT_EPSILON) continue;
+        mu1 = (mu1 + i*p_i) / q1;
+        double const mu2 = (mu - q1*mu1) / q2;
+        double const sigma = q1*q2*(mu1 - mu2)*(mu1 - mu2);
+        if (sigma > max_sigma) {
+            max_sigma = sigma;
+            max_val = i;
+        }
+    }
+    return max_val;
+}
@@ -0,0 +1,155 @@
+/// pair_source.hpp
+/// Purpose: Lazily enumerate input/output path pairs from argv, a manifest, or a directory.
+
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+using PathPair = std::pair<std::string, std::string>;
+
+/// @brief Thread-safe producer of input/output pairs
+/// @note Workers call `next()` directly, so pairs are produced only as fast as they are consumed
+///       and the full list is never held in memory.
+class PairSource {
+public:
+    virtual ~PairSource() = default;
+
+    /// @brief Next pair, or `std::nullopt` once exhausted
+    std::optional<PathPair> next() {
+        std::lock_guard lock(mutex_);
+        return produce();
+    }
+
+    /// @brief Why the source ended before its last pair, empty if it did not
+    std::string error() {
+        std::lock_guard lock(mutex_);
+        return error_;
+    }
+
+protected:
+    /// @brief Produce the next pair; called with the source lock held
+    virtual std::optional<PathPair> produce() = 0;
+
+    /// Set by `produce()` when it ends early
+    std::string error_;
+
+private:
+    std::mutex mutex_;
+};
+
+/// @brief Alternating input and output paths given on the command line
+class ArgumentPairs : public PairSource {
+public:
+    explicit ArgumentPairs(std::vector<std::string> image_files) : image_files_{std::move(image_files)} {}
+
+protected:
+    std::optional<PathPair> produce() override {
+        if (next_ + 1 >= image_files_.size()) return std::nullopt;
+        PathPair pair{image_files_[next_], image_files_[next_+1]};
+        next_ += 2;
+        return pair;
+    }
+
+private:
+    std::vector<std::string> image_files_;
+    size_t next_ = 0;
+};
+
+/// @brief One pair per line: `<input>\t<output>`, or `<input> <output>` when neither path has spaces
+/// @note Blank lines and lines starting with `#` are skipped. `-` reads the manifest from STDIN.
+class ManifestPairs : public PairSource {
+public:
+    explicit ManifestPairs(std::string const& path) {
+        if (path != "-") {
+            file_.open(path);
+            in_ = &file_;
+        }
+    }
+
+    bool is_open() const { return in_ == &std::cin || file_.is_open(); }
+
+protected:
+    std::optional<PathPair> produce() override {
+        std::string line;
+        while (std::getline(*in_, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line.front() == '#') continue;
+            auto split = line.find('\t');
+            if (split == std::string::npos) split = line.find(' ');
+            if (split == std::string::npos) {
+                // keep the pair so the bad line is reported like any other failed input
+                return PathPair{line, ""};
+            }
+            auto const output = line.find_first_not_of(" \t", split);
+            return PathPair{line.substr(0, split), (output == std::string::npos) ? "" : line.substr(output)};
+        }
+        return std::nullopt;
+    }
+
+private:
+    std::ifstream file_;
+    std::istream* in_ = &std::cin;
+};
+
+/// @brief Every regular file of a directory, written to an output directory under a naming template
+/// @note `{stem}` in the template is replaced by the input file name without extension and
+///       `{name}` by the full input file name, e.g. `{stem}.png`. Entries are visited in directory order.
+///       Filesystem errors do not throw: an entry whose type cannot be read is passed on, so reading it
+///       reports the failure, and a directory that cannot be listed further ends the pairs with `error()`.
+class DirectoryPairs : public PairSource {
+public:
+    DirectoryPairs(std::string const& input_dir, std::string const& output_dir, std::string name_template)
+    :
+    input_dir_{input_dir},
+    output_dir_{output_dir},
+    name_template_{std::move(name_template)}
+    {
+        std::error_code ec;
+        iter_ = std::filesystem::directory_iterator(input_dir_, ec);
+        if (ec) error_ = "cannot list " + input_dir_ + ": " + ec.message();
+    }
+
+    /// @brief Apply `name_template` to `input`
+    static std::string output_name(std::string name_template, std::filesystem::path const& input) {
+        auto expand = [&](std::string const& key, std::string const& value) {
+            for (auto pos = name_template.find(key); pos != std::string::npos; pos = name_template.find(key, pos + value.size())) {
+                name_template.replace(pos, key.size(), value);
+            }
+        };
+        expand("{stem}", input.stem().string());
+        expand("{name}", input.filename().string());
+        return name_template;
+    }
+
+protected:
+    std::optional<PathPair> produce() override {
+        std::error_code ec;
+        while (iter_ != std::filesystem::directory_iterator()) {
+            auto const entry = *iter_;
+            iter_.increment(ec);
+            if (ec) {
+                error_ = "cannot list " + input_dir_ + ": " + ec.message();
+                iter_ = std::filesystem::directory_iterator();
+            }
+            if (entry.path().filename().string().front() == '.') continue;
+            // dangling links and entries removed since listing are skipped, as regular files they are not
+            if (!entry.is_regular_file(ec) && (!ec || ec == std::errc::no_such_file_or_directory)) continue;
+            return PathPair{entry.path().string(), (output_dir_ / output_name(name_template_, entry.path())).string()};
+        }
+        return std::nullopt;
+    }
+
+private:
+    std::string input_dir_;
+    std::filesystem::directory_iterator iter_;
+    std::filesystem::path output_dir_;
+    std::string name_template_;
+};
@@ -0,0 +1,183 @@
+/// profiler.hpp
+/// Purpose: Scoped per-stage timers aggregated across a batch.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// @brief Stages timed by `ScopedTimer`; `extract` spans the stages from `color_filter` to `final_median`
+enum class Stage { read, extract, color_filter, large_arteries, median, threshold, remove_blobs, final_median, write, count };
+
+inline char const* stage_name(Stage stage) {
+    static char const* const names[] = {
+        "read", "extract", "color_filter", "large_arteries", "median", "threshold", "remove_blobs", "final_median", "write"
+    };
+    return names[static_cast<int>(stage)];
+}
+
+/// @brief Event counts accumulated alongside the timings
+enum class Counter { images, failures, buffer_allocations, cache_hits, cache_misses, reused_frames, count };
+
+inline char const* counter_name(Counter counter) {
+    static char const* const names[] = { "images", "failures", "buffer_allocations", "cache_hits", "cache_misses", "reused_frames" };
+    return names[static_cast<int>(counter)];
+}
+
+/// @brief Receives every sample and count a `Profiler` records, as it records them
+/// @note Called from the recording thread; implementations must be safe to call from every worker at once.
+class ProfileSink {
+public:
+    virtual ~ProfileSink() = default;
+    virtual void observe(Stage stage, double seconds) = 0;
+    virtual void add(Counter counter, size_t n) = 0;
+};
+
+/// @brief Durations recorded per stage, plus event counters
+/// @note Not thread safe; give each worker its own and `merge()` them when the batch is done.
+class Profiler {
+public:
+    Profiler() : samples_(static_cast<size_t>(Stage::count)) {}
+
+    /// @brief Also hand every sample and count to `sink`, `nullptr` for none
+    /// @param keep_samples Whether samples are still kept for `summary()`; a long-running server that only
+    ///        exports to `sink` would otherwise grow without bound
+    void forward_to(ProfileSink* sink, bool keep_samples = true) {
+        sink_ = sink;
+        keep_samples_ = keep_samples;
+    }
+
+    void record(Stage stage, double seconds) {
+        if (keep_samples_) samples_[static_cast<size_t>(stage)].push_back(seconds);
+        if (sink_) sink_->observe(stage, seconds);
+    }
+
+    void add(Counter counter, size_t n = 1) {
+        counters_[static_cast<size_t>(counter)] += n;
+        if (sink_) sink_->add(counter, n);
+    }
+
+    size_t counter(Counter counter) const { return counters_[static_cast<size_t>(counter)]; }
+
+    void merge(Profiler const& other) {
+        for (size_t i = 0; i < samples_.size(); i++) {
+            samples_[i].insert(samples_[i].end(), other.samples_[i].begin(), other.samples_[i].end());
+        }
+        for (size_t i = 0; i < counters_.size(); i++) {
+            counters_[i] += other.counters_[i];
+        }
+    }
+
+    /// @brief Summary statistics of one stage, in seconds
+    struct Summary {
+        size_t count = 0;
+        double min = 0, mean = 0, p50 = 0, p99 = 0, total = 0;
+    };
+
+    Summary summary(Stage stage) const {
+        auto sorted = samples_[static_cast<size_t>(stage)];
+        Summary result;
+        if (sorted.empty()) return result;
+        std::sort(sorted.begin(), sorted.end());
+        result.count = sorted.size();
+        for (auto s : sorted) result.total += s;
+        result.min = sorted.front();
+        result.mean = result.total / sorted.size();
+        result.p50 = percentile(sorted, 0.50);
+        result.p99 = percentile(sorted, 0.99);
+        return result;
+    }
+
+    /// @brief Print one row per stage with times in milliseconds, followed by the counters
+    void print_table(std::ostream& os) const {
+        os << std::left << std::setw(16) << "stage" << std::right
+           << std::setw(8) << "count" << std::setw(10) << "min" << std::setw(10) << "mean"
+           << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(12) << "total" << "  (ms)\n";
+        os << std::fixed << std::setprecision(3);
+        for (int i = 0; i < static_cast<int>(Stage::count); i++) {
+            auto const s = summary(static_cast<Stage>(i));
+            if (!s.count) continue;
+            os << std::left << std::setw(16) << stage_name(static_cast<Stage>(i)) << std::right
+               << std::setw(8) << s.count << std::setw(10) << 1e3*s.min << std::setw(10) << 1e3*s.mean
+               << std::setw(10) << 1e3*s.p50 << std::setw(10) << 1e3*s.p99 << std::setw(12) << 1e3*s.total << "\n";
+        }
+        os << std::defaultfloat;
+        for (int i = 0; i < static_cast<int>(Counter::count); i++) {
+            os << std::left << std::setw(24) << counter_name(static_cast<Counter>(i)) << std::right
+               << counters_[i] << "\n";
+        }
+    }
+
+    /// @brief Print `{"stages": {"<stage>": {"count":..., "min_ms":..., ...}, ...}, "counters": {...}}`
+    void print_json(std::ostream& os) const {
+        os << "{\"stages\": {";
+        char const* separator = "";
+        for (int i = 0; i < static_cast<int>(Stage::count); i++) {
+            auto const s = summary(static_cast<Stage>(i));
+            if (!s.count) continue;
+            os << separator << "\"" << stage_name(static_cast<Stage>(i)) << "\": {"
+               << "\"count\": " << s.count
+               << ", \"min_ms\": " << 1e3*s.min << ", \"mean_ms\": " << 1e3*s.mean
+               << ", \"p50_ms\": " << 1e3*s.p50 << ", \"p99_ms\": " << 1e3*s.p99
+               << ", \"total_ms\": " << 1e3*s.total << "}";
+            separator = ", ";
+        }
+        os << "}, \"counters\": {";
+        separator = "";
+        for (int i = 0; i < static_cast<int>(Counter::count); i++) {
+            os << separator << "\"" << counter_name(static_cast<Counter>(i)) << "\": " << counters_[i];
+            separator = ", ";
+        }
+        os << "}}\n";
+    }
+
+private:
+    /// @brief Nearest-rank percentile of sorted samples
+    static double percentile(std::vector<double> const& sorted, double p) {
+        auto rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+        return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+    }
+
+    std::vector< std::vector<double> > samples_;
+    std::array<size_t, static_cast<size_t>(Counter::count)> counters_{};
+    ProfileSink* sink_ = nullptr;
+    bool keep_samples_ = true;
+};
+
+/// @brief Records the lifetime of the scope into a `Profiler`
+/// @note With a null profiler no clock is read, so timers can stay in production code paths.
+class ScopedTimer {
+public:
+    /// @param images Images the scope works on together; each gets one sample of an equal share of the time,
+    ///        so per-image statistics stay comparable with scopes that handle one image
+    ScopedTimer(Profiler* profiler, Stage stage, size_t images = 1)
+    :
+    profiler_{profiler},
+    stage_{stage},
+    images_{images}
+    {
+        if (profiler_) start_ = std::chrono::steady_clock::now();
+    }
+
+    ~ScopedTimer() {
+        if (profiler_ && images_) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+            for (size_t i = 0; i < images_; i++) profiler_->record(stage_, elapsed.count() / images_);
+        }
+    }
+
+    ScopedTimer(ScopedTimer const&) = delete;
+    ScopedTimer& operator=(ScopedTimer const&) = delete;
+
+private:
+    Profiler* profiler_;
+    Stage stage_;
+    size_t images_;
+    std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,179 @@
+/// result_cache.hpp
+/// Purpose: On-disk cache of segmentation masks keyed by a hash of the input bytes and the parameters.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <span>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <opencv2/core.hpp>
+
+#include "mapped_file.hpp"
+#include "mask_codec.hpp"
+
+/// @brief XXH64 of `data`, the 64-bit xxHash
+/// @note Several GB/s per core, so hashing an input costs far less than decoding it.
+inline uint64_t xxh64(std::span<unsigned char const> data, uint64_t seed) {
+    constexpr uint64_t p1 = 11400714785074694791ull, p2 = 14029467366897019727ull, p3 = 1609587929392839161ull;
+    constexpr uint64_t p4 = 9650029242287828579ull, p5 = 2870177450012600261ull;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](unsigned char const* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](unsigned char const* p) { uint32_t v; std::memcpy(&v, p, 4); return uint64_t(v); };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+    auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v)) * p1 + p4; };
+
+    auto const* p = data.data();
+    auto const* const end = p + data.size();
+    uint64_t h;
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + p5;
+    }
+    h += data.size();
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ (*p * p5), 11) * p1;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// @brief Masks stored as `mask_codec.hpp` run lengths, one file per key, evicted least recently used first
+/// @note Thread safe. A hit refreshes the file's modification time, which is what eviction orders by,
+///       so the recency survives restarts and is shared by processes using the same directory.
+class ResultCache {
+public:
+    /// @param directory Cache directory, created if missing
+    /// @param capacity Total size of the cached files in bytes before the oldest are evicted
+    /// @param parameters Everything besides the input that determines the mask, e.g. `ExtractArteries::parameters()`
+    ResultCache(std::filesystem::path directory, uint64_t capacity, std::string const& parameters)
+    :
+    directory_{std::move(directory)},
+    capacity_{capacity},
+    seed_{xxh64({reinterpret_cast<unsigned char const*>(parameters.data()), parameters.size()}, 0)}
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(directory_, ec);
+        for (std::filesystem::directory_iterator it(directory_, ec), end; !ec && it != end; it.increment(ec)) {
+            if (it->path().extension() != ".vrle" || !it->is_regular_file(ec)) continue;
+            Entry entry{it->file_size(ec), it->last_write_time(ec)};
+            if (ec) break;
+            total_ += entry.size;
+            entries_.emplace(it->path().stem().string(), entry);
+        }
+        if (ec) error_ = directory_.string() + ": " + ec.message();
+    }
+
+    /// @brief Reason the directory could not be used, empty on success
+    std::string const& error() const { return error_; }
+
+    /// @brief Key of the mask of an input
+    /// @param input Encoded input image
+    /// @param extra Other bytes the mask depends on, e.g. a field of view mask file
+    std::string key(std::span<unsigned char const> input, std::span<unsigned char const> extra = {}) const {
+        auto const hash = xxh64(extra, xxh64(input, seed_));
+        char text[40];
+        std::snprintf(text, sizeof(text), "%016llx-%llx",
+            static_cast<unsigned long long>(hash), static_cast<unsigned long long>(input.size() + extra.size()));
+        return text;
+    }
+
+    /// @brief Cached mask of `key`, or an empty `Mat` on a miss
+    cv::Mat find(std::string const& key) {
+        auto const path = file(key);
+        MappedFile mapped(path.string());
+        auto mask = mapped.error().empty() ? decode_rle(mapped.data(), mapped.size()) : cv::Mat();
+        std::lock_guard lock(mutex_);
+        if (mask.empty()) return mask;
+        std::error_code ec;
+        auto const now = std::filesystem::file_time_type::clock::now();
+        std::filesystem::last_write_time(path, now, ec);
+        if (auto it = entries_.find(key); it != entries_.end()) it->second.used = now;
+        return mask;
+    }
+
+    /// @brief Store the mask of `key`, then evict the least recently used masks while over capacity
+    /// @note Written to a temporary file and renamed, so readers never see a partial mask.
+    void store(std::string const& key, cv::Mat const& mask) {
+        std::vector<unsigned char> encoded;
+        encode_rle(mask, false, encoded);
+        auto const path = file(key);
+        auto const temporary = path.string() + ".tmp" + std::to_string(::getpid()) + "-" + std::to_string(next_temporary_++);
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out.write(reinterpret_cast<char const*>(encoded.data()), encoded.size())) return;
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, path, ec);
+        if (ec) {
+            std::filesystem::remove(temporary, ec);
+            return;
+        }
+
+        std::lock_guard lock(mutex_);
+        auto [it, inserted] = entries_.try_emplace(key, Entry{0, {}});
+        total_ = total_ - it->second.size + encoded.size();
+        it->second = Entry{encoded.size(), std::filesystem::file_time_type::clock::now()};
+        if (total_ > capacity_) evict();
+    }
+
+private:
+    struct Entry {
+        uint64_t size;
+        std::filesystem::file_time_type used;
+    };
+
+    std::filesystem::path file(std::string const& key) const { return directory_ / (key + ".vrle"); }
+
+    /// @brief Remove the oldest entries until 90% of the capacity is left; called with the lock held
+    /// @note Evicting below the cap leaves room, so the sort is paid once per many stores.
+    void evict() {
+        std::vector<std::pair<std::filesystem::file_time_type, std::string>> by_age;
+        by_age.reserve(entries_.size());
+        for (auto const& [key, entry] : entries_) by_age.emplace_back(entry.used, key);
+        std::sort(by_age.begin(), by_age.end());
+        std::error_code ec;
+        for (auto const& [used, key] : by_age) {
+            if (total_ <= capacity_ / 10 * 9) break;
+            auto const it = entries_.find(key);
+            total_ -= it->second.size;
+            entries_.erase(it);
+            std::filesystem::remove(file(key), ec);
+        }
+    }
+
+    std::filesystem::path directory_;
+    uint64_t capacity_;
+    uint64_t seed_;
+    std::string error_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    uint64_t total_ = 0;
+    std::atomic<uint64_t> next_temporary_{0};
+};
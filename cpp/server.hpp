@@ -0,0 +1,251 @@
+/// server.hpp
+/// Purpose: Length-prefixed request/reply framing over STDIN/STDOUT or a Unix domain socket.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bounded_queue.hpp"
+
+/////////////////////////
+// Wire format, all integers little endian
+//
+// request: u32 id | u8 reply kind | u32 length | length bytes of an encoded image
+// reply:   u32 id | u8 status     | u32 length | length bytes of the result, or of the error text
+//
+// Replies on one connection may come back in any order when several workers serve it; `id` is
+// echoed so the client can match them.
+
+/// @brief What a request asks to get back: a PNG mask or composite, or one of the `mask_codec.hpp` encodings
+enum class ReplyKind : uint8_t { mask = 0, composite = 1, bits = 2, rle = 3, rle_zstd = 4 };
+
+/// @brief Outcome carried in the reply header
+enum class ReplyStatus : uint8_t { ok = 0, error = 1 };
+
+/// @brief Largest accepted request payload; anything bigger is taken as a framing error
+inline constexpr uint32_t max_request_bytes = 256u << 20;
+
+/// @brief One end of a client stream; replies from any thread are serialized by a lock
+class Connection {
+public:
+    /// @param in Descriptor requests are read from
+    /// @param out Descriptor replies are written to
+    /// @param owned Whether the descriptors are closed with the connection
+    Connection(int in, int out, bool owned) : in_{in}, out_{out}, owned_{owned} {}
+
+    ~Connection() {
+        if (owned_) {
+            ::close(in_);
+            if (out_ != in_) ::close(out_);
+        }
+    }
+
+    Connection(Connection const&) = delete;
+    Connection& operator=(Connection const&) = delete;
+
+    /// @brief Write one reply frame
+    /// @return `false` if the client went away
+    bool send(uint32_t id, ReplyStatus status, unsigned char const* data, size_t size) {
+        std::array<unsigned char, 9> header{};
+        put_u32(header.data(), id);
+        header[4] = static_cast<unsigned char>(status);
+        put_u32(header.data() + 5, static_cast<uint32_t>(size));
+        std::lock_guard lock(mutex_);
+        return write_all(header.data(), header.size()) && write_all(data, size);
+    }
+
+    /// @brief Stop reading; replies already queued can still be written
+    void shutdown_read() { ::shutdown(in_, SHUT_RD); }
+
+    static void put_u32(unsigned char* p, uint32_t v) {
+        p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+    }
+
+    static uint32_t get_u32(unsigned char const* p) {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    /// @brief Fill `size` bytes from the input
+    /// @return `false` on end of stream or error
+    bool read_all(unsigned char* data, size_t size) {
+        while (size) {
+            auto const n = ::read(in_, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+private:
+    bool write_all(unsigned char const* data, size_t size) {
+        while (size) {
+            auto const n = ::write(out_, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    int in_, out_;
+    bool owned_;
+    std::mutex mutex_;
+};
+
+/// @brief One decoded request frame, and the reply a worker fills in
+struct Request {
+    std::shared_ptr<Connection> connection;
+    uint32_t id = 0;
+    ReplyKind kind = ReplyKind::mask;
+    std::vector<unsigned char> payload;
+    /// Set by the worker: the encoded reply image, or the error text
+    ReplyStatus status = ReplyStatus::ok;
+    std::vector<unsigned char> reply;
+
+    void fail(std::string const& error) {
+        status = ReplyStatus::error;
+        reply.assign(error.begin(), error.end());
+    }
+
+    /// @brief Send the reply; a client that has gone away is not an error of the server
+    void respond() { connection->send(id, status, reply.data(), reply.size()); }
+};
+
+/// @brief Accepts request frames from STDIN or a Unix socket and queues them for worker threads
+/// @note Workers call `next_batch()` until it returns `false` and `respond()` each request. The queue
+///       bounds how many requests are held at once; readers stop consuming their streams while it
+///       is full, so a fast client is slowed to the rate of the workers.
+class FrameServer {
+public:
+    /// @param queue_depth Requests waiting for a worker before readers block
+    explicit FrameServer(size_t queue_depth) : queue_{queue_depth} {}
+
+    /// @brief Wait for requests and take up to `max_batch` of them
+    /// @return `false` once the server has stopped and every request was handed out
+    bool next_batch(size_t max_batch, std::vector<Request>& batch) {
+        return queue_.pop_some(max_batch, batch);
+    }
+
+    /// @brief Requests waiting for a worker now
+    size_t queued() const { return queue_.size(); }
+
+    /// @brief Read requests from STDIN and reply on STDOUT until end of input
+    void serve_stdio() {
+        ignore_broken_pipe();
+        read_requests(std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false));
+        queue_.close();
+    }
+
+    /// @brief Accept clients on a Unix socket until SIGINT or SIGTERM
+    /// @param path Socket path; an existing socket file there is replaced and removed on return
+    /// @return Empty on a clean shutdown, otherwise the reason the socket could not be set up
+    std::string serve_socket(std::string const& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            queue_.close();
+            return path + ": socket path too long";
+        }
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        int const listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ::unlink(path.c_str());
+        if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listener, SOMAXCONN) != 0) {
+            std::string error = path + ": " + std::strerror(errno);
+            if (listener >= 0) ::close(listener);
+            queue_.close();
+            return error;
+        }
+
+        install_stop_handlers();
+        std::vector<Reader> readers;
+        while (!stop_requested()) {
+            pollfd pending{listener, POLLIN, 0};
+            // wake up now and then so a signal that lands between the check and poll() is not missed
+            if (::poll(&pending, 1, 200) <= 0) continue;
+            int const client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            // join the readers of clients that have disconnected
+            std::erase_if(readers, [](Reader const& reader) { return reader.done->load(); });
+            auto connection = std::make_shared<Connection>(client, client, true);
+            auto done = std::make_shared<std::atomic<bool>>(false);
+            std::jthread thread([this, connection, done]() {
+                read_requests(connection);
+                done->store(true);
+            });
+            readers.push_back(Reader{connection, done, std::move(thread)});
+        }
+        ::close(listener);
+        ::unlink(path.c_str());
+
+        // readers see end of stream; requests they already queued are still answered
+        for (auto& reader : readers) {
+            if (auto connection = reader.connection.lock()) connection->shutdown_read();
+        }
+        readers.clear();
+        queue_.close();
+        return {};
+    }
+
+private:
+    /// @brief Thread reading one client, and whether it has finished
+    struct Reader {
+        std::weak_ptr<Connection> connection;
+        std::shared_ptr<std::atomic<bool>> done;
+        std::jthread thread;
+    };
+
+    /// @brief Queue every frame of one stream until it ends or is malformed
+    void read_requests(std::shared_ptr<Connection> connection) {
+        std::array<unsigned char, 9> header{};
+        while (connection->read_all(header.data(), header.size())) {
+            Request request{connection, Connection::get_u32(header.data())};
+            auto const size = Connection::get_u32(header.data() + 5);
+            if (header[4] > static_cast<unsigned char>(ReplyKind::rle_zstd) || size > max_request_bytes) {
+                request.fail("malformed request header");
+                request.respond();
+                return;
+            }
+            request.kind = static_cast<ReplyKind>(header[4]);
+            request.payload.resize(size);
+            if (!connection->read_all(request.payload.data(), size)) return;
+            if (!queue_.push(std::move(request))) return;
+        }
+    }
+
+    static bool stop_requested() { return stop_.load(); }
+
+    static void install_stop_handlers() {
+        struct sigaction action{};
+        action.sa_handler = [](int) { stop_.store(true); };
+        sigemptyset(&action.sa_mask);
+        ::sigaction(SIGINT, &action, nullptr);
+        ::sigaction(SIGTERM, &action, nullptr);
+        ignore_broken_pipe();
+    }
+
+    /// @brief A client closing early must show up as a failed write, not kill the server
+    static void ignore_broken_pipe() { std::signal(SIGPIPE, SIG_IGN); }
+
+    // set from the signal handler, hence lock-free and not a function-local static
+    static inline std::atomic<bool> stop_{false};
+    BoundedQueue<Request> queue_;
+};
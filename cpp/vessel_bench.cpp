@@ -0,0 +1,180 @@
+/// vessel_bench.cpp
+/// Purpose: Measure `ExtractArteries` throughput, end-to-end and per stage, over the DRIVE test images.
+///
+/// Usage: vessel_bench [benchmark flags] [<image_dir>]
+/// `<image_dir>` defaults to the repo's drive/DRIVE/test/images. All images are decoded before timing starts.
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "extract_arteries.hpp"
+
+namespace {
+
+/// @brief Input of every stage for each preloaded image, computed once with the regular pipeline
+struct StageInputs {
+    std::vector<cv::Mat> decoded;
+    std::vector<cv::Mat> filtered;
+    std::vector<cv::Mat> large_arteries;
+    std::vector<cv::Mat> median;
+    std::vector<cv::Mat> threshold;
+    std::vector<cv::Mat> cleaned;
+};
+
+StageInputs stage_inputs;
+
+/// @brief Decode every .tif in `dir`, sorted by name, as `read_image` does
+std::vector<cv::Mat> load_images(std::filesystem::path const& dir) {
+    std::vector<std::filesystem::path> paths;
+    for (auto const& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".tif") paths.push_back(entry.path());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<cv::Mat> images;
+    for (auto const& path : paths) {
+        auto image = cv::imread(path.string());
+        if (!image.empty()) images.push_back(image);
+    }
+    return images;
+}
+
+void compute_stage_inputs(std::vector<cv::Mat> const& images) {
+    ExtractArteries ex;
+    stage_inputs.decoded = images;
+    for (auto const& decoded : images) {
+        stage_inputs.filtered.push_back( ex.color_filter(decoded).clone() );
+        stage_inputs.large_arteries.push_back( ex.large_arteries(stage_inputs.filtered.back()).clone() );
+        cv::Mat median_img;
+        cv::medianBlur(stage_inputs.large_arteries.back(), median_img, 3);
+        stage_inputs.median.push_back( median_img );
+        stage_inputs.threshold.push_back( ex.threshold(median_img).clone() );
+        stage_inputs.cleaned.push_back( ex.remove_blobs(stage_inputs.threshold.back()).clone() );
+    }
+}
+
+using StageFn = std::function<void(ExtractArteries&, cv::Mat const&, cv::Mat&)>;
+
+/// @brief Run `fn` over `images` round-robin; each benchmark thread owns its `ExtractArteries`
+void run_stage(benchmark::State& state, std::vector<cv::Mat> const& images, StageFn const& fn) {
+    ExtractArteries ex;
+    cv::Mat output;
+    size_t i = state.thread_index();
+    for (auto _ : state) {
+        fn(ex, images[i++ % images.size()], output);
+        benchmark::DoNotOptimize(output.data);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void register_stage(std::string const& name, std::vector<cv::Mat> const& images, StageFn fn) {
+    int const max_threads = std::max(1u, std::thread::hardware_concurrency());
+    benchmark::RegisterBenchmark(name.c_str(), [&images, fn](benchmark::State& state) {
+            run_stage(state, images, fn);
+        })
+        ->ThreadRange(1, max_threads)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    std::filesystem::path const dir = (argc > 1) ? argv[1] : VESSEL_DRIVE_DIR;
+
+    auto images = load_images(dir);
+    if (images.empty()) {
+        std::cerr << "No .tif images found in " << dir << std::endl;
+        return 1;
+    }
+    compute_stage_inputs(images);
+
+    auto const& in = stage_inputs;
+    register_stage("extract", in.decoded, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        ex.extract(image, out);
+    });
+    register_stage("extract/tiled", in.decoded, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        ex.set_tile_size(256);
+        ex.extract(image, out);
+    });
+    for (int factor : {2, 4}) {
+        register_stage("extract/pyramid" + std::to_string(factor), in.decoded,
+            [factor](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+                if (ex.pyramid() != factor) ex.set_pyramid(factor);
+                ex.extract(image, out);
+            });
+    }
+    // whole batches, where images per cascade call is what differs; items are images
+    for (int stack : {1, 4, 10}) {
+        benchmark::RegisterBenchmark(("extract_batch/micro" + std::to_string(stack)).c_str(), [&in, stack](benchmark::State& state) {
+                ExtractArteries ex;
+                ex.set_micro_batch(stack);
+                std::vector<cv::Mat> masks(in.decoded.size());
+                for (auto _ : state) {
+                    ex.extract_batch(in.decoded, masks);
+                    benchmark::DoNotOptimize(masks.back().data);
+                    benchmark::ClobberMemory();
+                }
+                state.SetItemsProcessed(state.iterations() * in.decoded.size());
+            })
+            ->ThreadRange(1, std::max(1u, std::thread::hardware_concurrency()))
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+    }
+    register_stage("extract/green", in.decoded, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        if (ex.luminance() != Luminance::green) ex.set_luminance(Luminance::green);
+        ex.extract(image, out);
+    });
+    for (auto backend : {Backend::opencl, Backend::cuda}) {
+        if (!backend_available(backend)) continue;
+        register_stage(std::string("extract/") + backend_name(backend), in.decoded,
+            [backend](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+                if (ex.backend() != backend) ex.set_backend(backend);
+                ex.extract(image, out);
+            });
+    }
+    register_stage("color_filter", in.decoded, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        out = ex.color_filter(image);
+    });
+    register_stage("large_arteries", in.filtered, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        out = ex.large_arteries(image);
+    });
+    register_stage("large_arteries_reference", in.filtered, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        out = ex.large_arteries_reference(image);
+    });
+    register_stage("median", in.large_arteries, [](ExtractArteries&, cv::Mat const& image, cv::Mat& out) {
+        cv::medianBlur(image, out, 3);
+    });
+    register_stage("median_histogram", in.large_arteries, [](ExtractArteries&, cv::Mat const& image, cv::Mat& out) {
+        thread_local FusedMedian median;
+        std::array<int, 256> hist;
+        median.apply(image, out, cv::Mat(), hist);
+        benchmark::DoNotOptimize(hist);
+    });
+    register_stage("threshold", in.median, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        out = ex.threshold(image);
+    });
+    register_stage("remove_blobs", in.threshold, [](ExtractArteries& ex, cv::Mat const& image, cv::Mat& out) {
+        out = ex.remove_blobs(image);
+    });
+    register_stage("final_median", in.cleaned, [](ExtractArteries&, cv::Mat const& image, cv::Mat& out) {
+        cv::medianBlur(image, out, 3);
+    });
+
+    benchmark::AddCustomContext("images", std::to_string(images.size()) + " from " + dir.string());
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,364 @@
+/// vessel_eval.cpp
+/// Purpose: Score `ExtractArteries` against the DRIVE manual segmentations, with its time and memory cost.
+///
+/// Usage: vessel_eval [-j <n>] [--json] [--fov auto|mask] [--luminance lab|green] [--tile <px>] [--pyramid 2|4]
+///                    [--backend cpu|opencl|cuda] [--reference] [--min-agreement <dice>] [<training_dir>]
+/// `<training_dir>` defaults to the repo's drive/DRIVE/training and holds images/NN_training.tif,
+/// 1st_manual/NN_manual1.gif, and mask/NN_training_mask.gif. Scores count only pixels inside the
+/// field of view mask, however the pipeline itself is told about the field of view.
+/// `--reference` also segments every image with the exact default pipeline and reports the Dice of
+/// the variant's mask against that one, and the time of both, to judge approximations such as `--pyramid`.
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <opencv2/core.hpp>
+
+#include "extract_arteries.hpp"
+#include "image_io.hpp"
+
+namespace {
+
+/// @brief Settings given on the command line
+struct Options {
+    int jobs = 0;
+    bool json = false;
+    /// Field of view given to the pipeline: empty for the whole frame, "auto" to detect it, "mask" for the DRIVE mask
+    std::string fov;
+    Luminance luminance = Luminance::lab;
+    int tile_size = 0;
+    int pyramid = 1;
+    Backend backend = Backend::cpu;
+    /// Also run the default pipeline, on the CPU without tiles or pyramid, and compare with it
+    bool reference = false;
+    /// Fail if the pooled Dice against the default pipeline's masks is lower
+    double min_agreement = 0;
+    std::filesystem::path dir = VESSEL_DRIVE_TRAINING_DIR;
+};
+
+/// @brief Pixel counts of a mask against the manual segmentation, inside the field of view
+struct Confusion {
+    uint64_t tp = 0, fp = 0, fn = 0, tn = 0;
+
+    Confusion& operator+=(Confusion const& other) {
+        tp += other.tp; fp += other.fp; fn += other.fn; tn += other.tn;
+        return *this;
+    }
+
+    double dice() const { return ratio(2*tp, 2*tp + fp + fn); }
+    double sensitivity() const { return ratio(tp, tp + fn); }
+    double specificity() const { return ratio(tn, tn + fp); }
+
+    static double ratio(uint64_t num, uint64_t den) { return den ? double(num) / double(den) : 0.0; }
+};
+
+/// @brief Outcome of one training image
+struct ImageScore {
+    std::string name;
+    std::string error;
+    Confusion confusion;
+    double extract_ms = 0;
+    /// Against the default pipeline's mask, with `--reference`
+    Confusion agreement;
+    double reference_ms = 0;
+};
+
+/// @brief Count agreement of `mask` with `manual` where `fov` is non-zero; all CV_8UC1 of one size
+Confusion score(cv::Mat const& mask, cv::Mat const& manual, cv::Mat const& fov) {
+    Confusion c;
+    for (int y = 0; y < mask.rows; y++) {
+        auto const* m = mask.ptr<uint8_t>(y);
+        auto const* g = manual.ptr<uint8_t>(y);
+        auto const* f = fov.ptr<uint8_t>(y);
+        for (int x = 0; x < mask.cols; x++) {
+            if (!f[x]) continue;
+            bool const predicted = m[x] != 0, truth = g[x] != 0;
+            c.tp += predicted && truth;
+            c.fp += predicted && !truth;
+            c.fn += !predicted && truth;
+            c.tn += !predicted && !truth;
+        }
+    }
+    return c;
+}
+
+/// @brief Decode one training image with its manual segmentation and mask, segment it, and score it
+/// @param reference Default pipeline to compare with, or `nullptr`
+void evaluate(Options const& options, ExtractArteries& ex, ExtractArteries* reference,
+              std::filesystem::path const& image_path, ImageScore& result) {
+    auto const stem = image_path.stem().string();
+    auto const number = stem.substr(0, stem.find('_'));
+    result.name = number;
+    auto const manual_path = options.dir / "1st_manual" / (number + "_manual1.gif");
+    auto const mask_path = options.dir / "mask" / (stem + "_mask.gif");
+
+    auto const image = imread_mapped(image_path.string(), cv::IMREAD_COLOR, result.error);
+    if (image.empty()) return;
+    auto const manual = read_mask(manual_path.string());
+    auto const fov = read_mask(mask_path.string());
+    if (manual.size() != image.size() || fov.size() != image.size()) {
+        result.error = (manual.size() != image.size() ? manual_path : mask_path).string()
+            + " is missing or does not match " + image_path.string();
+        return;
+    }
+
+    cv::Mat pipeline_fov;
+    if (options.fov == "mask") pipeline_fov = fov;
+    auto const start = std::chrono::steady_clock::now();
+    if (options.fov == "auto") pipeline_fov = ExtractArteries::detect_fov(image);
+    cv::Mat mask;
+    ex.extract(image, mask, pipeline_fov);
+    std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    result.extract_ms = elapsed.count();
+    result.confusion = score(mask, manual, fov);
+
+    if (reference) {
+        cv::Mat expected;
+        auto const reference_start = std::chrono::steady_clock::now();
+        reference->extract(image, expected, pipeline_fov);
+        std::chrono::duration<double, std::milli> const reference_elapsed = std::chrono::steady_clock::now() - reference_start;
+        result.reference_ms = reference_elapsed.count();
+        result.agreement = score(mask, expected, fov);
+    }
+}
+
+/// @brief Largest resident set of the process so far, in KiB
+long peak_rss_kib() {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/// @brief Scores over every scored image
+struct Summary {
+    Confusion pooled;
+    double mean[3] = {0, 0, 0};
+    /// With `--reference`: pooled against the default pipeline, and total times of both
+    Confusion agreement;
+    double extract_ms = 0, reference_ms = 0;
+};
+
+void print_text(std::vector<ImageScore> const& scores, Summary const& summary, bool reference,
+                double wall_seconds, int jobs) {
+    std::cout << std::fixed << std::setprecision(4);
+    std::cout << "image      dice  sensitivity  specificity  extract_ms" << (reference ? "  agreement  reference_ms" : "") << "\n";
+    for (auto const& s : scores) {
+        if (!s.error.empty()) continue;
+        std::cout << std::left << std::setw(6) << s.name << std::right
+                  << std::setw(9) << s.confusion.dice() << std::setw(13) << s.confusion.sensitivity()
+                  << std::setw(13) << s.confusion.specificity()
+                  << std::setw(12) << std::setprecision(1) << s.extract_ms << std::setprecision(4);
+        if (reference) {
+            std::cout << std::setw(11) << s.agreement.dice()
+                      << std::setw(14) << std::setprecision(1) << s.reference_ms << std::setprecision(4);
+        }
+        std::cout << "\n";
+    }
+    auto const& mean = summary.mean;
+    auto const& pooled = summary.pooled;
+    std::cout << std::left << std::setw(6) << "mean" << std::right
+              << std::setw(9) << mean[0] << std::setw(13) << mean[1] << std::setw(13) << mean[2] << "\n";
+    std::cout << std::left << std::setw(6) << "pooled" << std::right
+              << std::setw(9) << pooled.dice() << std::setw(13) << pooled.sensitivity()
+              << std::setw(13) << pooled.specificity();
+    if (reference) {
+        std::cout << std::setw(12) << std::setprecision(1) << summary.extract_ms
+                  << std::setprecision(4) << std::setw(11) << summary.agreement.dice()
+                  << std::setw(14) << std::setprecision(1) << summary.reference_ms;
+    }
+    std::cout << "\n";
+    std::cout << std::setprecision(3) << "wall " << wall_seconds << " s with " << jobs << " jobs, peak RSS "
+              << peak_rss_kib() / 1024.0 << " MiB" << std::endl;
+}
+
+void print_json(std::vector<ImageScore> const& scores, Summary const& summary, bool reference,
+                double wall_seconds, int jobs, std::string const& parameters) {
+    auto metrics = [](std::ostream& out, double dice, double sensitivity, double specificity) {
+        out << "\"dice\":" << dice << ",\"sensitivity\":" << sensitivity << ",\"specificity\":" << specificity;
+    };
+    std::ostringstream out;
+    out << std::setprecision(6) << "{\"parameters\":\"" << parameters << "\",\"jobs\":" << jobs << ",\"images\":[";
+    bool first = true;
+    for (auto const& s : scores) {
+        if (!s.error.empty()) continue;
+        out << (first ? "" : ",") << "{\"name\":\"" << s.name << "\",";
+        metrics(out, s.confusion.dice(), s.confusion.sensitivity(), s.confusion.specificity());
+        out << ",\"extract_ms\":" << s.extract_ms;
+        if (reference) out << ",\"agreement\":" << s.agreement.dice() << ",\"reference_ms\":" << s.reference_ms;
+        out << "}";
+        first = false;
+    }
+    auto const& mean = summary.mean;
+    auto const& pooled = summary.pooled;
+    out << "],\"mean\":{";
+    metrics(out, mean[0], mean[1], mean[2]);
+    out << "},\"pooled\":{";
+    metrics(out, pooled.dice(), pooled.sensitivity(), pooled.specificity());
+    if (reference) {
+        out << ",\"extract_ms\":" << summary.extract_ms << ",\"agreement\":" << summary.agreement.dice()
+            << ",\"reference_ms\":" << summary.reference_ms;
+    }
+    out << "},\"wall_seconds\":" << wall_seconds << ",\"peak_rss_kib\":" << peak_rss_kib() << "}";
+    std::cout << out.str() << std::endl;
+}
+
+void help(std::string const& program_name, std::string const& error_msg = "") {
+    std::cout << program_name << " [-h] [-j <n>] [--json] [--fov auto|mask] [--luminance lab|green] [--tile <px>]\n"
+              << "\t[--pyramid 2|4] [--backend cpu|opencl|cuda] [--reference] [--min-agreement <dice>] [<training_dir>]\n";
+    std::cout << "\t-j <n> : score <n> images concurrently, each worker owning an ExtractArteries. Default 0, one per core.\n";
+    std::cout << "\t--json : print one JSON object instead of a table.\n";
+    std::cout << "\t--fov auto|mask : segment only inside the field of view, detected or the DRIVE mask. Default whole frame.\n";
+    std::cout << "\t--luminance, --tile, --pyramid, --backend : as for vessel_segmentation.\n";
+    std::cout << "\t--reference : also run the default pipeline, print each mask's Dice against its mask and the time of both.\n";
+    std::cout << "\t--min-agreement <dice> : with --reference, exit 1 if the pooled Dice against the default pipeline is lower.\n";
+    std::cout << "\t<training_dir> : holds images/, 1st_manual/, and mask/. Default the repo's drive/DRIVE/training.\n";
+    if (!error_msg.empty()) std::cerr << error_msg << std::endl;
+}
+
+bool parse_count(std::string const& value, int minimum, int& count) {
+    auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), count);
+    return ec == std::errc() && ptr == value.data() + value.size() && count >= minimum;
+}
+
+bool parse_fraction(std::string const& value, double& fraction) {
+    auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), fraction);
+    return ec == std::errc() && ptr == value.data() + value.size() && fraction >= 0 && fraction <= 1;
+}
+
+/// @return Shell return code, or -1 to go on
+int parse_args(int argc, char* argv[], Options& options) {
+    std::string const program_name(argv[0]);
+    for (int i = 1; i < argc; i++) {
+        std::string const arg(argv[i]);
+        std::string const value = (i+1 < argc) ? argv[i+1] : "";
+        auto fail = [&](std::string const& expected) {
+            help(program_name, arg + " expects " + expected + ", got '" + value + "'");
+            return 1;
+        };
+        if (arg == "-h") {
+            help(program_name);
+            return 0;
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "-j") {
+            if (!parse_count(value, 0, options.jobs)) return fail("a number of at least 0");
+            i++;
+        } else if (arg == "--fov") {
+            if (value != "auto" && value != "mask") return fail("auto or mask");
+            options.fov = value;
+            i++;
+        } else if (arg == "--luminance") {
+            if (value != "lab" && value != "green") return fail("lab or green");
+            options.luminance = value == "green" ? Luminance::green : Luminance::lab;
+            i++;
+        } else if (arg == "--tile") {
+            if (!parse_count(value, 0, options.tile_size)) return fail("a number of at least 0");
+            i++;
+        } else if (arg == "--pyramid") {
+            if (!parse_count(value, 1, options.pyramid) || (options.pyramid != 2 && options.pyramid != 4)) return fail("2 or 4");
+            i++;
+        } else if (arg == "--backend") {
+            if (value == "cpu") options.backend = Backend::cpu;
+            else if (value == "opencl") options.backend = Backend::opencl;
+            else if (value == "cuda") options.backend = Backend::cuda;
+            else return fail("cpu, opencl, or cuda");
+            if (!backend_available(options.backend)) return fail("a backend with a usable device");
+            i++;
+        } else if (arg == "--reference") {
+            options.reference = true;
+        } else if (arg == "--min-agreement") {
+            if (!parse_fraction(value, options.min_agreement)) return fail("a Dice between 0 and 1");
+            options.reference = true;
+            i++;
+        } else if (!arg.empty() && arg[0] == '-') {
+            help(program_name, "Unknown flag " + arg);
+            return 1;
+        } else {
+            options.dir = arg;
+        }
+    }
+    if (options.jobs == 0) options.jobs = std::max(1u, std::thread::hardware_concurrency());
+    return -1;
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (int const result = parse_args(argc, argv, options); result >= 0) return result;
+
+    std::vector<std::filesystem::path> paths;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(options.dir / "images", ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() == ".tif") paths.push_back(it->path());
+    }
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) {
+        std::cerr << "No .tif images found in " << (options.dir / "images") << std::endl;
+        return 1;
+    }
+
+    // workers take the next unscored image, so a slow image does not hold back a fixed share
+    std::vector<ImageScore> scores(paths.size());
+    std::atomic<size_t> next{0};
+    std::string parameters;
+    auto const start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> workers;
+        for (int w = 0; w < options.jobs; w++) {
+            workers.emplace_back([&, w]() {
+                ExtractArteries ex;
+                ExtractArteries reference;
+                reference.set_luminance(options.luminance);
+                ex.set_luminance(options.luminance);
+                ex.set_tile_size(options.tile_size);
+                ex.set_pyramid(options.pyramid);
+                ex.set_backend(options.backend);
+                if (w == 0) parameters = ex.parameters();
+                for (auto i = next++; i < paths.size(); i = next++) evaluate(options, ex, options.reference ? &reference : nullptr, paths[i], scores[i]);
+            });
+        }
+    }
+    std::chrono::duration<double> const wall = std::chrono::steady_clock::now() - start;
+
+    Summary summary;
+    int scored = 0;
+    for (auto const& s : scores) {
+        if (!s.error.empty()) {
+            std::cerr << "Error: " << s.error << std::endl;
+            continue;
+        }
+        summary.pooled += s.confusion;
+        summary.mean[0] += s.confusion.dice();
+        summary.mean[1] += s.confusion.sensitivity();
+        summary.mean[2] += s.confusion.specificity();
+        summary.agreement += s.agreement;
+        summary.extract_ms += s.extract_ms;
+        summary.reference_ms += s.reference_ms;
+        scored++;
+    }
+    if (scored) for (auto& m : summary.mean) m /= scored;
+
+    if (options.json) {
+        print_json(scores, summary, options.reference, wall.count(), options.jobs, parameters);
+    } else {
+        print_text(scores, summary, options.reference, wall.count(), options.jobs);
+    }
+    if (options.reference && summary.agreement.dice() < options.min_agreement) {
+        std::cerr << "Error: pooled Dice against the default pipeline " << summary.agreement.dice()
+                  << " is below " << options.min_agreement << std::endl;
+        return 1;
+    }
+    return scored == static_cast<int>(scores.size()) ? 0 : 1;
+}
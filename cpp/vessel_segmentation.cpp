@@ -6,252 +6,823 @@
 #include <tuple>
 #include <sstream>
 #include <filesystem>
+#include <fstream>
 #include <tuple>
 #include <set>
 #include <algorithm>
-#include <opencv2/opencv.hpp>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <charconv>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
 
-/////////////////////////
-// Utility functions
+#include "affinity.hpp"
+#include "autotune.hpp"
+#include "bounded_queue.hpp"
+#include "container.hpp"
+#include "display.hpp"
+#include "extract_arteries.hpp"
+#include "image_io.hpp"
+#include "logging.hpp"
+#include "mapped_file.hpp"
+#include "mask_codec.hpp"
+#include "metrics.hpp"
+#include "pair_source.hpp"
+#include "profiler.hpp"
+#include "result_cache.hpp"
+#include "server.hpp"
 
-void show_image(cv::Mat image, std::string const& title) {
-    cv::imshow(title, image);
-    int key = 0;
 
-    while (key != 27 && key !='q' && key != ' ') {
-        key = cv::waitKey(10) & 0xff;
+enum class Flag { show, help, pipeline, pin, stream };
+
+enum class ProfileFormat { none, table, json };
+
+/// @brief Flags and numeric settings given on the command line
+struct Options {
+    std::set<Flag> flags;
+    /// Number of input/output pairs processed concurrently, each worker owning an `ExtractArteries`
+    int jobs = 1;
+    /// Capacity of each queue between pipeline stages
+    int queue_depth = 4;
+    /// How to print the per-stage timing summary, if at all
+    ProfileFormat profile = ProfileFormat::none;
+    /// Field of view source: empty for the whole frame, "auto" to detect it, otherwise a directory of DRIVE masks
+    std::string fov;
+    /// File listing input/output pairs, "-" for STDIN
+    std::string manifest;
+    /// Directory whose files are all processed into `output_dir`, named by `name_template`
+    std::string input_dir;
+    std::string output_dir;
+    std::string name_template = "{stem}.png";
+    /// How each result is stored
+    OutputFormat output_format = OutputFormat::mask;
+    /// Compression of PNG masks and composites
+    PngSettings png;
+    /// Decode threads and encode threads of the pipeline, each, besides the `jobs` extract workers
+    int io_threads = 1;
+    /// Threads of OpenCV's pool that parallelize within an image, 0 to pick from the cores left per worker
+    int inner_threads = 0;
+    /// File all results are appended to, keyed by output path, instead of one file per result
+    std::string container;
+    /// Directory of cached masks, empty for none
+    std::string cache;
+    /// Size of the cache directory in MiB before the least recently used masks are evicted
+    int cache_size = 1024;
+    /// Where the image-to-image stages run
+    Backend backend = Backend::cpu;
+    /// Plane that is enhanced and segmented
+    Luminance luminance = Luminance::lab;
+    /// Side of the tiles large frames are split into, 0 for none
+    int tile_size = 0;
+    /// Implementation of each stage
+    StageKernels kernels;
+    /// Image the kernels, backend, and tile size are tuned on, empty to use the defaults
+    std::string autotune;
+    /// Profile of settings tuned on earlier runs, empty for `TuneProfile::default_path()`
+    std::string autotune_file;
+    /// Resolution divisor of the large-element background estimate, 1 for exact
+    int pyramid = 1;
+    /// Server endpoint: empty to process files, "-" for STDIN/STDOUT, otherwise a Unix socket path
+    std::string serve;
+    /// Most queued requests a server worker takes at once
+    int max_batch = 1;
+    /// Most images of one batch run through the cascade as one stack
+    int micro_batch = 1;
+    /// Video file or camera index segmented frame by frame, and the video the masks are written to
+    std::string video;
+    std::string video_output;
+    /// Codec of `video_output`, as four characters
+    std::string fourcc = "FFV1";
+    /// Mean luminance change, in gray levels, up to which a frame reuses the estimates of the last refresh
+    double reuse_threshold = 2;
+    /// Frames after which the estimates are refreshed regardless
+    int refresh = 30;
+    /// Rows segmented at a time with `Flag::stream`
+    int band_rows = 256;
+    /// Directory of the files `Flag::stream` spills intermediates to, empty for the system's temporary directory
+    std::string spill_dir;
+    /// `[<host>:]<port>` answering Prometheus scrapes while the process runs, empty for none
+    std::string metrics_listen;
+    /// File the metrics are written to when the run ends, empty for none
+    std::string metrics_file;
+    /// How diagnostics on STDERR are written
+    LogFormat log_format = LogFormat::text;
+
+    bool contains(Flag flag) const { return flags.contains(flag); }
+    void insert(Flag flag) { flags.insert(flag); }
+};
+
+
+/// @brief Output help text
+/// @param program_name Included in output
+/// @param error_msg Optional message to include in output to STDERR
+void help(std::string const& program_name, std::string error_msg = "") {
+    std::cout << program_name << " [-h] [-s] [-j <n>] [-p] [-q <depth>] [--profile[=json]] [--fov auto|<mask_dir>]\n"
+              << "\t[--backend cpu|opencl|cuda] [--luminance lab|green] [--tile <px>] [--pyramid 2|4]\n"
+              << "\t[--output mask|bits|rle|rle-zstd|composite] [--png-level 0-9|fast] [--png-filter <filter>] [--io-threads <n>]\n"
+              << "\t[--pin] [--inner-threads <n>] [--autotune <sample_img> [--autotune-file <file>]]\n"
+              << "\t[--container <file>] [--cache <dir> [--cache-size <MiB>]] [--stream [--band <rows>] [--spill-dir <dir>]]\n"
+              << "\t[--metrics-listen [<host>:]<port>] [--metrics-file <file>] [--log-format text|json]\n"
+              << "\t[<input_img> <output_img>]* | --manifest <file> | --input-dir <dir> --output-dir <dir> [--name <template>]\n"
+              << "\t| --serve -|<socket> [--batch <n> [--micro-batch <n>]]\n"
+              << "\t| --video <source> <output_video> [--fourcc <code>] [--reuse-threshold <levels>] [--refresh <frames>]" << std::endl;
+    std::cout << "\t-h : print help\n";
+    std::cout << "\t-s : show images. Press 'q', SPACE, or ESC to close window.\n";
+    std::cout << "\t-j <n> : process <n> image pairs concurrently, 0 for one per core. Default 1.\n";
+    std::cout << "\t-p : pipeline mode, decoding and encoding on their own threads while <n> workers segment.\n";
+    std::cout << "\t-q <depth> : images queued between pipeline stages. Default 4.\n";
+    std::cout << "\t--io-threads <n> : with -p, decode on <n> threads and encode on <n> others. Default 1.\n";
+    std::cout << "\t--pin : bind each worker thread to its own core, alternating between NUMA nodes, with its buffers on that node.\n";
+    std::cout << "\t--inner-threads <n> : threads of OpenCV's one process-wide pool. Only one worker at a time runs on it,\n";
+    std::cout << "\t\tthe others' parallel calls run serially, so it helps only with -j well below the core count.\n";
+    std::cout << "\t\tDefault: cores divided by -j.\n";
+    std::cout << "\t--autotune <sample_img> : time each stage's implementations, the backends, and tile sizes on <sample_img>\n";
+    std::cout << "\t\tand use the fastest; OpenCL only if its mask of the sample is the CPU's. The choice is kept per host, -j, image size, and settings.\n";
+    std::cout << "\t--autotune-file <file> : where tuned choices are kept. Default $XDG_CACHE_HOME/vessel_segmentation/autotune.\n";
+    std::cout << "\t--profile[=json] : print per-stage timing (min/mean/p50/p99) and counters as a table or JSON.\n";
+    std::cout << "\t--fov auto|<mask_dir> : segment only inside the field of view, detected from the image or read\n";
+    std::cout << "\t\tfrom <mask_dir>/<input_stem>_mask.gif as shipped with DRIVE.\n";
+    std::cout << "\t--backend cpu|opencl|cuda : device for color filter through threshold. Default cpu.\n";
+    std::cout << "\t--luminance lab|green : segment L of Lab, or the green channel. Default lab.\n";
+    std::cout << "\t--tile <px> : split larger frames into <px> tiles segmented in parallel, same output. Default 0, off.\n";
+    std::cout << "\t--pyramid 2|4 : estimate the background of the larger elements at 1/2 or 1/4 resolution. Faster, approximate.\n";
+    std::cout << "\t--output mask|bits|rle|rle-zstd|composite : store the mask as a 1-bit PNG (or the image type of\n";
+    std::cout << "\t\t<output_img>), 1-bit PBM, run lengths, zstd-compressed run lengths, or side by side with\n";
+    std::cout << "\t\tthe input for inspection. Default mask.\n";
+    std::cout << "\t--png-level 0-9|fast : zlib level of PNG outputs; fast is level 1 with run-length matching and no\n";
+    std::cout << "\t\trow filter. Default 1 with run-length matching, as cv::imwrite.\n";
+    std::cout << "\t--png-filter none|sub|up|average|paeth|adaptive : PNG row filter. Default sub, as cv::imwrite; without\n";
+    std::cout << "\t\tlibpng, only sub at the default level and adaptive at any level.\n";
+    std::cout << "\t--container <file> : append every result to <file>, indexed by <output_img>, instead of writing files.\n";
+    std::cout << "\t--cache <dir> : reuse the mask of an input whose bytes and settings were segmented before.\n";
+    std::cout << "\t--cache-size <MiB> : evict the least recently used masks beyond this size. Default 1024.\n";
+    std::cout << "\t--stream : segment each image a band of rows at a time, spilling intermediates to disk, for images\n";
+    std::cout << "\t\ttoo large to hold. Writes mask or bits only; 8-bit RGB TIFF inputs are also read a strip, or --band rows, at a time.\n";
+    std::cout << "\t--band <rows> : rows per band of --stream. Default 256.\n";
+    std::cout << "\t--spill-dir <dir> : where --stream spills, about twice the image's pixel count in bytes. Default $TMPDIR or /tmp.\n";
+    std::cout << "\t--metrics-listen [<host>:]<port> : answer Prometheus scrapes of /metrics over HTTP while running: stage\n";
+    std::cout << "\t\tlatency histograms, image, failure, and cache counts, queue depths. Default host: every interface.\n";
+    std::cout << "\t--metrics-file <file> : write the same metrics to <file> when the run ends, e.g. for a textfile collector.\n";
+    std::cout << "\t--log-format text|json : write errors and notices on STDERR as text, or as one JSON object per line. Default text.\n";
+    std::cout << "\t<input_img> input image that is read and processed.\n";
+    std::cout << "\t<output_img> path where output image is written\n";
+    std::cout << "\t--manifest <file> : read '<input_img>\\t<output_img>' lines from <file>, '-' for STDIN.\n";
+    std::cout << "\t--input-dir <dir> --output-dir <dir> : process every file of <dir>, writing to the output <dir>.\n";
+    std::cout << "\t--name <template> : output file name, {stem} and {name} expand from the input. Default {stem}.png.\n";
+    std::cout << "\t--serve -|<socket> : serve length-prefixed requests on STDIN/STDOUT or a Unix socket until EOF or SIGTERM,\n";
+    std::cout << "\t\twith <n> warm workers and -q requests queued.\n";
+    std::cout << "\t--batch <n> : requests a server worker takes from the queue at once. Default 1.\n";
+    std::cout << "\t--micro-batch <n> : stack up to <n> same-size images of a batch through the morphology, same output. Default 1.\n";
+    std::cout << "\t--video <source> <output_video> : segment a video file, or the camera of that index, frame by frame\n";
+    std::cout << "\t\tinto a video of masks, or of composites with --output composite.\n";
+    std::cout << "\t--fourcc <code> : codec of <output_video>. Default FFV1, lossless.\n";
+    std::cout << "\t--reuse-threshold <levels> : frames whose luminance differs from the last refreshed one by at most this\n";
+    std::cout << "\t\tmean reuse its CLAHE tables and background estimate; 0 refreshes on any change. Default 2.\n";
+    std::cout << "\t--refresh <frames> : refresh the estimates at least every <frames> frames, 1 for every frame. Default 30.\n";
+    if (error_msg.size()) {
+        std::cerr << error_msg << std::endl;
     }
-    cv::destroyWindow(title);
 }
 
-cv::Mat imread_rgb(std::string const& filename) {
-    cv::Mat bgr = cv::imread(filename);
-    cv::Mat result;
-    cv::cvtColor(bgr, result, cv::COLOR_RGB2BGR);
-    return result;
+/// @brief Outcome of processing one input/output pair
+struct PairResult {
+    std::string input_path;
+    std::string output_path;
+    bool success = false;
+    std::string error;
+};
+
+/// @brief Collects per-pair outcomes from any thread as they complete
+/// @note Errors are printed immediately, so a streamed batch of any length keeps only the counts.
+class ResultLog {
+public:
+    /// @param format How errors are printed
+    /// @param metrics Also counts images and failures as they complete, if not `nullptr`
+    explicit ResultLog(LogFormat format = LogFormat::text, Metrics* metrics = nullptr) : format_{format}, metrics_{metrics} {}
+
+    void report(PairResult const& result) {
+        if (metrics_) {
+            metrics_->add(Counter::images);
+            if (!result.success) metrics_->add(Counter::failures);
+        }
+        std::lock_guard lock(mutex_);
+        images_++;
+        if (!result.success) {
+            failures_++;
+            log_message(format_, LogLevel::error, result.error,
+                {{"input", result.input_path}, {"output", result.output_path}});
+        }
+    }
+
+    size_t images() const { return images_; }
+    size_t failures() const { return failures_; }
+
+private:
+    LogFormat const format_;
+    Metrics* const metrics_;
+    std::mutex mutex_;
+    size_t images_ = 0;
+    size_t failures_ = 0;
+};
+
+/// @brief Run one stage for a pair, recording any exception as the pair's error
+/// @param result Receives the error text if `stage` throws
+/// @param stage Callable returning `true` on success
+/// @return `true` if the stage succeeded
+template <typename StageFn>
+bool guarded(PairResult& result, StageFn&& stage) {
+    try {
+        return stage();
+    } catch (std::exception const& e) {
+        // cv::Exception derives from std::exception; one bad pair must not stop the batch
+        result.error = result.input_path + ": " + e.what();
+    }
+    return false;
 }
 
-void print_info(std::string const& str, cv::Mat image) {
-    std::cout << str << " " << image.size() << " " << image.channels() << std::endl;
+/// @brief One image on its way through the read, extract, and write stages
+struct WorkItem {
+    PairResult result;
+    cv::Mat input_img;
+    cv::Mat fov;
+    cv::Mat output_img;
+    /// Key of the mask in the result cache, and whether `output_img` came from it
+    std::string cache_key;
+    bool cached = false;
+};
+
+/// @brief Where results go besides the output files; members are `nullptr` when not in use
+struct Stores {
+    ContainerWriter* container = nullptr;
+    ResultCache* cache = nullptr;
+};
+
+/// @brief Decode the input image of a pair, and its field of view mask if one is read from disk
+/// @param options Supplies the field of view source and the output format
+/// @param item Pair being processed, receives the decoded image and mask, or the error text on failure
+/// @param cache Looked up for the mask of the input bytes, if not `nullptr`
+/// @param profiler Receives the read time, if not `nullptr`
+/// @return `true` if the image was decoded, or its mask found in `cache`
+/// @note On a cache hit the image is only decoded when the composite needs it.
+bool read_image(Options const& options, WorkItem& item, ResultCache* cache, Profiler* profiler) {
+    ScopedTimer timer(profiler, Stage::read);
+    auto& result = item.result;
+    if (result.output_path.empty()) {
+        result.error = result.input_path + " has no output path";
+        return false;
+    }
+    MappedFile file(result.input_path);
+    if (!file.error().empty()) {
+        result.error = result.input_path + ": " + file.error();
+        return false;
+    }
+    std::string mask_path;
+    if (!options.fov.empty() && options.fov != "auto") {
+        auto const stem = std::filesystem::path(result.input_path).stem().string();
+        mask_path = (std::filesystem::path(options.fov) / (stem + "_mask.gif")).string();
+    }
+    if (cache) {
+        // the field of view file is part of the key, an edited mask must not hit
+        std::optional<MappedFile> mask_file;
+        std::span<unsigned char const> mask_bytes;
+        if (!mask_path.empty()) {
+            mask_file.emplace(mask_path);
+            mask_bytes = {mask_file->data(), mask_file->size()};
+        }
+        item.cache_key = cache->key({file.data(), file.size()}, mask_bytes);
+        item.output_img = cache->find(item.cache_key);
+        item.cached = !item.output_img.empty();
+        if (profiler) profiler->add(item.cached ? Counter::cache_hits : Counter::cache_misses);
+        if (item.cached && options.output_format != OutputFormat::composite) return true;
+    }
+    item.input_img = decode_mapped(file, result.input_path, cv::IMREAD_COLOR, result.error);
+    if (item.input_img.empty()) {
+        return false;
+    }
+    if (!mask_path.empty() && !item.cached) {
+        item.fov = read_mask(mask_path);
+        if (item.fov.size() != item.input_img.size()) {
+            result.error = mask_path + " missing, unreadable, or not the size of " + result.input_path;
+            return false;
+        }
+    }
+    return true;
 }
 
-cv::Mat plane(cv::Mat image, int index) {
-    std::vector<cv::Mat> planes;
-    cv::split(image, planes);
-    return planes[index];
+/// @brief Extract arteries from a decoded input image
+/// @param options Supplies the field of view source
+/// @param ex Performs artery extraction
+/// @param item Image as decoded by `read_image`, receives the binary mask of large arteries
+/// @param cache Receives the mask under the key `read_image` computed, if not `nullptr`
+void segment_image(Options const& options, ExtractArteries& ex, WorkItem& item, ResultCache* cache) {
+    if (item.cached) return;
+    if (options.fov == "auto") {
+        item.fov = ExtractArteries::detect_fov(item.input_img);
+    }
+    ex.extract(item.input_img, item.output_img, item.fov);
+    if (cache) cache->store(item.cache_key, item.output_img);
 }
 
+/// @brief Input and mask side by side, as written to the output file
+cv::Mat two_up(cv::Mat const& input_img, cv::Mat const& output_img) {
+    cv::Mat output_color;
+    cv::cvtColor(output_img, output_color, cv::COLOR_GRAY2RGB);
+    cv::Mat twoup;
+    cv::hconcat(input_img, output_color, twoup);
+    return twoup;
+}
 
-/////////////////////////
-// Does the segmentation
-struct ExtractArteries {
-    /// @brief Construct structuring elements and adaptive contrast enhancement data structures
-    /// @param show Whether to incrementally show image as it is processed
-    /// @note Based on [Contour Based Blood Vessel Segmentation in Retinal Fundus Images](https://github.com/sachinmb27/Contour-Based-Blood-Vessel-Segmentation-in-Retinal-Fundus-Images/blob/main/segmentation.py)
-    ExtractArteries(bool show)
-    :
-    show_{show}
-    {
-        
-        for (auto morph_size : std::vector<int>{2,5,11} ) {
-            auto sz = 2*morph_size + 1;
-            structuringElements_.push_back(
-                cv::getStructuringElement( 
-                    cv::MORPH_RECT, 
-                    cv::Size(sz,sz),
-                    cv::Point(morph_size,morph_size)
-                )
-            );
+/// @brief Encode a result in memory
+/// @param format `bits`, `rle`, or `rle_zstd`; `mask` and `composite` are encoded as PNG
+/// @param png Compression of `mask` and `composite`
+/// @param input_img Decoded input, only used by `composite`
+/// @param output_img Binary mask
+/// @param out Receives the encoded bytes
+/// @return `false` if the format is not available in this build or the encoder failed
+bool encode_result(OutputFormat format, PngSettings const& png, cv::Mat const& input_img, cv::Mat const& output_img, std::vector<unsigned char>& out) {
+    switch (format) {
+    case OutputFormat::mask:
+        return encode_png(output_img, true, png, out);
+    case OutputFormat::composite:
+        return encode_png(two_up(input_img, output_img), false, png, out);
+    case OutputFormat::bits:
+        encode_bits(output_img, out);
+        return true;
+    case OutputFormat::rle:
+    case OutputFormat::rle_zstd:
+        if (format == OutputFormat::rle_zstd && !zstd_available()) return false;
+        encode_rle(output_img, format == OutputFormat::rle_zstd, out);
+        return true;
+    }
+    return false;
+}
+
+/// @brief Store the result in the format chosen on the command line
+/// @param options Supplies the output format
+/// @param item Image as decoded by `read_image` and mask from `segment_image`; `success` is set when the file was written
+/// @param show Whether to show the mask on-screen
+/// @param container Receives the result under its output path instead of a file, if not `nullptr`
+/// @param profiler Receives the write time, if not `nullptr`
+/// @return `true` if the output file was written
+/// @note A 1-bit mask is a small fraction of the 2-up composite, and far cheaper to compress.
+bool write_image(Options const& options, WorkItem& item, bool show, ContainerWriter* container, Profiler* profiler) {
+    if (show) show_image(item.output_img, "output_path");
+    ScopedTimer timer(profiler, Stage::write);
+    auto& result = item.result;
+    bool written = false;
+    // images go to the codec their extension picks, except PNG, which honours --png-level and --png-filter
+    auto extension = std::filesystem::path(result.output_path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    bool const by_extension = extension != ".png"
+        && (options.output_format == OutputFormat::mask || options.output_format == OutputFormat::composite);
+    if (container) {
+        std::vector<unsigned char> encoded;
+        written = encode_result(options.output_format, options.png, item.input_img, item.output_img, encoded)
+            && container->append(result.output_path, options.output_format, encoded);
+    } else if (by_extension && options.output_format == OutputFormat::mask) {
+        written = cv::imwrite(result.output_path, item.output_img, {cv::IMWRITE_PNG_BILEVEL, 1});
+    } else if (by_extension) {
+        written = cv::imwrite(result.output_path, two_up(item.input_img, item.output_img));
+    } else {
+        std::vector<unsigned char> encoded;
+        if (encode_result(options.output_format, options.png, item.input_img, item.output_img, encoded)) {
+            std::ofstream file(result.output_path, std::ios::binary);
+            written = file.write(reinterpret_cast<char const*>(encoded.data()), encoded.size()).good();
         }
+    }
+    if (!written) {
+        result.error = "Failed to write " + result.output_path;
+        return false;
+    }
+    result.success = true;
+    return true;
+}
+
+/// @brief Apply the command line to an extractor
+/// @param options Supplies the stage options, and `show` to display intermediates
+/// @param ex Extractor to configure
+/// @param profiler Receives per-stage times, if not `nullptr`
+void configure(Options const& options, ExtractArteries& ex, Profiler* profiler) {
+    if (options.contains(Flag::show)) {
+        ex.set_observer([](std::string const& stage, cv::Mat const& image) { show_image(image, stage); });
+    }
+    ex.set_luminance(options.luminance);
+    ex.set_tile_size(options.tile_size);
+    ex.set_pyramid(options.pyramid);
+    ex.set_micro_batch(options.micro_batch);
+    ex.set_kernels(options.kernels);
+    ex.set_backend(options.backend);
+    ex.set_profiler(profiler);
+}
+
+/// @brief Extract arteries from an input band by band, see `ExtractArteries::extract_stream()`
+/// @param options Supplies the band height, spill directory, and output format, `mask` or `bits`
+/// @param ex Performs artery extraction
+/// @param pair Input image path on disk and output path on disk where to store the mask
+/// @param result Receives the reason on failure
+/// @return `true` if the mask was written
+bool stream_image(Options const& options, ExtractArteries& ex, PathPair const& pair, PairResult& result) {
+    std::string error;
+    auto source = open_row_source(pair.first, options.band_rows, error);
+    if (!source) {
+        result.error = error;
+        return false;
+    }
+    std::unique_ptr<RowSink> sink;
+    if (options.output_format == OutputFormat::bits) {
+        sink = std::make_unique<PbmRowSink>(pair.second, source->size());
+    } else {
+#ifdef VESSEL_HAVE_PNG
+        sink = std::make_unique<PngRowSink>(pair.second, source->size(), options.png);
+#endif
+    }
+    if (!sink) {
+        result.error = "--stream writes PNG masks only in a build with libpng; use --output bits";
+        return false;
+    }
+    if (!sink->error().empty()) {
+        result.error = sink->error();
+        return false;
+    }
+    error = ex.extract_stream(*source, *sink, StreamConfig{options.band_rows, options.spill_dir});
+    if (!error.empty()) {
+        result.error = pair.first + ": " + error;
+        // a partial mask is not a result
+        std::error_code ec;
+        std::filesystem::remove(pair.second, ec);
+        return false;
+    }
+    result.success = true;
+    return true;
+}
 
-        clahe_ = cv::createCLAHE();
-        clahe_->setClipLimit(3);
-    }
-
-    bool show() const { return show_; }
-
-    /// @brief Perform adaptive contrast enhancement
-    /// @param image Source for contrast enhancement
-    /// @param channel_index Optional channel index for multi-channel images
-    /// @return Contrast enhanced image
-    cv::Mat clahe(cv::Mat image, int channel_index = 0) {
-        cv::Mat result;
-        cv::Mat channel;
-        cv::extractChannel(image, channel, channel_index);
-        clahe_->apply(channel, result);
-        return result;
-    }
-
-    /// @brief Perform contrast enhancement on luminance
-    /// @param test_image Source for filtering
-    /// @return Contrast-enhanced luminance image
-    cv::Mat color_filter(cv::Mat test_image) {
-        cv::Mat lab;
-        cv::cvtColor(test_image, lab, cv::COLOR_BGR2Lab);
-        auto luminance = plane(lab,0);
-        cv::Mat equalized;
-        clahe_->apply(luminance, equalized);
-        cv::Mat result;
-        cv::merge(std::vector<cv::Mat>{equalized, equalized, equalized}, result);
-        return result;
-    }
-
-    /// @brief Morphological opening
-    /// @param image Source for morpho operation
-    /// @param se Structuring element
-    /// @param iterations How many times to perform operation
-    /// @return Opening result
-    cv::Mat erosion(cv::Mat image, cv::Mat se, int iterations = 1) {
-        cv::Mat result;
-        cv::morphologyEx(image, result, cv::MORPH_OPEN, se, cv::Point(-1,-1), iterations);
-        return result;
-    }
-
-    /// @brief Morphological closing
-    /// @param image Source for morpho operation
-    /// @param se Structing element
-    /// @param iterations How many time to perform operation
-    /// @return Closing result
-    cv::Mat dilation(cv::Mat image, cv::Mat se, int iterations = 1) {
-        cv::Mat result;
-        cv::morphologyEx(image, result, cv::MORPH_CLOSE, se, cv::Point(-1,-1), iterations);
-        return result;
-    }
-
-    /// @brief Extract the large arteries 
-    /// @param test_image Source for extraction
-    /// @return Grayscale image with everything other than larger arteries suppressed
-    /// @note "Large arteries" is a relative
-    cv::Mat large_arteries(cv::Mat test_image) {
-        cv::Mat close;
-        cv::Mat open;
-        test_image.copyTo(close);
-
-        for (auto const& se : structuringElements_) {
-            open = erosion(close, se);
-            close = dilation(open, se);
+/// @brief Read image, extract arteries, and store resulting image to file
+/// @param options Supplies the field of view source
+/// @param ex Performs artery extraction
+/// @param pair Input image path on disk and output path on disk where to store image
+/// @param stores Container and cache to use, if any
+/// @param profiler Receives read and write times, if not `nullptr`
+/// @return Result holding `success` and, on failure, the reason in `error`
+PairResult process_image(
+    Options const& options,
+    ExtractArteries& ex, 
+    PathPair const& pair,
+    Stores const& stores,
+    Profiler* profiler
+    ) 
+{
+    WorkItem item{PairResult{pair.first, pair.second, false, ""}};
+    if (options.contains(Flag::stream)) {
+        guarded(item.result, [&]() { return stream_image(options, ex, pair, item.result); });
+        return item.result;
+    }
+    guarded(item.result, [&]() {
+        if (!read_image(options, item, stores.cache, profiler)) return false;
+        segment_image(options, ex, item, stores.cache);
+        return write_image(options, item, options.contains(Flag::show), stores.container, profiler);
+    });
+    return item.result;
+}
+
+
+/// @brief Per-thread `Profiler` merged into a shared one when the thread is done, and feeding live metrics
+/// @note Stages record without locking; only the final merge is serialized. Without a shared profiler the
+///       samples only go to `metrics` and are not kept.
+class WorkerProfile {
+public:
+    WorkerProfile(Profiler* shared, Metrics* metrics, std::mutex& mutex) : shared_{shared}, metrics_{metrics}, mutex_{mutex} {
+        local_.forward_to(metrics, shared != nullptr);
+    }
+    ~WorkerProfile() {
+        if (shared_) {
+            std::lock_guard lock(mutex_);
+            shared_->merge(local_);
         }
+    }
 
-        cv::Mat background_removed;
-        cv::subtract(close, test_image, background_removed);
-        return clahe(background_removed);
-    }
-
-    /// @brief Set everything below the image mean to black
-    /// @param image Source for threshold
-    /// @return Binary image with thresholding results
-    cv::Mat threshold(cv::Mat image) {
-        cv::Mat result;
-        auto mean = cv::mean(image);
-        cv::Mat threshold_img;
-        cv::threshold(image, threshold_img, mean[0], 255, cv::THRESH_BINARY | cv::THRESH_OTSU) ;
-        return threshold_img;
-    }
-
-    /// @brief Remove blobs from image based on size
-    /// @param binary_image Source for suppression
-    /// @return Binary image with blobs suppressed
-    cv::Mat remove_blobs(cv::Mat binary_image) {
-        cv::Mat result;
-        binary_image.copyTo(result);
-
-        std::vector< cv::Mat > contours;
-        cv::findContours( binary_image, contours, cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE);
-        double const min_valid_area = 25.0;
-        for (auto const& cnt : contours) {
-            auto area = cv::contourArea(cnt);
-            if (area < min_valid_area) {
-                cv::drawContours(result, cnt, -1, cv::Scalar(0), -1);
-            }
+    /// @brief Profiler for this thread, `nullptr` when neither profiling nor metrics are on
+    Profiler* get() { return (shared_ || metrics_) ? &local_ : nullptr; }
+
+private:
+    Profiler* shared_;
+    Metrics* metrics_;
+    std::mutex& mutex_;
+    Profiler local_;
+};
+
+
+/// @brief Process all input/output pairs on a pool of `jobs` workers
+/// @param options Supplies `show` and the number of workers
+/// @param pairs Input and output paths, pulled by the workers as they become idle
+/// @param log Receives the result of every pair
+/// @param stores Container and cache to use, if any
+/// @param profiler Receives the stage timings of all workers, if not `nullptr`
+/// @param metrics Receives the stage timings and counts as they are recorded, if not `nullptr`
+/// @note With `--pin`, worker `i` is bound to `CpuTopology::place(i)`.
+void process_batch(Options const& options, PairSource& pairs, ResultLog& log, Stores const& stores, Profiler* profiler, Metrics* metrics) {
+    std::mutex profiler_mutex;
+
+    CpuTopology const topology;
+    // Each worker owns its ExtractArteries; the CLAHE instance inside keeps per-call state.
+    auto worker = [&](int index) {
+        // bound before the extractor exists, so its buffers are first touched on the worker's node
+        if (options.contains(Flag::pin)) pin_current_thread(topology.place(index));
+        WorkerProfile profile(profiler, metrics, profiler_mutex);
+        ExtractArteries ex;
+        configure(options, ex, profile.get());
+        while (auto pair = pairs.next()) {
+            log.report( process_image(options, ex, *pair, stores, profile.get()) );
+        }
+        if (profile.get()) profile.get()->add(Counter::buffer_allocations, ex.allocations());
+    };
+
+    if (options.jobs <= 1) {
+        worker(0);
+    } else {
+        std::vector<std::jthread> workers;
+        for (int i=0; i<options.jobs; i++) {
+            workers.emplace_back(worker, i);
         }
-        return result;
     }
+}
 
 
-    /// @brief Primary interface to extract arteries from image
-    /// @param test_image BGR source image
-    /// @return Binary image with mask of large arteries
-    cv::Mat extract(cv::Mat test_image) {
-        auto large_arteries_img = large_arteries( color_filter(test_image) );
-        if (show()) show_image(large_arteries_img, "extract(): large_arteries_img");
-        cv::Mat median_img;
-        cv::medianBlur(large_arteries_img, median_img, 3);
+/// @brief Process all pairs as a reader -> extract -> writer pipeline
+/// @param options Supplies the number of extract workers and the queue depth
+/// @param pairs Input and output paths, pulled by the reader
+/// @param log Receives the result of every pair
+/// @param stores Container and cache to use, if any
+/// @param profiler Receives the stage timings of all threads, if not `nullptr`
+/// @param metrics Receives the stage timings and counts as they are recorded, and the queue depths, if not `nullptr`
+/// @note Decode and encode overlap with segmentation, each on `io_threads` threads of their own, so
+///       slow codecs do not take cores from the extract workers. Bounded queues apply backpressure,
+///       so at most `2*queue_depth + jobs + 2*io_threads` images are held in memory at any time.
+///       With `--pin` the extract workers are bound as in `process_batch()`; decode and encode threads are
+///       left to the scheduler, since an image crosses from one thread to the next anyway.
+void process_pipeline(Options const& options, PairSource& pairs, ResultLog& log, Stores const& stores, Profiler* profiler, Metrics* metrics) {
+    BoundedQueue<WorkItem> decoded(options.queue_depth);
+    BoundedQueue<WorkItem> segmented(options.queue_depth);
+    std::mutex profiler_mutex;
+    std::vector<Metrics::Gauge> gauges;
+    if (metrics) {
+        gauges.push_back(metrics->gauge("vessel_queue_depth{queue=\"decoded\"}", "Items waiting in a queue",
+            [&decoded]() { return double(decoded.size()); }));
+        gauges.push_back(metrics->gauge("vessel_queue_depth{queue=\"segmented\"}", "Items waiting in a queue",
+            [&segmented]() { return double(segmented.size()); }));
+    }
 
-        auto threshold_img = threshold(median_img);
-        if (show()) show_image(threshold_img, "extract(): threshold");
-        auto cleaned_img = remove_blobs( threshold_img );
-        if (show()) show_image(cleaned_img, "extract(): cleaned");
-        cv::medianBlur(cleaned_img, median_img, 3);
-        return median_img;
+    std::vector<std::jthread> writers;
+    for (int i=0; i<options.io_threads; i++) {
+        writers.emplace_back([&]() {
+            WorkerProfile profile(profiler, metrics, profiler_mutex);
+            while (auto item = segmented.pop()) {
+                guarded(item->result, [&]() { return write_image(options, *item, false, stores.container, profile.get()); });
+                log.report(item->result);
+            }
+        });
     }
 
+    CpuTopology const topology;
+    std::atomic<int> active_extractors{options.jobs};
+    std::vector<std::jthread> extractors;
+    for (int i=0; i<options.jobs; i++) {
+        extractors.emplace_back([&, i]() {
+            if (options.contains(Flag::pin)) pin_current_thread(topology.place(i));
+            WorkerProfile profile(profiler, metrics, profiler_mutex);
+            ExtractArteries ex;
+            configure(options, ex, profile.get());
+            while (auto item = decoded.pop()) {
+                if (guarded(item->result, [&]() { segment_image(options, ex, *item, stores.cache); return true; })) {
+                    segmented.push( std::move(*item) );
+                } else {
+                    log.report(item->result);
+                }
+            }
+            if (profile.get()) profile.get()->add(Counter::buffer_allocations, ex.allocations());
+            if (--active_extractors == 0) segmented.close();
+        });
+    }
 
-protected:
-    bool show_;
-    std::vector< cv::Mat > structuringElements_;
-    cv::Ptr<cv::CLAHE> clahe_;
+    // readers pull pairs directly, the source hands each one to a single reader
+    std::vector<std::jthread> readers;
+    for (int i=0; i<options.io_threads; i++) {
+        readers.emplace_back([&]() {
+            WorkerProfile profile(profiler, metrics, profiler_mutex);
+            while (auto pair = pairs.next()) {
+                WorkItem item{PairResult{pair->first, pair->second, false, ""}};
+                if (guarded(item.result, [&]() { return read_image(options, item, stores.cache, profile.get()); })) {
+                    decoded.push( std::move(item) );
+                } else {
+                    log.report(item.result);
+                }
+            }
+        });
+    }
+    readers.clear();
+    decoded.close();
 
-};
+    extractors.clear();
+    writers.clear();
+}
 
 
+/// @brief Output format a server request asks for
+OutputFormat reply_format(ReplyKind kind) {
+    switch (kind) {
+    case ReplyKind::mask: return OutputFormat::mask;
+    case ReplyKind::composite: return OutputFormat::composite;
+    case ReplyKind::bits: return OutputFormat::bits;
+    case ReplyKind::rle: return OutputFormat::rle;
+    case ReplyKind::rle_zstd: return OutputFormat::rle_zstd;
+    }
+    return OutputFormat::mask;
+}
 
-enum class Flag { show, help};
+/// @brief Decode, segment, and encode a batch of requests
+/// @param options Supplies the field of view source
+/// @param ex Performs artery extraction
+/// @param batch Requests taken together from the server queue; each receives its reply
+/// @param log Receives the result of every request
+/// @param profiler Receives read, extract, and write times, if not `nullptr`
+void serve_batch(Options const& options, ExtractArteries& ex, std::vector<Request>& batch, ResultLog& log, Profiler* profiler) {
+    std::vector<cv::Mat> images, fovs, masks;
+    std::vector<Request*> decoded;
+    {
+        ScopedTimer timer(profiler, Stage::read);
+        for (auto& request : batch) {
+            cv::Mat image;
+            try {
+                image = decode_image(request.payload.data(), request.payload.size(), cv::IMREAD_COLOR);
+            } catch (std::exception const&) {
+                // reported below like any other undecodable payload
+            }
+            if (image.empty()) {
+                request.fail("request " + std::to_string(request.id) + " could not be decoded");
+                continue;
+            }
+            images.push_back(image);
+            if (options.fov == "auto") fovs.push_back(ExtractArteries::detect_fov(image));
+            decoded.push_back(&request);
+        }
+    }
 
-using Options = std::set<Flag>;
+    masks.resize(images.size());
+    try {
+        ex.extract_batch(images, masks, fovs);
+    } catch (std::exception const& e) {
+        for (auto* request : decoded) request->fail(e.what());
+        decoded.clear();
+    }
 
+    ScopedTimer timer(profiler, Stage::write);
+    for (size_t i = 0; i < decoded.size(); i++) {
+        auto& request = *decoded[i];
+        if (!encode_result(reply_format(request.kind), options.png, images[i], masks[i], request.reply)) {
+            request.fail("request " + std::to_string(request.id) + " could not be encoded");
+        }
+    }
+    for (auto& request : batch) {
+        request.respond();
+        bool const ok = request.status == ReplyStatus::ok;
+        log.report(PairResult{"request " + std::to_string(request.id), "", ok,
+            ok ? "" : std::string(request.reply.begin(), request.reply.end())});
+    }
+}
 
-/// @brief Output help text
-/// @param program_name Included in output
-/// @param error_msg Optional message to include in output to STDERR
-void help(std::string const& program_name, std::string error_msg = "") {
-    std::cout << program_name << " [-h] [-s] [<input_img> <output_img>]*" << std::endl;
-    std::cout << "\t-h : print help\n";
-    std::cout << "\t-s : show images. Press 'q', SPACE, or ESC to close window.\n";
-    std::cout << "\t<input_img> input image that is read and processed.\n";
-    std::cout << "\t<output_img> path where output image is written\n";
-    if (error_msg.size()) {
-        std::cerr << error_msg << std::endl;
+
+/// @brief Answer requests on STDIN/STDOUT or a Unix socket with `jobs` warm workers
+/// @param options Supplies the endpoint, the number of workers, the queue depth, and the batch size
+/// @param log Receives the result of every request
+/// @param profiler Receives the stage timings of all workers, if not `nullptr`
+/// @param metrics Receives the stage timings and counts as they are recorded, the queue depth, and the busy
+///        workers, if not `nullptr`
+/// @return Empty on a clean shutdown, otherwise the reason the endpoint could not be served
+/// @note Each worker keeps its `ExtractArteries`, and so the structuring elements, CLAHE, and every
+///       scratch buffer, from one request to the next; a request only pays for decode, segment, and encode.
+std::string process_server(Options const& options, ResultLog& log, Profiler* profiler, Metrics* metrics) {
+    FrameServer server(options.queue_depth);
+    std::mutex profiler_mutex;
+    std::atomic<int> busy{0};
+    std::vector<Metrics::Gauge> gauges;
+    if (metrics) {
+        gauges.push_back(metrics->gauge("vessel_queue_depth{queue=\"requests\"}", "Items waiting in a queue",
+            [&server]() { return double(server.queued()); }));
+        gauges.push_back(metrics->gauge("vessel_busy_workers", "Workers segmenting a batch of requests now",
+            [&busy]() { return double(busy.load()); }));
+    }
+
+    std::vector<std::jthread> workers;
+    for (int i=0; i<options.jobs; i++) {
+        workers.emplace_back([&]() {
+            WorkerProfile profile(profiler, metrics, profiler_mutex);
+            ExtractArteries ex;
+            configure(options, ex, profile.get());
+            std::vector<Request> batch;
+            while (server.next_batch(options.max_batch, batch)) {
+                busy++;
+                serve_batch(options, ex, batch, log, profile.get());
+                busy--;
+            }
+            if (profile.get()) profile.get()->add(Counter::buffer_allocations, ex.allocations());
+        });
+    }
+
+    std::string error;
+    if (options.serve == "-") {
+        server.serve_stdio();
+    } else {
+        error = server.serve_socket(options.serve);
     }
+    workers.clear();
+    return error;
 }
 
-/// @brief Read image, extract arteries, and store resulting image to file
-/// @param program_name Used in error text
-/// @param ex Performs artery extraction
-/// @param input_path Input image path on disk
-/// @param output_put Output path on disk where to store image
-/// @return bool `true` if succeeded in processing, `false` otherwise
-bool process_image(
-    std::string const& program_name, 
-    ExtractArteries& ex, 
-    std::string const& input_path, 
-    std::string const& output_path
-    ) 
-{
-    bool success = true;
-    if (!std::filesystem::exists(input_path)) {
-        std::ostringstream oss;
-        oss << input_path << " input does not exist";
-        help(program_name, oss.str());
-        success = false;
+
+/// @brief Segment the frames of a video into a video of masks, reusing estimates while the scene holds still
+/// @param options Supplies the source, the output video and its codec, the output format, and the reuse settings
+/// @param log Receives the result of every frame
+/// @param shared Receives stage timings and the count of frames that reused the estimates, if not `nullptr`
+/// @param metrics Receives the same as they are recorded, if not `nullptr`
+/// @return Empty if the source and the output could be opened, otherwise the reason they could not
+/// @note Frames depend on the estimates of those before them, so they run in order on one extractor.
+std::string process_video(Options const& options, ResultLog& log, Profiler* shared, Metrics* metrics) {
+    cv::VideoCapture capture;
+    bool const camera = !options.video.empty() && std::all_of(options.video.begin(), options.video.end(),
+        [](unsigned char c) { return std::isdigit(c); });
+    if (camera) {
+        int index = 0;
+        auto const [ptr, ec] = std::from_chars(options.video.data(), options.video.data() + options.video.size(), index);
+        if (ec != std::errc()) return options.video + ": camera index out of range";
+        capture.open(index);
     } else {
-        auto input_img = cv::imread(input_path);
-        cv::Mat bgr_img;
-        cv::cvtColor(input_img, bgr_img, cv::COLOR_RGB2BGR);
-        auto output_img = ex.extract(bgr_img);
-        // create 2-up composite to show result
-        cv::Mat output_color;
-        cv::cvtColor(output_img, output_color, cv::COLOR_GRAY2RGB);
-        cv::Mat twoup;
-        cv::hconcat(input_img, output_color, twoup);
-        if (ex.show()) show_image(output_img, "output_path");
-        cv::imwrite(output_path, twoup);
-        if (!std::filesystem::exists(output_path)) {
-            std::ostringstream oss;
-            std::cerr << "Error: Failed to write " << output_path;
-            success = false;
+        capture.open(options.video);
+    }
+    if (!capture.isOpened()) return options.video + ": cannot open video source";
+    double fps = capture.get(cv::CAP_PROP_FPS);
+    if (!(fps > 0)) fps = 30;
+
+    std::mutex profiler_mutex;
+    WorkerProfile profile(shared, metrics, profiler_mutex);
+    auto* profiler = profile.get();
+    ExtractArteries ex;
+    configure(options, ex, profiler);
+    SequenceState state;
+    state.max_change = options.reuse_threshold;
+    state.refresh_interval = options.refresh;
+    bool const composite = options.output_format == OutputFormat::composite;
+    auto const& code = options.fourcc;
+    cv::VideoWriter writer;
+    std::string error;
+    cv::Mat frame, mask;
+    for (size_t index = 0; ; index++) {
+        {
+            ScopedTimer timer(profiler, Stage::read);
+            if (!capture.read(frame) || frame.empty()) break;
         }
+        PairResult result{options.video + " frame " + std::to_string(index), options.video_output, false, ""};
+        guarded(result, [&]() {
+            bool const refreshed = ex.extract_frame(frame, mask, state);
+            if (!refreshed && profiler) profiler->add(Counter::reused_frames);
+            if (options.contains(Flag::show)) show_image(mask, "output_path");
+            ScopedTimer timer(profiler, Stage::write);
+            cv::Mat const out = composite ? two_up(frame, mask) : mask;
+            if (!writer.isOpened() && !writer.open(options.video_output,
+                    cv::VideoWriter::fourcc(code[0], code[1], code[2], code[3]), fps, out.size(), composite)) {
+                error = options.video_output + ": cannot open for writing with codec " + code;
+                return false;
+            }
+            writer.write(out);
+            result.success = true;
+            return true;
+        });
+        // every later frame would fail the same way
+        if (!error.empty()) return error;
+        log.report(result);
+    }
+    return {};
+}
+
+
+/// @brief Parse a numeric command line value
+/// @param program_name Used in error text
+/// @param flag Flag the value belongs to, used in error text
+/// @param value Text to parse
+/// @param minimum Smallest accepted value
+/// @param count Receives the parsed value
+/// @return `true` if `value` is an integer not less than `minimum`
+bool parse_count(std::string const& program_name, std::string const& flag, std::string const& value, int minimum, int& count) {
+    auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), count);
+    if (ec != std::errc() || ptr != value.data() + value.size() || count < minimum) {
+        help(program_name, flag + " expects a number of at least " + std::to_string(minimum) + ", got '" + value + "'");
+        return false;
     }
-    return success;
+    return true;
 }
 
 
@@ -265,19 +836,216 @@ std::tuple< Options, std::vector<std::string>, int, std::string> parse_args(int
 
     std::string program_name(argv[0]);
     std::vector<std::string> image_files;
+    // --png-level fast picks a filter too, unless --png-filter is given in any position
+    bool png_fast = false;
+    std::optional<PngFilter> png_filter;
 
-    std::vector< std::pair< std::string, std::string > > input_output;
     for (int i=1; i<argc; i++) {
         std::string arg( argv[i] );
         if ( arg == "-h") {
             options.insert(Flag::help);
         } else if ( arg == "-s" ) {
             options.insert(Flag::show);
+        } else if ( arg == "-j" ) {
+            if (!parse_count(program_name, "-j", (i+1 < argc) ? argv[++i] : "", 0, options.jobs)) result = -1;
+        } else if ( arg == "-p" ) {
+            options.insert(Flag::pipeline);
+        } else if ( arg == "--pin" ) {
+            options.insert(Flag::pin);
+        } else if ( arg == "--stream" ) {
+            options.insert(Flag::stream);
+        } else if ( arg == "--band" ) {
+            if (!parse_count(program_name, "--band", (i+1 < argc) ? argv[++i] : "", 1, options.band_rows)) result = -1;
+        } else if ( arg == "--spill-dir" ) {
+            options.spill_dir = (i+1 < argc) ? argv[++i] : "";
+            if (!std::filesystem::is_directory(options.spill_dir)) {
+                help(program_name, "--spill-dir expects a directory, got '" + options.spill_dir + "'");
+                result = -1;
+            }
+        } else if ( arg == "--inner-threads" ) {
+            if (!parse_count(program_name, "--inner-threads", (i+1 < argc) ? argv[++i] : "", 1, options.inner_threads)) result = -1;
+        } else if ( arg == "-q" ) {
+            if (!parse_count(program_name, "-q", (i+1 < argc) ? argv[++i] : "", 1, options.queue_depth)) result = -1;
+        } else if ( arg == "--profile" || arg == "--profile=table" ) {
+            options.profile = ProfileFormat::table;
+        } else if ( arg == "--profile=json" ) {
+            options.profile = ProfileFormat::json;
+        } else if ( arg == "--fov" ) {
+            options.fov = (i+1 < argc) ? argv[++i] : "";
+            if (options.fov != "auto" && !std::filesystem::is_directory(options.fov)) {
+                help(program_name, "--fov expects 'auto' or a mask directory, got '" + options.fov + "'");
+                result = -1;
+            }
+        } else if ( arg == "--backend" ) {
+            std::string const name = (i+1 < argc) ? argv[++i] : "";
+            if (name == "cpu") options.backend = Backend::cpu;
+            else if (name == "opencl") options.backend = Backend::opencl;
+            else if (name == "cuda") options.backend = Backend::cuda;
+            else {
+                help(program_name, "--backend expects cpu, opencl, or cuda, got '" + name + "'");
+                result = -1;
+            }
+            if (result == 0 && !backend_available(options.backend)) {
+                help(program_name, std::string("--backend ") + backend_name(options.backend) + " has no usable device in this build or on this host");
+                result = -1;
+            }
+        } else if ( arg == "--luminance" ) {
+            std::string const name = (i+1 < argc) ? argv[++i] : "";
+            if (name == "lab") options.luminance = Luminance::lab;
+            else if (name == "green") options.luminance = Luminance::green;
+            else {
+                help(program_name, "--luminance expects lab or green, got '" + name + "'");
+                result = -1;
+            }
+        } else if ( arg == "--tile" ) {
+            if (!parse_count(program_name, "--tile", (i+1 < argc) ? argv[++i] : "", 0, options.tile_size)) result = -1;
+        } else if ( arg == "--autotune" ) {
+            options.autotune = (i+1 < argc) ? argv[++i] : "";
+            if (options.autotune.empty()) {
+                help(program_name, "--autotune expects a sample image");
+                result = -1;
+            }
+        } else if ( arg == "--autotune-file" ) {
+            options.autotune_file = (i+1 < argc) ? argv[++i] : "";
+        } else if ( arg == "--pyramid" ) {
+            if (!parse_count(program_name, "--pyramid", (i+1 < argc) ? argv[++i] : "", 1, options.pyramid)) {
+                result = -1;
+            } else if (options.pyramid != 1 && options.pyramid != 2 && options.pyramid != 4) {
+                help(program_name, "--pyramid expects 2 or 4, got " + std::to_string(options.pyramid));
+                result = -1;
+            }
+        } else if ( arg == "--manifest" ) {
+            options.manifest = (i+1 < argc) ? argv[++i] : "";
+        } else if ( arg == "--input-dir" ) {
+            options.input_dir = (i+1 < argc) ? argv[++i] : "";
+        } else if ( arg == "--output-dir" ) {
+            options.output_dir = (i+1 < argc) ? argv[++i] : "";
+        } else if ( arg == "--output" ) {
+            std::string const name = (i+1 < argc) ? argv[++i] : "";
+            if (name == "mask") options.output_format = OutputFormat::mask;
+            else if (name == "bits") options.output_format = OutputFormat::bits;
+            else if (name == "rle") options.output_format = OutputFormat::rle;
+            else if (name == "rle-zstd") options.output_format = OutputFormat::rle_zstd;
+            else if (name == "composite") options.output_format = OutputFormat::composite;
+            else {
+                help(program_name, "--output expects mask, bits, rle, rle-zstd, or composite, got '" + name + "'");
+                result = -1;
+            }
+            if (options.output_format == OutputFormat::rle_zstd && !zstd_available()) {
+                help(program_name, "--output rle-zstd needs a build with libzstd");
+                result = -1;
+            }
+        } else if ( arg == "--png-level" ) {
+            std::string const value = (i+1 < argc) ? argv[++i] : "";
+            if (value == "fast") {
+                png_fast = true;
+            } else if (parse_count(program_name, "--png-level", value, 0, options.png.level) && options.png.level <= 9) {
+                // like cv::imwrite, an explicit level uses zlib's default matching
+                options.png.rle = false;
+            } else {
+                if (options.png.level > 9) help(program_name, "--png-level expects 0 to 9 or fast, got '" + value + "'");
+                result = -1;
+            }
+        } else if ( arg == "--png-filter" ) {
+            std::string const name = (i+1 < argc) ? argv[++i] : "";
+            static char const* const names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+            auto const it = std::find(std::begin(names), std::end(names), name);
+            if (it == std::end(names)) {
+                help(program_name, "--png-filter expects none, sub, up, average, paeth, or adaptive, got '" + name + "'");
+                result = -1;
+            } else {
+                png_filter = static_cast<PngFilter>(it - std::begin(names));
+            }
+        } else if ( arg == "--io-threads" ) {
+            if (!parse_count(program_name, "--io-threads", (i+1 < argc) ? argv[++i] : "", 1, options.io_threads)) result = -1;
+        } else if ( arg == "--container" ) {
+            options.container = (i+1 < argc) ? argv[++i] : "";
+        } else if ( arg == "--cache" ) {
+            options.cache = (i+1 < argc) ? argv[++i] : "";
+        } else if ( arg == "--cache-size" ) {
+            if (!parse_count(program_name, "--cache-size", (i+1 < argc) ? argv[++i] : "", 1, options.cache_size)) result = -1;
+        } else if ( arg == "--serve" ) {
+            options.serve = (i+1 < argc) ? argv[++i] : "";
+            if (options.serve.empty()) {
+                help(program_name, "--serve expects '-' or a socket path");
+                result = -1;
+            }
+        } else if ( arg == "--batch" ) {
+            if (!parse_count(program_name, "--batch", (i+1 < argc) ? argv[++i] : "", 1, options.max_batch)) result = -1;
+        } else if ( arg == "--video" ) {
+            options.video = (i+1 < argc) ? argv[++i] : "";
+            options.video_output = (i+1 < argc) ? argv[++i] : "";
+            if (options.video_output.empty()) {
+                help(program_name, "--video expects a source and an output video");
+                result = -1;
+            }
+        } else if ( arg == "--fourcc" ) {
+            options.fourcc = (i+1 < argc) ? argv[++i] : "";
+            if (options.fourcc.size() != 4) {
+                help(program_name, "--fourcc expects four characters, got '" + options.fourcc + "'");
+                result = -1;
+            }
+        } else if ( arg == "--reuse-threshold" ) {
+            std::string const value = (i+1 < argc) ? argv[++i] : "";
+            auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), options.reuse_threshold);
+            if (ec != std::errc() || ptr != value.data() + value.size() || options.reuse_threshold < 0) {
+                help(program_name, "--reuse-threshold expects a non-negative number of gray levels, got '" + value + "'");
+                result = -1;
+            }
+        } else if ( arg == "--refresh" ) {
+            if (!parse_count(program_name, "--refresh", (i+1 < argc) ? argv[++i] : "", 1, options.refresh)) result = -1;
+        } else if ( arg == "--micro-batch" ) {
+            if (!parse_count(program_name, "--micro-batch", (i+1 < argc) ? argv[++i] : "", 1, options.micro_batch)) result = -1;
+        } else if ( arg == "--metrics-listen" ) {
+            options.metrics_listen = (i+1 < argc) ? argv[++i] : "";
+            if (options.metrics_listen.empty()) {
+                help(program_name, "--metrics-listen expects [<host>:]<port>");
+                result = -1;
+            }
+        } else if ( arg == "--metrics-file" ) {
+            options.metrics_file = (i+1 < argc) ? argv[++i] : "";
+            if (options.metrics_file.empty()) {
+                help(program_name, "--metrics-file expects a file");
+                result = -1;
+            }
+        } else if ( arg == "--log-format" ) {
+            std::string const name = (i+1 < argc) ? argv[++i] : "";
+            if (name == "text") options.log_format = LogFormat::text;
+            else if (name == "json") options.log_format = LogFormat::json;
+            else {
+                help(program_name, "--log-format expects text or json, got '" + name + "'");
+                result = -1;
+            }
+        } else if ( arg == "--name" ) {
+            options.name_template = (i+1 < argc) ? argv[++i] : "";
         } else {
             image_files.push_back( arg );
         }
     }
 
+    CpuTopology const topology;
+    if (options.jobs == 0) {
+        options.jobs = topology.cpu_count();
+    }
+    if (options.inner_threads == 0) {
+        // each worker's share of the cores; one worker per core leaves OpenCV single-threaded
+        options.inner_threads = std::max(1, topology.cpu_count() / options.jobs);
+    }
+    if (png_fast) options.png = PngSettings::fast();
+    if (png_filter) options.png.filter = *png_filter;
+    // without libpng a level makes cv::imencode search the filters, as cv::imwrite does
+    if (!png_filter && !png_fast && !options.png.encodable()) options.png.filter = PngFilter::adaptive;
+    if (!options.png.encodable()) {
+        help(program_name, "--png-filter other than adaptive, or sub at the default level, needs a build with libpng");
+        result = -1;
+    }
+    if (options.contains(Flag::show) && (options.jobs > 1 || options.contains(Flag::pipeline))) {
+        // HighGUI windows must be driven from a single thread
+        std::cerr << "-s given, processing pairs one at a time" << std::endl;
+        options.jobs = 1;
+        options.flags.erase(Flag::pipeline);
+    }
+
     if (image_files.size() % 2 == 1) {
         std::ostringstream oss;
         oss << "Wrong number of arguments, argc=" << argc; 
@@ -285,10 +1053,82 @@ std::tuple< Options, std::vector<std::string>, int, std::string> parse_args(int
         result = -1;
     } 
 
+    int const sources = !image_files.empty() + !options.manifest.empty() + !options.input_dir.empty() + !options.serve.empty()
+        + !options.video.empty();
+    if (sources > 1) {
+        help(program_name, "Give image pairs, --manifest, --input-dir, --serve, or --video, not more than one");
+        result = -1;
+    } else if (!options.video.empty() && (options.contains(Flag::pipeline) || !options.fov.empty()
+            || !options.container.empty() || !options.cache.empty() || options.backend != Backend::cpu)) {
+        help(program_name, "--video runs frames in order on the CPU; it cannot be combined with -p, --fov, --container, --cache, or --backend");
+        result = -1;
+    } else if (!options.video.empty() && options.output_format != OutputFormat::mask && options.output_format != OutputFormat::composite) {
+        help(program_name, "--video writes masks or composites only");
+        result = -1;
+    } else if (options.contains(Flag::stream) && (options.contains(Flag::pipeline) || options.contains(Flag::show)
+            || !options.fov.empty() || !options.container.empty() || !options.cache.empty() || options.backend != Backend::cpu
+            || options.pyramid != 1 || !options.serve.empty() || !options.video.empty() || !options.autotune.empty())) {
+        help(program_name, "--stream segments image files on the CPU; it cannot be combined with -p, -s, --fov, --container, --cache,\n"
+            "--backend, --pyramid, --serve, --video, or --autotune");
+        result = -1;
+    } else if (options.contains(Flag::stream) && options.output_format != OutputFormat::mask && options.output_format != OutputFormat::bits) {
+        help(program_name, "--stream writes masks or bits only");
+        result = -1;
+    } else if (!options.autotune.empty() && (options.backend != Backend::cpu || options.tile_size != 0 || !options.video.empty())) {
+        help(program_name, "--autotune picks the backend and tile size; it cannot be combined with --backend, --tile, or --video");
+        result = -1;
+    } else if (!options.autotune_file.empty() && options.autotune.empty()) {
+        help(program_name, "--autotune-file needs --autotune");
+        result = -1;
+    } else if (!options.serve.empty() && (options.contains(Flag::show) || options.contains(Flag::pipeline))) {
+        help(program_name, "--serve cannot be combined with -s or -p");
+        result = -1;
+    } else if (!options.serve.empty() && !options.fov.empty() && options.fov != "auto") {
+        help(program_name, "--serve supports --fov auto only, requests carry no mask file");
+        result = -1;
+    } else if (!options.input_dir.empty() && !std::filesystem::is_directory(options.input_dir)) {
+        help(program_name, "--input-dir '" + options.input_dir + "' is not a directory");
+        result = -1;
+    } else if (!options.serve.empty() && (!options.container.empty() || !options.cache.empty())) {
+        help(program_name, "--serve replies to clients, it cannot write a --container or use a --cache");
+        result = -1;
+    } else if (!options.input_dir.empty() && options.container.empty() && !std::filesystem::is_directory(options.output_dir)) {
+        help(program_name, "--input-dir needs an existing --output-dir, got '" + options.output_dir + "'");
+        result = -1;
+    }
+
     return std::make_tuple(options, image_files, result, program_name);
 }
 
 
+/// @brief Set the kernels, backend, and tile size of `options` to those tuned on `options.autotune`
+/// @note Settings tuned earlier for this host, -j, sample size, and pipeline parameters are reused from the
+///       profile file; otherwise they are tuned now and stored.
+/// @return Error message, empty on success
+std::string apply_autotune(Options& options) {
+    auto const sample = cv::imread(options.autotune);
+    if (sample.empty()) return "cannot read autotune sample " + options.autotune;
+    ExtractArteries ex;
+    configure(options, ex, nullptr);
+    TuneProfile const profile(options.autotune_file.empty() ? TuneProfile::default_path() : std::filesystem::path(options.autotune_file));
+    auto const key = TuneProfile::key(ex, sample.size(), options.jobs);
+    auto settings = profile.find(key);
+    if (settings) {
+        log_message(options.log_format, LogLevel::info, "autotune: reusing " + to_string(*settings));
+    } else {
+        settings = autotune(ex, sample);
+        log_message(options.log_format, LogLevel::info, "autotune: picked " + to_string(*settings));
+        // a profile that cannot be written only costs tuning again next time
+        if (!profile.store(key, *settings)) {
+            log_message(options.log_format, LogLevel::warning, "autotune: cannot write the profile, choice not kept");
+        }
+    }
+    options.kernels = settings->kernels;
+    options.backend = settings->backend;
+    options.tile_size = settings->tile_size;
+    return "";
+}
+
 int main(int argc, char* argv[]) {
     auto [options, image_files, result, program_name] = parse_args(argc, argv);
     
@@ -297,14 +1137,112 @@ int main(int argc, char* argv[]) {
     }
 
     if (result==0) {
-        auto ex = ExtractArteries( options.contains(Flag::show) );
+        // OpenCV keeps one pool for the process: while one worker's parallel_for_ runs on it, those of the
+        // others run serially on their own threads, and the pool threads are not pinned, so they touch a
+        // worker's node-local buffers from any socket. More than one inner thread pays only when -j is
+        // well below the core count.
+        cv::setNumThreads(options.inner_threads);
+        // threads inherit the affinity of their creator, so start the pool before any worker is pinned
+        cv::parallel_for_(cv::Range(0, options.inner_threads), [](cv::Range const&) {});
+        std::unique_ptr<Metrics> metrics;
+        std::unique_ptr<MetricsEndpoint> endpoint;
+        Metrics::Gauge workers;
+        if (!options.metrics_listen.empty() || !options.metrics_file.empty()) {
+            metrics = std::make_unique<Metrics>();
+            workers = metrics->gauge("vessel_workers", "Workers segmenting images or requests",
+                [jobs = options.jobs]() { return double(jobs); });
+        }
+        if (!options.metrics_listen.empty()) {
+            endpoint = std::make_unique<MetricsEndpoint>(*metrics);
+            auto const error = endpoint->start(options.metrics_listen);
+            if (!error.empty()) {
+                log_message(options.log_format, LogLevel::error, "cannot serve metrics on " + error);
+                return 1;
+            }
+        }
+        if (!options.autotune.empty()) {
+            auto const error = apply_autotune(options);
+            if (!error.empty()) {
+                log_message(options.log_format, LogLevel::error, error);
+                return 1;
+            }
+        }
+        std::unique_ptr<PairSource> pairs;
+        if (!options.manifest.empty()) {
+            auto manifest = std::make_unique<ManifestPairs>(options.manifest);
+            if (!manifest->is_open()) {
+                log_message(options.log_format, LogLevel::error, "cannot open manifest " + options.manifest);
+                return 1;
+            }
+            pairs = std::move(manifest);
+        } else if (!options.input_dir.empty()) {
+            pairs = std::make_unique<DirectoryPairs>(options.input_dir, options.output_dir, options.name_template);
+        } else {
+            pairs = std::make_unique<ArgumentPairs>(std::move(image_files));
+        }
 
-        for (int i=0; i<image_files.size(); i+=2) {
-            result = process_image(program_name, ex, image_files.at(i), image_files.at(i+1) );
-            if (result != 0) {
-                break;
+        Profiler profile;
+        auto* profiler = (options.profile != ProfileFormat::none) ? &profile : nullptr;
+        ResultLog log(options.log_format, metrics.get());
+        if (!options.serve.empty()) {
+            auto const error = process_server(options, log, profiler, metrics.get());
+            if (!error.empty()) {
+                log_message(options.log_format, LogLevel::error, "cannot serve " + error);
+                return 1;
+            }
+        } else if (!options.video.empty()) {
+            auto const error = process_video(options, log, profiler, metrics.get());
+            if (!error.empty()) {
+                log_message(options.log_format, LogLevel::error, error);
+                result = 1;
+            }
+        } else {
+            std::unique_ptr<ContainerWriter> container;
+            if (!options.container.empty()) {
+                container = std::make_unique<ContainerWriter>(options.container);
+                if (!container->error().empty()) {
+                    log_message(options.log_format, LogLevel::error, "cannot create container " + container->error());
+                    return 1;
+                }
+            }
+            std::unique_ptr<ResultCache> cache;
+            if (!options.cache.empty()) {
+                ExtractArteries ex;
+                configure(options, ex, nullptr);
+                auto const fov = options.fov.empty() ? "none" : (options.fov == "auto") ? "auto" : "file";
+                cache = std::make_unique<ResultCache>(options.cache, uint64_t(options.cache_size) << 20,
+                    ex.parameters() + " fov=" + fov);
+                if (!cache->error().empty()) {
+                    log_message(options.log_format, LogLevel::error, "cannot open cache " + cache->error());
+                    return 1;
+                }
+            }
+            Stores const stores{container.get(), cache.get()};
+            if (options.contains(Flag::pipeline)) {
+                process_pipeline(options, *pairs, log, stores, profiler, metrics.get());
+            } else {
+                process_batch(options, *pairs, log, stores, profiler, metrics.get());
             }
+            if (auto const error = pairs->error(); !error.empty()) {
+                log_message(options.log_format, LogLevel::error, error);
+                result = 1;
+            }
+            if (container && !container->close()) {
+                log_message(options.log_format, LogLevel::error, "cannot write container " + options.container + ": " + container->error());
+                result = 1;
+            }
+        }
+        profile.add(Counter::images, log.images());
+        profile.add(Counter::failures, log.failures());
+        if (log.failures()) result = 1;
+        if (metrics && !options.metrics_file.empty() && !metrics->write_file(options.metrics_file)) {
+            log_message(options.log_format, LogLevel::error, "cannot write metrics to " + options.metrics_file);
+            result = 1;
         }
+        // STDOUT carries the replies when serving on it
+        auto& report = (options.serve == "-") ? std::cerr : std::cout;
+        if (options.profile == ProfileFormat::table) profile.print_table(report);
+        if (options.profile == ProfileFormat::json) profile.print_json(report);
     }
 
     return result;
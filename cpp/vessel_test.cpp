@@ -0,0 +1,595 @@
+/// vessel_test.cpp
+/// Purpose: Check the optimized paths of `ExtractArteries` against the reference ones, pixel for pixel.
+///
+/// Usage: vessel_test [<case>...]
+/// Runs the named cases, or every case. Each compares a fast path with the computation it replaces on the
+/// DRIVE test images, decoded from the repo's drive/DRIVE/test/images, and on random frames of odd sizes.
+/// Exits non-zero if any case fails; mismatches are reported on STDERR.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "clahe.hpp"
+#include "extract_arteries.hpp"
+#include "image_io.hpp"
+#include "median.hpp"
+#include "morphology.hpp"
+#include "profiler.hpp"
+
+namespace {
+
+/// @brief Every .tif of the DRIVE test images, sorted by name
+std::vector<std::filesystem::path> const& drive_paths() {
+    static std::vector<std::filesystem::path> const paths = [] {
+        std::vector<std::filesystem::path> found;
+        std::error_code ec;
+        for (auto const& entry : std::filesystem::directory_iterator(VESSEL_DRIVE_DIR, ec)) {
+            if (entry.path().extension() == ".tif") found.push_back(entry.path());
+        }
+        std::sort(found.begin(), found.end());
+        return found;
+    }();
+    return paths;
+}
+
+/// @brief Decode every .tif of the DRIVE test images, sorted by name
+std::vector<cv::Mat> const& drive_images() {
+    static std::vector<cv::Mat> const images = [] {
+        std::vector<cv::Mat> decoded;
+        for (auto const& path : drive_paths()) {
+            auto image = cv::imread(path.string());
+            if (!image.empty()) decoded.push_back(image);
+        }
+        if (decoded.empty()) std::cerr << "no images could be read from " << VESSEL_DRIVE_DIR << "\n";
+        return decoded;
+    }();
+    return images;
+}
+
+/// @brief Frames for the whole-pipeline cases: the DRIVE images, and crops of the first of odd sizes
+std::vector<cv::Mat> const& pipeline_frames() {
+    static std::vector<cv::Mat> const frames = [] {
+        auto frames = drive_images();
+        if (frames.empty()) return frames;
+        for (cv::Size size : {cv::Size(97, 131), cv::Size(301, 257), cv::Size(523, 211)}) {
+            frames.push_back(frames.front()(cv::Rect(cv::Point(13, 29), size)).clone());
+        }
+        return frames;
+    }();
+    return frames;
+}
+
+/// @brief Name of the `index`th of `pipeline_frames()` in mismatch reports
+std::string frame_label(size_t index) {
+    auto const size = pipeline_frames()[index].size();
+    return "frame " + std::to_string(index) + " (" + std::to_string(size.width) + "x" + std::to_string(size.height) + ")";
+}
+
+/// @brief Sizes of the random frames: odd, prime, narrower and shorter than the largest structuring element
+std::vector<cv::Size> const& random_sizes() {
+    static std::vector<cv::Size> const sizes{{1, 1}, {7, 5}, {23, 37}, {64, 101}, {131, 257}, {509, 383}};
+    return sizes;
+}
+
+/// @brief Uniform noise over smooth shading, so that both the morphology and Otsu's level have work to do
+cv::Mat random_image(cv::Size size, int type, cv::RNG& rng) {
+    cv::Mat noise(size, type);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat shading(size, type);
+    for (int y = 0; y < size.height; y++) {
+        auto* row = shading.ptr<uint8_t>(y);
+        for (int x = 0; x < size.width * shading.channels(); x++) row[x] = cv::saturate_cast<uint8_t>(x / 4 + y / 3);
+    }
+    cv::Mat image;
+    cv::addWeighted(noise, 0.5, shading, 0.5, 0, image);
+    return image;
+}
+
+/// @brief Number of pixels, over every channel, where `a` and `b` differ; the largest `size_t` if their geometry does
+size_t differences(cv::Mat const& a, cv::Mat const& b) {
+    if (a.size() != b.size() || a.type() != b.type()) return std::numeric_limits<size_t>::max();
+    cv::Mat diff;
+    cv::absdiff(a, b, diff);
+    return cv::countNonZero(diff.reshape(1));
+}
+
+/// @brief Whether `actual` equals `expected`; a mismatch is reported as `what`
+bool expect_equal(cv::Mat const& actual, cv::Mat const& expected, std::string const& what) {
+    auto const n = differences(actual, expected);
+    if (n == std::numeric_limits<size_t>::max()) {
+        std::cerr << what << ": " << actual.size() << " type " << actual.type() << " instead of "
+            << expected.size() << " type " << expected.type() << "\n";
+    } else if (n) {
+        std::cerr << what << ": " << n << " of " << expected.total() * expected.channels() << " values differ\n";
+    }
+    return !n;
+}
+
+/// @brief Whether the histogram `actual` equals `expected`; a mismatch is reported as `what`
+bool expect_equal(std::array<int, 256> const& actual, std::array<int, 256> const& expected, std::string const& what) {
+    auto const bins = std::count_if(actual.begin(), actual.end(), [&, i = 0](int n) mutable { return n != expected[i++]; });
+    if (bins) std::cerr << what << ": " << bins << " histogram bins differ\n";
+    return !bins;
+}
+
+/// @brief 256-bin histogram of a CV_8UC1 image through `cv::calcHist`, of the pixels where `mask` is non-zero if given
+std::array<int, 256> histogram_reference(cv::Mat const& image, cv::Mat const& mask = cv::Mat()) {
+    int const channels[] = {0};
+    int const bins[] = {256};
+    float const range[] = {0, 256};
+    float const* ranges[] = {range};
+    cv::Mat hist;
+    cv::calcHist(&image, 1, channels, mask, hist, 1, bins, ranges);
+    std::array<int, 256> counts{};
+    for (int i = 0; i < 256; i++) counts[i] = cvRound(hist.at<float>(i));
+    return counts;
+}
+
+/// @brief Name of the `index`th DRIVE image in mismatch reports
+std::string drive_label(size_t index) { return "DRIVE image " + std::to_string(index); }
+
+/// @brief Name of a random frame in mismatch reports
+std::string random_label(cv::Size size, int channels) {
+    return "random " + std::to_string(size.width) + "x" + std::to_string(size.height) + "x" + std::to_string(channels);
+}
+
+/// @brief Open then close with each square element of `radii`, through `cv::morphologyEx`
+cv::Mat open_close_reference(cv::Mat const& image, std::vector<int> const& radii) {
+    cv::Mat close = image.clone(), open;
+    for (auto radius : radii) {
+        auto const se = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2*radius + 1, 2*radius + 1));
+        cv::morphologyEx(close, open, cv::MORPH_OPEN, se);
+        cv::morphologyEx(open, close, cv::MORPH_CLOSE, se);
+    }
+    return close;
+}
+
+/// @brief The van Herk cascade, generic and specialized, against `cv::morphologyEx`, and `large_arteries()`
+///        against `large_arteries_reference()` on the DRIVE images
+bool test_cascade() {
+    bool ok = true;
+    std::vector<int> const radii{default_morph_sizes.begin(), default_morph_sizes.end()};
+    AlternatingSequentialFilter generic{radii};
+    SpecializedAlternatingSequentialFilter<default_morph_sizes> specialized{radii};
+    AlternatingSequentialFilter other{{1, 4, 9}};
+    cv::RNG rng(3);
+    for (auto size : random_sizes()) {
+        for (int channels : {1, 3}) {
+            auto const image = random_image(size, CV_8UC(channels), rng);
+            auto const expected = open_close_reference(image, radii);
+            cv::Mat actual;
+            generic.apply(image, actual);
+            ok &= expect_equal(actual, expected, random_label(size, channels) + ", generic cascade");
+            specialized.apply(image, actual);
+            ok &= expect_equal(actual, expected, random_label(size, channels) + ", specialized cascade");
+            other.apply(image, actual);
+            ok &= expect_equal(actual, open_close_reference(image, {1, 4, 9}), random_label(size, channels) + ", radii 1, 4, 9");
+        }
+    }
+
+    ExtractArteries ex;
+    auto const& images = drive_images();
+    for (size_t i = 0; i < images.size(); i++) {
+        auto const filtered = ex.color_filter(images[i]).clone();
+        // both return the same CLAHE buffer, so the first result is copied out
+        auto const actual = ex.large_arteries(filtered).clone();
+        ok &= expect_equal(actual, ex.large_arteries_reference(filtered), drive_label(i) + ", large_arteries");
+    }
+    return ok && !images.empty();
+}
+
+/// @brief `apply_subtract()` against `apply()` then `cv::subtract()`, over the whole frame and over rectangles
+///        touching each edge, with the source itself or noise as the subtrahend
+bool test_apply_subtract() {
+    bool ok = true;
+    std::vector<int> const radii{default_morph_sizes.begin(), default_morph_sizes.end()};
+    AlternatingSequentialFilter generic{radii};
+    SpecializedAlternatingSequentialFilter<default_morph_sizes> specialized{radii};
+    cv::RNG rng(25);
+    auto check = [&](cv::Mat const& image, std::string const& label) {
+        cv::Mat filtered;
+        generic.apply(image, filtered);
+        int const w = image.cols, h = image.rows;
+        std::vector<cv::Rect> const rois{
+            {0, 0, w, h}, {0, 0, (w + 1) / 2, (h + 1) / 2}, {w / 2, h / 2, w - w / 2, h - h / 2},
+            {w / 3, 0, std::max(w / 3, 1), h}, {0, h / 4, w, std::max(h / 3, 1)}, {w - 1, h - 1, 1, 1},
+        };
+        for (auto const& roi : rois) {
+            cv::Mat noise(roi.size(), image.type());
+            rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+            for (bool source : {true, false}) {
+                cv::Mat const part = source ? image(roi) : noise;
+                cv::Mat expected, actual;
+                cv::subtract(filtered(roi), part, expected);
+                auto const what = label + ", " + (source ? "source" : "noise") + " subtracted in "
+                    + std::to_string(roi.width) + "x" + std::to_string(roi.height) + " at " + std::to_string(roi.x) + "," + std::to_string(roi.y);
+                generic.apply_subtract(image, roi, part, actual);
+                ok &= expect_equal(actual, expected, what + ", generic");
+                specialized.apply_subtract(image, roi, part, actual);
+                ok &= expect_equal(actual, expected, what + ", specialized");
+            }
+        }
+    };
+    for (auto size : random_sizes()) {
+        for (int channels : {1, 3}) check(random_image(size, CV_8UC(channels), rng), random_label(size, channels));
+    }
+    ExtractArteries ex;
+    auto const& images = drive_images();
+    for (size_t i = 0; i < images.size(); i++) check(ex.color_filter(images[i]).clone(), drive_label(i));
+    return ok && !images.empty();
+}
+
+/// @brief `FusedMedian` against `cv::medianBlur` and `cv::calcHist`, whole, inside a field of view, and by tiles
+bool test_fused_median() {
+    bool ok = true;
+    FusedMedian median;
+    cv::RNG rng(12);
+    auto check = [&](cv::Mat const& image, std::string const& label) {
+        cv::Mat expected;
+        cv::medianBlur(image, expected, 3);
+        cv::Mat noise(image.size(), CV_8UC1), fov;
+        rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+        cv::threshold(noise, fov, 64, 255, cv::THRESH_BINARY);
+
+        cv::Mat actual;
+        std::array<int, 256> hist;
+        median.apply(image, actual, cv::Mat(), hist);
+        ok &= expect_equal(actual, expected, label + ", median");
+        ok &= expect_equal(hist, histogram_reference(expected), label + ", histogram");
+        median.apply(image, actual, fov, hist);
+        ok &= expect_equal(actual, expected, label + ", median with a field of view");
+        ok &= expect_equal(hist, histogram_reference(expected, fov), label + ", histogram inside the field of view");
+
+        // tiles that do not divide the frame, each reading its neighbours' pixels
+        for (int tile : {1, 2, 17, 64}) {
+            cv::Mat tiled(image.size(), CV_8UC1);
+            std::array<int, 256> total{};
+            for (int y = 0; y < image.rows; y += tile) {
+                for (int x = 0; x < image.cols; x += tile) {
+                    cv::Rect const roi(x, y, std::min(tile, image.cols - x), std::min(tile, image.rows - y));
+                    cv::Mat dst = tiled(roi);
+                    median.apply(image, roi, dst, fov, hist);
+                    for (int i = 0; i < 256; i++) total[i] += hist[i];
+                }
+            }
+            ok &= expect_equal(tiled, expected, label + ", median by " + std::to_string(tile) + " pixel tiles");
+            ok &= expect_equal(total, histogram_reference(expected, fov), label + ", histogram by " + std::to_string(tile) + " pixel tiles");
+        }
+    };
+    for (auto size : random_sizes()) check(random_image(size, CV_8UC1, rng), random_label(size, 1));
+
+    ExtractArteries ex;
+    auto const& images = drive_images();
+    for (size_t i = 0; i < images.size(); i++) check(ex.large_arteries(ex.color_filter(images[i])).clone(), drive_label(i));
+    return ok && !images.empty();
+}
+
+/// @brief `extract()` on tiles of several sizes against `extract()` on whole frames, with and without a field of view
+bool test_tiled() {
+    bool ok = true;
+    ExtractArteries plain, tiled;
+    auto const& frames = pipeline_frames();
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto const fov = ExtractArteries::detect_fov(frames[i]);
+        cv::Mat expected, expected_fov, actual;
+        plain.extract(frames[i], expected);
+        plain.extract(frames[i], expected_fov, fov);
+        // sides that divide none of the frames, so every frame has partial tiles at its right and bottom
+        for (int tile : {61, 128, 200, 333}) {
+            tiled.set_tile_size(tile);
+            tiled.extract(frames[i], actual);
+            ok &= expect_equal(actual, expected, frame_label(i) + ", " + std::to_string(tile) + " pixel tiles");
+            tiled.extract(frames[i], actual, fov);
+            ok &= expect_equal(actual, expected_fov, frame_label(i) + ", " + std::to_string(tile) + " pixel tiles with a field of view");
+        }
+    }
+    return ok && !frames.empty();
+}
+
+/// @brief `extract()` with each of the 8 `StageKernels` combinations against the defaults, with and without a field of view
+bool test_kernels() {
+    bool ok = true;
+    ExtractArteries defaults, chosen;
+    auto const& frames = pipeline_frames();
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto const fov = ExtractArteries::detect_fov(frames[i]);
+        cv::Mat expected, expected_fov, actual;
+        defaults.extract(frames[i], expected);
+        defaults.extract(frames[i], expected_fov, fov);
+        for (auto morphology : {MorphologyKernel::van_herk, MorphologyKernel::opencv}) {
+            for (auto median : {MedianKernel::fused, MedianKernel::opencv}) {
+                for (auto blobs : {BlobKernel::labeling, BlobKernel::stats}) {
+                    chosen.set_kernels(StageKernels{morphology, median, blobs});
+                    auto const label = frame_label(i) + ", kernels " + morphology_kernel_name(morphology) + "/"
+                        + median_kernel_name(median) + "/" + blob_kernel_name(blobs);
+                    chosen.extract(frames[i], actual);
+                    ok &= expect_equal(actual, expected, label);
+                    chosen.extract(frames[i], actual, fov);
+                    ok &= expect_equal(actual, expected_fov, label + " with a field of view");
+                }
+            }
+        }
+    }
+    return ok && !frames.empty();
+}
+
+/// @brief `extract_batch()` with images stacked through the cascade against `extract()` of each image
+/// @note Batches mix runs of one size, full and odd, with sizes that break a stack early. Every stage must
+///       also get one profiler sample per image, whether it ran on the stack or image by image.
+bool test_stacked() {
+    bool ok = true;
+    ExtractArteries plain, stacked;
+    auto const& frames = pipeline_frames();
+    auto const& images = drive_images();
+    std::vector<cv::Mat> batch(images.begin(), images.end());
+    for (size_t i = 0; i < images.size(); i++) {
+        // odd-size crops, each run broken by a frame of another size
+        batch.push_back(images[i](cv::Rect(3, 5, 301, 257)).clone());
+        if (i % 7 == 6) batch.push_back(frames.back());
+    }
+    std::vector<cv::Mat> expected(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) plain.extract(batch[i], expected[i]);
+
+    for (int micro : {2, 3, 8}) {
+        Profiler profiler;
+        stacked.set_micro_batch(micro);
+        stacked.set_profiler(&profiler);
+        std::vector<cv::Mat> results(batch.size());
+        stacked.extract_batch(batch, results);
+        stacked.set_profiler(nullptr);
+        for (size_t i = 0; i < batch.size(); i++) {
+            ok &= expect_equal(results[i], expected[i], "image " + std::to_string(i) + " of the batch, stacks of " + std::to_string(micro));
+        }
+        for (auto stage : {Stage::extract, Stage::color_filter, Stage::large_arteries, Stage::median,
+                           Stage::threshold, Stage::remove_blobs, Stage::final_median}) {
+            auto const count = profiler.summary(stage).count;
+            if (count != batch.size()) {
+                std::cerr << "stacks of " << micro << ": " << count << " " << stage_name(stage) << " samples for "
+                          << batch.size() << " images\n";
+                ok = false;
+            }
+        }
+    }
+    return ok && !images.empty();
+}
+
+/// @brief `RowSink` that keeps the rows in memory
+class MatRowSink : public RowSink {
+public:
+    bool write(cv::Mat const& rows) override {
+        mask.push_back(rows);
+        return true;
+    }
+
+    bool close() override { return true; }
+
+    std::string const& error() const override { return error_; }
+
+    cv::Mat mask;
+
+private:
+    std::string error_;
+};
+
+/// @brief `extract_stream()` against `extract()`, for bands thinner than the cascade halo up to the whole frame
+bool test_stream() {
+    bool ok = true;
+    ExtractArteries plain, streamed;
+    auto const& frames = pipeline_frames();
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto const expected = plain.extract(frames[i]);
+        // source reads that do not line up with the bands
+        for (auto [band, rows] : {std::pair{17, 13}, std::pair{64, 100}, std::pair{256, 7}, std::pair{1024, 1024}}) {
+            DecodedRowSource source(frames[i], rows);
+            MatRowSink sink;
+            auto const label = frame_label(i) + ", bands of " + std::to_string(band) + " rows read " + std::to_string(rows) + " at a time";
+            auto const error = streamed.extract_stream(source, sink, StreamConfig{band, ""});
+            if (!error.empty()) {
+                std::cerr << label << ": " << error << "\n";
+                ok = false;
+                continue;
+            }
+            ok &= expect_equal(sink.mask, expected, label);
+        }
+    }
+    return ok && !frames.empty();
+}
+
+/// @brief `extract_stream()` of the DRIVE files through `open_row_source()` against `extract()` of the decoded image
+/// @note With libtiff, the files must stream through `TiffRowSource`: reads of fewer rows than their strips
+///       of four take the scanline path, the others whole strips.
+bool test_stream_tiff() {
+    bool ok = true;
+    ExtractArteries plain, streamed;
+    auto const& paths = drive_paths();
+    for (auto const& path : paths) {
+        auto const expected = plain.extract(cv::imread(path.string()));
+        for (auto [band, rows] : {std::pair{17, 3}, std::pair{64, 4}, std::pair{256, 100}}) {
+            auto const label = path.filename().string() + ", bands of " + std::to_string(band) + " rows read "
+                + std::to_string(rows) + " at a time";
+            std::string error;
+            auto source = open_row_source(path.string(), rows, error);
+            if (!source) {
+                std::cerr << label << ": " << error << "\n";
+                ok = false;
+                continue;
+            }
+#ifdef VESSEL_HAVE_TIFF
+            if (!dynamic_cast<TiffRowSource*>(source.get())) {
+                std::cerr << label << ": not streamed by TiffRowSource\n";
+                ok = false;
+            }
+#endif
+            MatRowSink sink;
+            error = streamed.extract_stream(*source, sink, StreamConfig{band, ""});
+            if (!error.empty()) {
+                std::cerr << label << ": " << error << "\n";
+                ok = false;
+                continue;
+            }
+            ok &= expect_equal(sink.mask, expected, label);
+        }
+    }
+    return ok && !paths.empty();
+}
+
+/// @brief `update_region()` after a series of edits against `extract()` of the edited frame
+/// @note Edits touch every edge and corner, are as small as a pixel or as wide as the frame, and include
+///       flat fills of a large part of the frame, which move Otsu's level so the whole-frame threshold path runs.
+bool test_update_region() {
+    bool ok = true;
+    ExtractArteries state_ex, plain;
+    cv::RNG rng(23);
+    auto const& frames = pipeline_frames();
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto frame = frames[i].clone();
+        int const w = frame.cols, h = frame.rows;
+        struct Edit {
+            cv::Rect rect;
+            /// Fill value, or -1 for noise
+            int fill;
+        };
+        std::vector<Edit> const edits{
+            {{0, 0, 1, 1}, -1},
+            {{w - 1, h - 1, 1, 1}, -1},
+            {{0, 0, std::min(40, w), std::min(30, h)}, -1},
+            {{std::max(w - 37, 0), 0, std::min(37, w), std::min(23, h)}, -1},
+            {{0, std::max(h - 19, 0), std::min(29, w), std::min(19, h)}, -1},
+            {{std::max(w - 51, 0), std::max(h - 43, 0), std::min(51, w), std::min(43, h)}, 0},
+            {{0, h / 2, w, std::min(7, h - h / 2)}, -1},
+            {{w / 3, h / 3, std::max(w / 5, 1), std::max(h / 5, 1)}, -1},
+            {{0, 0, w, h / 2}, 255},
+            {{w / 2, 0, w - w / 2, h}, 0},
+        };
+        SegmentationState state;
+        state_ex.extract_state(frame, state);
+        bool level_moved = false;
+        for (auto const& edit : edits) {
+            auto region = frame(edit.rect);
+            if (edit.fill < 0) {
+                rng.fill(region, cv::RNG::UNIFORM, 0, 256);
+            } else {
+                region.setTo(cv::Scalar::all(edit.fill));
+            }
+            int const level = state.level;
+            state_ex.update_region(frame, edit.rect, state);
+            level_moved |= state.level != level;
+            auto const label = frame_label(i) + ", edit of " + std::to_string(edit.rect.width) + "x" + std::to_string(edit.rect.height)
+                + " at " + std::to_string(edit.rect.x) + "," + std::to_string(edit.rect.y);
+            ok &= expect_equal(state.mask, plain.extract(frame), label);
+        }
+        if (!level_moved) {
+            std::cerr << frame_label(i) << ": no edit moved Otsu's level, the whole-frame threshold path was not checked\n";
+            ok = false;
+        }
+    }
+    return ok && !frames.empty();
+}
+
+/// @brief `ClaheLut::compute()` then `apply()` against `cv::CLAHE::apply()`, on sizes even and uneven to the 8x8 grid
+bool test_clahe_lut() {
+    bool ok = true;
+    cv::RNG rng(24);
+    ClaheLut lut;
+    auto check = [&](cv::Mat const& image, std::string const& label) {
+        for (double clip : {0.0, 3.0, 40.0}) {
+            auto clahe = cv::createCLAHE(clip);
+            cv::Mat expected, actual;
+            clahe->apply(image, expected);
+            lut.compute(image, clip);
+            lut.apply(image, actual);
+            ok &= expect_equal(actual, expected, label + ", clip limit " + std::to_string(clip));
+        }
+    };
+    for (cv::Size size : {cv::Size(8, 8), cv::Size(64, 64), cv::Size(23, 37), cv::Size(64, 101), cv::Size(136, 257), cv::Size(509, 383)}) {
+        check(random_image(size, CV_8UC1, rng), random_label(size, 1));
+    }
+    ExtractArteries ex;
+    auto const& frames = pipeline_frames();
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto const luminance = ex.color_filter(frames[i]).clone();
+        check(luminance, frame_label(i) + ", equalized luminance");
+        check(ex.large_arteries(luminance).clone(), frame_label(i) + ", background removed");
+    }
+    return ok && !frames.empty();
+}
+
+/// @brief `extract_frame()` against `extract()` on the frames whose estimates it refreshed, and on repeated
+///        frames, which the kept estimates map as a refresh would
+bool test_sequence() {
+    bool ok = true;
+    ExtractArteries sequence, plain;
+    auto const& frames = pipeline_frames();
+    for (int interval : {1, 3}) {
+        SequenceState state;
+        state.refresh_interval = interval;
+        cv::Mat actual;
+        for (size_t i = 0; i < frames.size(); i++) {
+            auto const expected = plain.extract(frames[i]);
+            for (int repeat = 0; repeat < 4; repeat++) {
+                bool const refreshed = sequence.extract_frame(frames[i], actual, state);
+                auto const label = frame_label(i) + ", repeat " + std::to_string(repeat) + " with refresh interval " + std::to_string(interval);
+                if (repeat == 0 && !refreshed) {
+                    std::cerr << label << ": a new frame was not refreshed\n";
+                    ok = false;
+                }
+                ok &= expect_equal(actual, expected, label);
+            }
+        }
+    }
+    return ok && !frames.empty();
+}
+
+struct TestCase {
+    char const* name;
+    std::function<bool()> run;
+};
+
+std::vector<TestCase> const& test_cases() {
+    static std::vector<TestCase> const cases{
+        {"cascade", test_cascade},
+        {"apply_subtract", test_apply_subtract},
+        {"fused_median", test_fused_median},
+        {"tiled", test_tiled},
+        {"stacked", test_stacked},
+        {"kernels", test_kernels},
+        {"update_region", test_update_region},
+        {"clahe_lut", test_clahe_lut},
+        {"sequence", test_sequence},
+        {"stream", test_stream},
+        {"stream_tiff", test_stream_tiff},
+    };
+    return cases;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> names(argv + 1, argv + argc);
+    if (names.empty()) {
+        for (auto const& test : test_cases()) names.push_back(test.name);
+    }
+    int failed = 0;
+    for (auto const& name : names) {
+        auto const test = std::find_if(test_cases().begin(), test_cases().end(), [&](TestCase const& t) { return name == t.name; });
+        if (test == test_cases().end()) {
+            std::cerr << "Error: unknown test " << name << "\n";
+            failed++;
+            continue;
+        }
+        bool const ok = test->run();
+        std::cout << (ok ? "pass " : "FAIL ") << name << std::endl;
+        failed += !ok;
+    }
+    return failed ? 1 : 0;
+}